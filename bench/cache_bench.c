@@ -0,0 +1,196 @@
+/*
+  cache_bench.c -- compares the hash indexed cache with the previous linked
+  list cache on insert, lookup and eviction of small objects.
+
+  Usage: ./bench/cache_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../headers/cache.h"
+#include "../headers/slab.h"
+
+#define OBJECT_SIZE 64
+#define LIST_BUDGET 100000000 //element visits allowed per list phase, the list is O(n) per lookup
+
+/* The linked list cache as it was before the hash index: lookups compare
+   every url and eviction scans the whole list for the oldest time. */
+
+typedef struct list_element list_element;
+
+struct list_element{
+    char* url;
+    char* data;
+    int len;
+    time_t time;
+    list_element* next;
+};
+
+static list_element* head;
+static long list_size;
+static pthread_mutex_t list_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static list_element* list_find(char* url){
+    list_element* ele=NULL;
+    pthread_mutex_lock(&list_mutex);
+    for(ele=head;ele!=NULL;ele=ele->next){
+        if(!strcmp(ele->url, url)){
+            ele->time=time(NULL);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&list_mutex);
+    return ele;
+}
+
+static void list_remove(){
+    list_element *p, *q, *temp;
+    pthread_mutex_lock(&list_mutex);
+    if(head!=NULL){
+        for(q=head, p=head, temp=head;q->next!=NULL;q=q->next){
+            if(((q->next)->time)<(temp->time)){
+                temp=q->next;
+                p=q;
+            }
+        }
+        if(temp==head)
+            head=head->next;
+        else
+            p->next=temp->next;
+        list_size-=temp->len+sizeof(list_element)+strlen(temp->url)+1;
+        free(temp->data);
+        free(temp->url);
+        free(temp);
+    }
+    pthread_mutex_unlock(&list_mutex);
+}
+
+static void list_add(char* data, int len, char* url){
+    pthread_mutex_lock(&list_mutex);
+    list_element* element=(list_element*)malloc(sizeof(list_element));
+    element->data=(char*)malloc(len+1);
+    memcpy(element->data, data, len+1);
+    element->url=(char*)malloc(strlen(url)+1);
+    strcpy(element->url, url);
+    element->len=len;
+    element->time=time(NULL);
+    element->next=head;
+    head=element;
+    list_size+=len+1+strlen(url)+sizeof(list_element);
+    pthread_mutex_unlock(&list_mutex);
+}
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static unsigned long long rng_state=88172645463325252ULL;
+
+static unsigned long long next_random(){
+    rng_state^=rng_state<<13;
+    rng_state^=rng_state>>7;
+    rng_state^=rng_state<<17;
+    return rng_state;
+}
+
+static void run(int entries){
+    char data[OBJECT_SIZE+1];
+    memset(data, 'x', OBJECT_SIZE);
+    data[OBJECT_SIZE]='\0';
+
+    char** keys=(char**)malloc(entries*sizeof(char*));
+    cache_key* cache_keys=(cache_key*)malloc(entries*sizeof(cache_key));
+    for(int i=0;i<entries;i++){
+        char key[64];
+        snprintf(key, sizeof(key), "GET\nbench.example.com\n80\n/object/%d", i);
+        keys[i]=strdup(key);
+        cache_keys[i].bytes=keys[i];
+        cache_keys[i].len=strlen(keys[i]);
+        cache_keys[i].hash=cache_hash(keys[i], cache_keys[i].len);
+        cache_keys[i].arena=NULL;
+    }
+
+    //the list only gets as many lookups and evictions as LIST_BUDGET allows
+    long list_ops=LIST_BUDGET/entries;
+    if(list_ops<100)
+        list_ops=100;
+    if(list_ops>entries)
+        list_ops=entries;
+    long hash_ops=entries;
+
+    double start, insert_ns, lookup_ns, evict_ns;
+    long hits=0;
+
+    start=now_ns();
+    for(int i=0;i<entries;i++)
+        list_add(data, OBJECT_SIZE, keys[i]);
+    insert_ns=(now_ns()-start)/entries;
+
+    start=now_ns();
+    for(long i=0;i<list_ops;i++)
+        hits+=list_find(keys[next_random()%entries])!=NULL;
+    lookup_ns=(now_ns()-start)/list_ops;
+
+    start=now_ns();
+    for(long i=0;i<list_ops;i++)
+        list_remove();
+    evict_ns=(now_ns()-start)/list_ops;
+    printf("%-10d %-6s %14.1f %14.1f %14.1f\n", entries, "list", insert_ns, lookup_ns, evict_ns);
+
+    while(head!=NULL){
+        list_element* next=head->next;
+        free(head->data);
+        free(head->url);
+        free(head);
+        head=next;
+    }
+    list_size=0;
+
+    start=now_ns();
+    for(int i=0;i<entries;i++)
+        add_cache_element(data, OBJECT_SIZE, &cache_keys[i]);
+    insert_ns=(now_ns()-start)/entries;
+
+    start=now_ns();
+    for(long i=0;i<hash_ops;i++){
+        cache_element* element=find(&cache_keys[next_random()%entries]);
+        if(element!=NULL){
+            hits++;
+            cache_element_release(element);
+        }
+    }
+    lookup_ns=(now_ns()-start)/hash_ops;
+
+    //evicting everything also leaves the cache empty for the next size
+    start=now_ns();
+    for(int i=0;i<entries;i++)
+        remove_cache_element();
+    evict_ns=(now_ns()-start)/entries;
+    printf("%-10d %-6s %14.1f %14.1f %14.1f\n", entries, "hash", insert_ns, lookup_ns, evict_ns);
+
+    if(hits==0)
+        printf("no hits\n");
+    for(int i=0;i<entries;i++)
+        free(keys[i]);
+    free(keys);
+    free(cache_keys);
+}
+
+int main(){
+    if(slab_init(MAX_SIZE, 0)!=0 || cache_init(CACHE_SHARDS, CACHE_POLICY_LRU)!=0){
+        perror("Cache initialisation failed");
+        return 1;
+    }
+    printf("%-10s %-6s %14s %14s %14s\n", "entries", "cache", "insert ns/op", "lookup ns/op", "evict ns/op");
+    int sizes[]={10000, 100000, 1000000};
+    for(int i=0;i<3;i++)
+        run(sizes[i]);
+
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+  policy_bench.c -- replays request traces through the cache under each
+  eviction policy and reports hit ratio and byte hit ratio.
+
+  The synthetic traces draw small objects from a Zipf popularity
+  distribution, once alone and once mixed with one-off large downloads,
+  the pattern that flushes popular objects out of a plain LRU. A trace
+  file holds one request per line, a key followed by the object size in
+  bytes.
+
+  Usage: ./bench/policy_bench [trace file]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../headers/cache.h"
+#include "../headers/slab.h"
+
+#define REQUESTS 1000000
+#define OBJECTS 100000 //distinct small objects, about 1.5 times what the cache holds
+#define ZIPF_SKEW 0.9
+#define SMALL_MIN 512
+#define SMALL_MAX (8*1024)
+#define DOWNLOAD_MIN (64*1024)
+#define DOWNLOAD_MAX (1024*1024)
+#define DOWNLOAD_PERCENT 1 //requests that are a download nobody asks for again
+#define WARMUP_PERCENT 10 //requests replayed before counting starts
+
+typedef struct request {
+    char* key;
+    int size;
+} request;
+
+static unsigned long long rng_state=88172645463325252ULL;
+
+static unsigned long long next_random(){
+    rng_state^=rng_state<<13;
+    rng_state^=rng_state>>7;
+    rng_state^=rng_state<<17;
+    return rng_state;
+}
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+//log-uniform in [min, max), so small sizes are as common as large ones per octave
+static int random_size(int min, int max){
+    double r=(double)(next_random()%1000000)/1000000;
+    return (int)(min*pow((double)max/min, r));
+}
+
+static char* object_key(const char* kind, long id){
+    char key[96];
+    snprintf(key, sizeof(key), "GET\ntrace.example.com\n80\n/%s/%ld", kind, id);
+    return strdup(key);
+}
+
+static request* synthetic_trace(int downloads, int* count){
+    request* trace=(request*)malloc(REQUESTS*sizeof(request));
+    double* cdf=(double*)malloc(OBJECTS*sizeof(double));
+    int* sizes=(int*)malloc(OBJECTS*sizeof(int));
+    double sum=0;
+    for(int i=0;i<OBJECTS;i++){
+        sum+=1.0/pow(i+1, ZIPF_SKEW);
+        cdf[i]=sum;
+        sizes[i]=random_size(SMALL_MIN, SMALL_MAX);
+    }
+
+    long download_id=0;
+    for(int i=0;i<REQUESTS;i++){
+        if(downloads && (int)(next_random()%100)<DOWNLOAD_PERCENT){
+            trace[i].key=object_key("download", download_id++);
+            trace[i].size=random_size(DOWNLOAD_MIN, DOWNLOAD_MAX);
+            continue;
+        }
+        //rank of the drawn popularity, by binary search of the cumulative weights
+        double r=(double)(next_random()%1000000000)/1000000000*sum;
+        int lo=0, hi=OBJECTS-1;
+        while(lo<hi){
+            int mid=(lo+hi)/2;
+            if(cdf[mid]<r)
+                lo=mid+1;
+            else
+                hi=mid;
+        }
+        trace[i].key=object_key("object", lo);
+        trace[i].size=sizes[lo];
+    }
+    free(cdf);
+    free(sizes);
+    *count=REQUESTS;
+    return trace;
+}
+
+static request* file_trace(const char* path, int* count){
+    FILE* file=fopen(path, "r");
+    if(file==NULL)
+        return NULL;
+    int cap=1024, n=0;
+    request* trace=(request*)malloc(cap*sizeof(request));
+    char key[4096];
+    int size;
+    while(fscanf(file, "%4095s %d", key, &size)==2){
+        if(n==cap){
+            cap*=2;
+            trace=(request*)realloc(trace, cap*sizeof(request));
+        }
+        trace[n].key=strdup(key);
+        trace[n].size=size;
+        n++;
+    }
+    fclose(file);
+    *count=n;
+    return trace;
+}
+
+static void replay(const char* name, request* trace, int count, int policy, const char* policy_name, char* data){
+    if(cache_init(CACHE_SHARDS, policy)!=0){
+        perror("Cache initialisation failed");
+        exit(1);
+    }
+    long hits=0, requests=0;
+    long long hit_bytes=0, bytes=0;
+    int warmup=count*WARMUP_PERCENT/100;
+    double start=now_ns();
+    for(int i=0;i<count;i++){
+        cache_key key;
+        key.bytes=trace[i].key;
+        key.len=strlen(trace[i].key);
+        key.hash=cache_hash(key.bytes, key.len);
+        key.arena=NULL;
+
+        cache_element* element=find(&key);
+        if(element!=NULL)
+            cache_element_release(element);
+        else if(trace[i].size<=MAX_ELEMENT_SIZE)
+            add_cache_element(data, trace[i].size, &key);
+        if(i<warmup)
+            continue;
+        requests++;
+        bytes+=trace[i].size;
+        if(element!=NULL){
+            hits++;
+            hit_bytes+=trace[i].size;
+        }
+    }
+    double ns=(now_ns()-start)/count;
+    printf("%-20s %-8s %10.2f%% %14.2f%% %12.1f\n", name, policy_name, 100.0*hits/requests,
+        100.0*hit_bytes/bytes, ns);
+    cache_destroy();
+}
+
+static void run(const char* name, request* trace, int count, char* data){
+    replay(name, trace, count, CACHE_POLICY_LRU, "lru", data);
+    replay(name, trace, count, CACHE_POLICY_TINYLFU, "tinylfu", data);
+    for(int i=0;i<count;i++)
+        free(trace[i].key);
+    free(trace);
+}
+
+int main(int argc, char* argv[]){
+    char* data=(char*)calloc(MAX_ELEMENT_SIZE, 1);
+    if(data==NULL || slab_init(MAX_SIZE, 0)!=0)
+        return 1;
+    printf("%-20s %-8s %11s %15s %12s\n", "trace", "policy", "hit ratio", "byte hit ratio", "ns/request");
+
+    int count;
+    if(argc>1){
+        request* trace=file_trace(argv[1], &count);
+        if(trace==NULL){
+            perror("Cannot read trace");
+            return 1;
+        }
+        run(argv[1], trace, count, data);
+        return 0;
+    }
+    request* trace=synthetic_trace(0, &count);
+    run("zipf", trace, count, data);
+    trace=synthetic_trace(1, &count);
+    run("zipf+downloads", trace, count, data);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+  accept_queue.c -- bounded lock-free MPMC ring of accepted sockets.
+*/
+
+#include "accept_queue.h"
+
+#include <stdlib.h>
+
+int accept_queue_init(accept_queue* queue, size_t capacity){
+    size_t size=2;
+    while(size<capacity)
+        size<<=1;
+
+    queue->cells=(accept_queue_cell*)malloc(size*sizeof(accept_queue_cell));
+    if(queue->cells==NULL)
+        return -1;
+
+    //cell i is free for the producer whose position is i
+    for(size_t i=0;i<size;i++){
+        queue->cells[i].sequence=i;
+        queue->cells[i].fd=-1;
+    }
+    queue->mask=size-1;
+    queue->enqueue_pos=0;
+    queue->dequeue_pos=0;
+    return 0;
+}
+
+void accept_queue_destroy(accept_queue* queue){
+    free(queue->cells);
+    queue->cells=NULL;
+}
+
+int accept_queue_push(accept_queue* queue, int fd){
+    accept_queue_cell* cell;
+    size_t pos=__atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+
+    while(1){
+        cell=&queue->cells[pos & queue->mask];
+        size_t sequence=__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff=(long)sequence-(long)pos;
+
+        if(diff==0){
+            //cell is free for this lap, claim the position
+            if(__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }else if(diff<0){
+            return -1; //consumer has not released the cell yet, queue is full
+        }else{
+            pos=__atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->fd=fd;
+    __atomic_store_n(&cell->sequence, pos+1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int accept_queue_pop(accept_queue* queue, int* fd){
+    accept_queue_cell* cell;
+    size_t pos=__atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+
+    while(1){
+        cell=&queue->cells[pos & queue->mask];
+        size_t sequence=__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff=(long)sequence-(long)(pos+1);
+
+        if(diff==0){
+            //cell was filled for this lap, claim it
+            if(__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }else if(diff<0){
+            return -1; //producer has not filled the cell yet, queue is empty
+        }else{
+            pos=__atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *fd=cell->fd;
+    //hand the cell back to the producer of the next lap
+    __atomic_store_n(&cell->sequence, pos+queue->mask+1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+size_t accept_queue_size(accept_queue* queue){
+    size_t enqueue_pos=__atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    size_t dequeue_pos=__atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    return enqueue_pos>dequeue_pos ? enqueue_pos-dequeue_pos : 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * accept_queue.h -- bounded lock-free MPMC ring of accepted sockets.
+ *
+ * The acceptor pushes client descriptors and the workers pop them, either
+ * from their own queue or by stealing from a sibling. Every cell carries a
+ * sequence number that tells producers and consumers whether it is free or
+ * filled for the current lap, so neither side ever takes a lock.
+ */
+
+#include <stddef.h>
+
+#ifndef ACCEPT_QUEUE
+#define ACCEPT_QUEUE
+
+#define CACHE_LINE 64
+
+typedef struct accept_queue_cell {
+    size_t sequence;
+    int fd;
+} accept_queue_cell;
+
+typedef struct accept_queue {
+    accept_queue_cell* cells;
+    size_t mask; //capacity-1, capacity is a power of two
+    char pad0[CACHE_LINE];
+    size_t enqueue_pos; //written by producers only
+    char pad1[CACHE_LINE];
+    size_t dequeue_pos; //written by consumers only
+    char pad2[CACHE_LINE];
+} accept_queue;
+
+/* capacity is rounded up to a power of two. Returns 0 or -1 on error */
+int accept_queue_init(accept_queue* queue, size_t capacity);
+void accept_queue_destroy(accept_queue* queue);
+
+/* Returns 0, or -1 when the queue is full */
+int accept_queue_push(accept_queue* queue, int fd);
+
+/* Returns 0 and stores the descriptor in fd, or -1 when the queue is empty */
+int accept_queue_pop(accept_queue* queue, int* fd);
+
+/* Approximate number of queued sockets, exact when no push or pop is racing */
+size_t accept_queue_size(accept_queue* queue);
+
+#endif
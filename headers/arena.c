@@ -0,0 +1,84 @@
+/*
+  arena.c -- bump allocator for objects that live as long as one request.
+*/
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t align_up(size_t len){
+    return (len+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+}
+
+void arena_init(arena* a){
+    memset(a, 0, sizeof(*a));
+}
+
+//a new block for an allocation that does not fit, the link to the previous one takes its first bytes
+static int arena_grow(arena* a, size_t len){
+    size_t size=len>ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+    char* block=(char*)malloc(ARENA_ALIGN+size);
+    if(block==NULL)
+        return -1;
+    memcpy(block, &a->overflow, sizeof(char*));
+    a->overflow=block;
+    a->block=block+ARENA_ALIGN;
+    a->size=size;
+    a->used=0;
+    return 0;
+}
+
+void* arena_alloc(arena* a, size_t len){
+    len=align_up(len>0 ? len : 1);
+    if(a->base==NULL){
+        a->base=(char*)malloc(ARENA_BLOCK_SIZE);
+        if(a->base==NULL)
+            return NULL;
+        a->base_size=ARENA_BLOCK_SIZE;
+        a->block=a->base;
+        a->size=a->base_size;
+        a->used=0;
+    }
+    if(a->used+len>a->size && arena_grow(a, len)<0)
+        return NULL;
+    void* p=a->block+a->used;
+    a->used+=len;
+    a->requested+=len;
+    return p;
+}
+
+static void arena_free_overflow(arena* a){
+    while(a->overflow!=NULL){
+        char* next;
+        memcpy(&next, a->overflow, sizeof(char*));
+        free(a->overflow);
+        a->overflow=next;
+    }
+}
+
+void arena_reset(arena* a){
+    //a request that overflowed is likely to be followed by similar ones, size the first block for it
+    if(a->overflow!=NULL){
+        arena_free_overflow(a);
+        size_t size=a->requested<ARENA_MAX_BLOCK ? align_up(a->requested) : ARENA_MAX_BLOCK;
+        if(size>a->base_size){
+            char* base=(char*)malloc(size);
+            if(base!=NULL){
+                free(a->base);
+                a->base=base;
+                a->base_size=size;
+            }
+        }
+    }
+    a->block=a->base;
+    a->size=a->base_size;
+    a->used=0;
+    a->requested=0;
+}
+
+void arena_free(arena* a){
+    arena_free_overflow(a);
+    free(a->base);
+    arena_init(a);
+}
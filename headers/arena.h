@@ -0,0 +1,47 @@
+/*
+ * arena.h -- bump allocator for objects that live as long as one request.
+ *
+ * A connection owns one arena. Everything a request needs while it is
+ * served (the parsed request and its strings, the cache key, the request
+ * rebuilt for the origin) is carved out of it by moving a pointer, and all
+ * of it is released at once by arena_reset() when the response is done.
+ *
+ * The first block is kept across resets, so requests on a keep-alive
+ * connection reuse the same memory and never call malloc. A request that
+ * outgrows the block gets overflow blocks, and at the next reset the first
+ * block is resized to what that request needed, up to ARENA_MAX_BLOCK.
+ */
+
+#include <stddef.h>
+
+#ifndef ARENA
+#define ARENA
+
+#define ARENA_BLOCK_SIZE (16*1024) //first block, enough for a typical request
+#define ARENA_MAX_BLOCK (256*1024) //largest first block kept between requests
+#define ARENA_ALIGN 16
+
+typedef struct arena {
+    char* base; //first block, NULL until the first allocation
+    size_t base_size;
+    char* block; //block allocations come from, base or the newest overflow block
+    size_t size;
+    size_t used;
+    char* overflow; //blocks beyond the first, chained through their first bytes
+    size_t requested; //bytes handed out since the last reset
+} arena;
+
+/* Set up an empty arena, no memory is taken until the first allocation */
+void arena_init(arena* a);
+
+/* len bytes aligned to ARENA_ALIGN, valid until the next reset, NULL when
+ * out of memory */
+void* arena_alloc(arena* a, size_t len);
+
+/* Release everything allocated since the last reset, keeping the first block */
+void arena_reset(arena* a);
+
+/* Release all memory of the arena */
+void arena_free(arena* a);
+
+#endif
@@ -0,0 +1,882 @@
+/*
+  cache.c -- in-memory response cache shared by all workers.
+*/
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "http_response.h"
+#include "encoding.h"
+#include "freshness.h"
+#include "sketch.h"
+#include "slab.h"
+
+typedef struct cache_slot {
+    uint64_t hash;
+    cache_element* element; //NULL marks an empty slot
+} cache_slot;
+
+//regions of a shard, each an LRU list. Plain LRU keeps every element in the window
+#define REGION_WINDOW 0 //W-TinyLFU admission window, the only list under plain LRU
+#define REGION_PROBATION 1 //main region, admitted from the window and not used since
+#define REGION_PROTECTED 2 //main region, used again while on probation
+#define REGIONS 3
+
+typedef struct cache_list {
+    cache_element* head; //most recently used
+    cache_element* tail; //least recently used, evicted first
+    size_t size; //bytes of the elements on the list
+} cache_list;
+
+//one independently locked slice of the cache, padded so shard locks never share a cache line
+typedef struct cache_shard {
+    pthread_mutex_t mutex; //Lock for cache_element access within the shard
+    cache_slot* table;
+    size_t table_mask; //number of slots-1, a power of two
+    size_t table_used;
+
+    cache_list lists[REGIONS];
+    size_t cache_element_size; //bytes accounted to stored elements
+    size_t budget; //this shard's share of MAX_SIZE
+    size_t window_budget; //W-TinyLFU: bytes the window may hold, the rest is the main region
+    size_t protected_budget; //W-TinyLFU: bytes of the main region kept for elements used again
+    frequency_sketch sketch; //W-TinyLFU: recent accesses to every key looked up in the shard
+
+    //contention counters, updated with the lock held
+    unsigned long acquisitions;
+    unsigned long contended; //acquisitions that found the lock taken
+    unsigned long long wait_ns; //time spent waiting for the lock
+} __attribute__((aligned(64))) cache_shard;
+
+static cache_shard* shards;
+static int num_shards;
+static int policy;
+static uint64_t next_element_id;
+
+static int cache_reclaim(size_t size);
+static void (*demote_hook)(cache_element* element);
+
+uint64_t cache_hash(const char* key, size_t len){
+    const uint64_t m=0xc6a4a7935bd1e995ULL;
+    uint64_t h=0x9e3779b97f4a7c15ULL ^ (len*m);
+    const unsigned char* p=(const unsigned char*)key;
+
+    //eight bytes at a time, then the tail
+    while(len>=8){
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k*=m;
+        k^=k>>47;
+        k*=m;
+        h^=k;
+        h*=m;
+        p+=8;
+        len-=8;
+    }
+    uint64_t tail=0;
+    for(size_t i=0;i<len;i++)
+        tail|=(uint64_t)p[i]<<(8*i);
+    h^=tail;
+    h*=m;
+
+    h^=h>>47;
+    h*=m;
+    h^=h>>47;
+    return h;
+}
+
+static unsigned long long monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+int cache_init(int shard_count, int cache_policy){
+    if(shard_count<1)
+        shard_count=CACHE_SHARDS;
+    policy=cache_policy;
+
+    shards=(cache_shard*)aligned_alloc(64, shard_count*sizeof(cache_shard));
+    if(shards==NULL)
+        return -1;
+    memset(shards, 0, shard_count*sizeof(cache_shard));
+
+    for(int i=0;i<shard_count;i++){
+        cache_shard* shard=&shards[i];
+        if(pthread_mutex_init(&shard->mutex, NULL)!=0)
+            return -1;
+        shard->table=(cache_slot*)calloc(CACHE_TABLE_SIZE, sizeof(cache_slot));
+        if(shard->table==NULL)
+            return -1;
+        shard->table_mask=CACHE_TABLE_SIZE-1;
+        shard->budget=(size_t)(MAX_SIZE)/100*(100-CACHE_SLAB_RESERVE_PERCENT)/shard_count;
+        if(policy==CACHE_POLICY_TINYLFU){
+            shard->window_budget=shard->budget*TINYLFU_WINDOW_PERCENT/100;
+            shard->protected_budget=(shard->budget-shard->window_budget)*TINYLFU_PROTECTED_PERCENT/100;
+            if(sketch_init(&shard->sketch, shard->budget/SKETCH_OBJECT_SIZE)<0)
+                return -1;
+        }
+    }
+    num_shards=shard_count;
+    slab_set_reclaim(cache_reclaim);
+    return 0;
+}
+
+int cache_policy_of(const char* name){
+    if(strcasecmp(name, "lru")==0)
+        return CACHE_POLICY_LRU;
+    if(strcasecmp(name, "tinylfu")==0 || strcasecmp(name, "w-tinylfu")==0)
+        return CACHE_POLICY_TINYLFU;
+    return -1;
+}
+
+//the low bits of the hash pick the table slot, the high bits pick the shard
+static cache_shard* shard_for(uint64_t hash){
+    return &shards[(hash>>32)%num_shards];
+}
+
+//take the shard lock, counting how often and how long we had to wait for it
+static void shard_lock(cache_shard* shard){
+    if(pthread_mutex_trylock(&shard->mutex)!=0){
+        unsigned long long start=monotonic_ns();
+        pthread_mutex_lock(&shard->mutex);
+        shard->contended++;
+        shard->wait_ns+=monotonic_ns()-start;
+    }
+    shard->acquisitions++;
+}
+
+static void shard_unlock(cache_shard* shard){
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/* hash table, linear probing with backward shift deletion so no tombstones build up */
+
+//the stored hash rejects almost every other key before the bytes are compared
+static cache_slot* table_lookup(cache_shard* shard, uint64_t hash, const char* key, int key_len){
+    cache_slot* table=shard->table;
+    size_t i=hash & shard->table_mask;
+    while(table[i].element!=NULL){
+        cache_element* element=table[i].element;
+        if(table[i].hash==hash && element->key_len==key_len && memcmp(element->key, key, key_len)==0)
+            return &table[i];
+        i=(i+1) & shard->table_mask;
+    }
+    return NULL;
+}
+
+static cache_slot* table_slot_of(cache_shard* shard, cache_element* element){
+    return table_lookup(shard, element->hash, element->key, element->key_len);
+}
+
+static void table_place(cache_slot* slots, size_t mask, cache_element* element){
+    size_t i=element->hash & mask;
+    while(slots[i].element!=NULL)
+        i=(i+1) & mask;
+    slots[i].hash=element->hash;
+    slots[i].element=element;
+}
+
+static int table_grow(cache_shard* shard){
+    size_t size=(shard->table_mask+1)*2;
+    cache_slot* grown=(cache_slot*)calloc(size, sizeof(cache_slot));
+    if(grown==NULL)
+        return -1;
+    for(size_t i=0;i<=shard->table_mask;i++){
+        if(shard->table[i].element!=NULL)
+            table_place(grown, size-1, shard->table[i].element);
+    }
+    free(shard->table);
+    shard->table=grown;
+    shard->table_mask=size-1;
+    return 0;
+}
+
+static void table_delete(cache_shard* shard, cache_slot* slot){
+    cache_slot* table=shard->table;
+    size_t table_mask=shard->table_mask;
+    size_t i=slot-table;
+    size_t j=i;
+
+    //pull later members of the probe run back into the hole
+    while(1){
+        j=(j+1) & table_mask;
+        if(table[j].element==NULL)
+            break;
+        size_t home=table[j].hash & table_mask;
+        //the entry may only move if its home slot is not cyclically inside (i, j]
+        int stays=(i<=j) ? (i<home && home<=j) : (i<home || home<=j);
+        if(!stays){
+            table[i]=table[j];
+            i=j;
+        }
+    }
+    table[i].element=NULL;
+    table[i].hash=0;
+    shard->table_used--;
+}
+
+/* LRU lists, one per region */
+
+static void lru_unlink(cache_shard* shard, cache_element* element){
+    cache_list* list=&shard->lists[element->region];
+    if(element->prev!=NULL)
+        element->prev->next=element->next;
+    else
+        list->head=element->next;
+    if(element->next!=NULL)
+        element->next->prev=element->prev;
+    else
+        list->tail=element->prev;
+    element->prev=NULL;
+    element->next=NULL;
+    list->size-=element->size;
+}
+
+static void lru_push_front(cache_shard* shard, cache_element* element, int region){
+    cache_list* list=&shard->lists[region];
+    element->region=region;
+    element->prev=NULL;
+    element->next=list->head;
+    if(list->head!=NULL)
+        list->head->prev=element;
+    else
+        list->tail=element;
+    list->head=element;
+    list->size+=element->size;
+}
+
+//the element eviction takes next: the LRU tail, or under W-TinyLFU the coldest of the main region
+static cache_element* coldest(cache_shard* shard){
+    if(shard->lists[REGION_PROBATION].tail!=NULL)
+        return shard->lists[REGION_PROBATION].tail;
+    if(shard->lists[REGION_PROTECTED].tail!=NULL)
+        return shard->lists[REGION_PROTECTED].tail;
+    return shard->lists[REGION_WINDOW].tail;
+}
+
+void cache_element_release(cache_element* element){
+    //key, vary and the segment array live in the same allocation as the element
+    if(__atomic_sub_fetch(&element->refcount, 1, __ATOMIC_ACQ_REL)==0){
+        for(int i=0;i<element->segment_count;i++)
+            segment_release(element->segments[i]);
+        slab_free(element);
+    }
+}
+
+void cache_element_ref(cache_element* element){
+    __atomic_add_fetch(&element->refcount, 1, __ATOMIC_RELAXED);
+}
+
+int cache_element_iov(cache_element* element, size_t offset, struct iovec* iov, int max){
+    int count=0;
+    for(int i=offset/SEGMENT_SIZE;i<element->segment_count && count<max;i++){
+        size_t start=(size_t)i*SEGMENT_SIZE;
+        size_t end=start+SEGMENT_SIZE<(size_t)element->len ? start+SEGMENT_SIZE : (size_t)element->len;
+        size_t from=offset>start ? offset : start;
+        iov[count].iov_base=element->segments[i]->data+(from-start);
+        iov[count].iov_len=end-from;
+        count++;
+    }
+    return count;
+}
+
+//unlink from the table and the list and drop the cache's reference, shard lock must be held
+static void evict_locked(cache_shard* shard, cache_slot* slot){
+    cache_element* element=slot->element;
+    table_delete(shard, slot);
+    lru_unlink(shard, element);
+    shard->cache_element_size-=element->size;
+    //readers still sending the element keep it alive until they release it
+    cache_element_release(element);
+}
+
+static void evict_element(cache_shard* shard, cache_element* element){
+    evict_locked(shard, table_slot_of(shard, element));
+}
+
+//evicted for room rather than replaced, the next tier gets a chance to keep it
+static void demote_element(cache_shard* shard, cache_element* element){
+    if(demote_hook!=NULL)
+        demote_hook(element);
+    evict_element(shard, element);
+}
+
+/* W-TinyLFU: new elements enter a small LRU window. What falls out of the
+ * window is admitted to the main region only if the sketch estimates it
+ * more popular than the main elements it would push out, so a burst of
+ * one-off downloads passes through the window without flushing the
+ * elements that are asked for again and again. */
+
+//a used element moves up: window and protected to their fronts, probation to protected
+static void tinylfu_touch(cache_shard* shard, cache_element* element){
+    int region=element->region==REGION_WINDOW ? REGION_WINDOW : REGION_PROTECTED;
+    lru_unlink(shard, element);
+    lru_push_front(shard, element, region);
+    //protected overflow goes back on probation, where it has to be used again to stay
+    while(shard->lists[REGION_PROTECTED].size>shard->protected_budget){
+        cache_element* demoted=shard->lists[REGION_PROTECTED].tail;
+        lru_unlink(shard, demoted);
+        lru_push_front(shard, demoted, REGION_PROBATION);
+    }
+}
+
+//the window's tail against the main region's coldest elements, the more frequent one stays
+static void tinylfu_admit(cache_shard* shard, cache_element* candidate){
+    size_t main_budget=shard->budget-shard->window_budget;
+    size_t main_size=shard->lists[REGION_PROBATION].size+shard->lists[REGION_PROTECTED].size;
+    int frequency=sketch_frequency(&shard->sketch, candidate->hash);
+    //a large candidate may need several victims, none is evicted unless it beats each of them
+    int victims=0;
+    int region=REGION_PROBATION;
+    cache_element* victim=shard->lists[region].tail;
+    while(main_size+candidate->size>main_budget){
+        if(victim==NULL && region==REGION_PROBATION){
+            region=REGION_PROTECTED;
+            victim=shard->lists[region].tail;
+            continue;
+        }
+        if(victim==NULL || frequency<=sketch_frequency(&shard->sketch, victim->hash)){
+            demote_element(shard, candidate);
+            return;
+        }
+        main_size-=victim->size;
+        victims++;
+        victim=victim->prev;
+    }
+    //the victims walked are the probation tail, then the protected tail
+    for(;victims>0;victims--){
+        victim=shard->lists[REGION_PROBATION].tail;
+        if(victim==NULL)
+            victim=shard->lists[REGION_PROTECTED].tail;
+        demote_element(shard, victim);
+    }
+    lru_unlink(shard, candidate);
+    lru_push_front(shard, candidate, REGION_PROBATION);
+}
+
+static void tinylfu_balance(cache_shard* shard){
+    while(shard->lists[REGION_WINDOW].size>shard->window_budget)
+        tinylfu_admit(shard, shard->lists[REGION_WINDOW].tail);
+}
+
+/* cache keys */
+
+//writes the canonical key into out, or only measures it when out is NULL
+static int key_write(char* out, ParsedRequest* request, const char* vary){
+    int pos=0;
+    const char* port=request->port!=NULL ? request->port : "80";
+    const char* parts[]={request->method, "\n", NULL, "\n", port, "\n", request->path};
+
+    for(int i=0;i<7;i++){
+        if(parts[i]==NULL){
+            //hosts compare case-insensitively
+            for(const char* c=request->host;*c;c++,pos++){
+                if(out!=NULL)
+                    out[pos]=tolower((unsigned char)*c);
+            }
+            continue;
+        }
+        int n=strlen(parts[i]);
+        if(out!=NULL)
+            memcpy(out+pos, parts[i], n);
+        pos+=n;
+    }
+
+    //one line per request header the origin varies on, absent headers still count
+    while(vary!=NULL && *vary){
+        const char* comma=strchr(vary, ',');
+        int name_len=comma!=NULL ? comma-vary : (int)strlen(vary);
+        struct ParsedHeader* header=ParsedHeader_getn(request, vary, name_len);
+        const char* value=header!=NULL ? header->value : "";
+        int value_len=strlen(value);
+        if(out!=NULL){
+            out[pos]='\n';
+            memcpy(out+pos+1, vary, name_len);
+            out[pos+1+name_len]=':';
+            memcpy(out+pos+2+name_len, value, value_len);
+        }
+        pos+=2+name_len+value_len;
+        vary=comma!=NULL ? comma+1 : NULL;
+    }
+    return pos;
+}
+
+int cache_key_build(cache_key* key, ParsedRequest* request, const char* vary){
+    key->bytes=NULL;
+    key->len=0;
+    key->arena=NULL;
+    if(request->method==NULL || request->host==NULL || request->path==NULL)
+        return -1;
+
+    //the key lives as long as the request, so it shares the request's arena
+    int len=key_write(NULL, request, vary);
+    key->arena=request->arena;
+    key->bytes=key->arena!=NULL ? (char*)arena_alloc(key->arena, len+1) : (char*)malloc(len+1);
+    if(key->bytes==NULL)
+        return -1;
+    key_write(key->bytes, request, vary);
+    key->bytes[len]='\0';
+    key->len=len;
+    key->hash=cache_hash(key->bytes, len);
+    return 0;
+}
+
+void cache_key_free(cache_key* key){
+    if(key->arena==NULL)
+        free(key->bytes);
+    key->bytes=NULL;
+    key->len=0;
+}
+
+//"Accept-Encoding, User-Agent, Accept-Language" becomes "user-agent,accept-language", NULL for "*"
+char* cache_normalize_vary(const char* value, int len){
+    char* vary=(char*)malloc(len+1);
+    if(vary==NULL)
+        return NULL;
+    int pos=0;
+    int name_start=0;
+    for(int i=0;i<=len;i++){
+        if(i<len && value[i]=='*'){
+            free(vary);
+            return NULL;
+        }
+        if(i==len || value[i]==','){
+            //codings are negotiated from the one stored copy, so Accept-Encoding does not split the entry
+            if(pos-name_start==15 && memcmp(vary+name_start, "accept-encoding", 15)==0)
+                pos=name_start;
+            else if(i<len)
+                vary[pos++]=',';
+            name_start=pos;
+            continue;
+        }
+        if(value[i]!=' ' && value[i]!='\t')
+            vary[pos++]=tolower((unsigned char)value[i]);
+    }
+    //a name dropped from the end leaves its comma behind
+    if(pos>0 && vary[pos-1]==',')
+        pos--;
+    vary[pos]='\0';
+    return vary;
+}
+
+cache_element* find(cache_key* key){
+    cache_element* ele=NULL;
+    cache_shard* shard=shard_for(key->hash);
+
+    shard_lock(shard);
+    //misses count too, a key asked for often enough is admitted once it is stored
+    if(policy==CACHE_POLICY_TINYLFU)
+        sketch_increment(&shard->sketch, key->hash);
+    cache_slot* slot=table_lookup(shard, key->hash, key->bytes, key->len);
+    if(slot!=NULL){
+        ele=slot->element;
+        //pinned for the caller, eviction can no longer free it underneath
+        __atomic_add_fetch(&ele->refcount, 1, __ATOMIC_RELAXED);
+        ele->time=time(NULL);
+        if(policy==CACHE_POLICY_TINYLFU){
+            tinylfu_touch(shard, ele);
+        }else{
+            lru_unlink(shard, ele);
+            lru_push_front(shard, ele, REGION_WINDOW);
+        }
+    }
+    shard_unlock(shard);
+    return ele;
+}
+
+//1 when the stored response ends where its framing says and lets the connection carry another one
+static int segments_persistent(cache_element* element){
+    http_framing framing;
+    http_framing_init(&framing, 0);
+    int persistent=element->len>0;
+    for(int i=0;i<element->segment_count && persistent;i++){
+        int n=element->len-i*SEGMENT_SIZE<SEGMENT_SIZE ? element->len-i*SEGMENT_SIZE : SEGMENT_SIZE;
+        persistent=http_framing_feed(&framing, element->segments[i]->data, n)==n;
+    }
+    persistent=persistent && framing.state==HTTP_FRAME_DONE && framing.keep_alive;
+    http_framing_free(&framing);
+    return persistent;
+}
+
+//frees an element that was never linked into a shard
+static void element_discard(cache_element* element){
+    for(int i=0;i<element->segment_count;i++)
+        segment_release(element->segments[i]);
+    slab_free(element);
+}
+
+//references the len bytes of chain in a new element under key, vary is set on the markers kept under base keys
+static int store_element(segment* chain, int len, cache_key* key, const char* vary, int derived) {
+    int vary_len = vary != NULL ? strlen(vary) + 1 : 0;
+    int count = (len + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+    int tail_len = len - (count - 1) * SEGMENT_SIZE;
+    size_t header_size = sizeof(cache_element) + key->len + 1 + vary_len + count * sizeof(segment*);
+    // accounted by the chunks the element will hold, what the memory really costs
+    size_t ele_size = slab_chunk_size(header_size);
+    segment* seg = chain;
+    for (int i = 0; i < count; i++, seg = seg->next) {
+        int size = i == count - 1 && seg->size > tail_len ? tail_len : seg->size;
+        ele_size += slab_chunk_size(sizeof(segment) + size);
+    }
+    cache_shard* shard = shard_for(key->hash);
+    if (ele_size > MAX_ELEMENT_SIZE || ele_size > shard->budget) {
+        printf("Cache size exceeded\n");
+        return 0;
+    }
+
+    // Build the element outside the lock, only linking it in needs the mutex
+    cache_element* element = (cache_element*)slab_alloc(header_size);
+    if (element == NULL)
+        return -1;
+    // cache memory stays within the region, what only the heap could supply is not stored
+    if (!slab_owns(element)) {
+        slab_free(element);
+        return -1;
+    }
+    element->segments = (segment**)(element + 1);
+    element->segment_count = 0;
+    element->len = len;
+    seg = chain;
+    for (int i = 0; i < count; i++, seg = seg->next) {
+        // a partly filled tail is copied to its exact size, and a segment a fetch took from the heap into the region.
+        // The other full segments are shared
+        int size = i == count - 1 && seg->size > tail_len ? tail_len : seg->size;
+        segment* held = seg;
+        if (size < seg->size || !slab_owns(seg)) {
+            held = segment_new(size);
+            if (held == NULL) {
+                element_discard(element);
+                return -1;
+            }
+            memcpy(held->data, seg->data, size);
+        } else {
+            segment_ref(seg);
+        }
+        element->segments[i] = held;
+        element->segment_count++;
+        if (!slab_owns(held)) {
+            element_discard(element);
+            return -1;
+        }
+    }
+    element->key = (char*)(element->segments + count);
+    memcpy(element->key, key->bytes, key->len + 1);
+    element->key_len = key->len;
+    element->derived = derived;
+    element->vary = NULL;
+    if (vary != NULL) {
+        element->vary = element->key + key->len + 1;
+        memcpy(element->vary, vary, vary_len);
+    }
+    element->head_len = count > 0 ? http_response_head_len(element->segments[0]->data, count > 1 ? SEGMENT_SIZE : len) : 0;
+    element->persistent = count > 0 && segments_persistent(element);
+    element->encoding = element->head_len > 0 ? encoding_of(element->segments[0]->data, element->head_len) : ENCODING_IDENTITY;
+    element->expires = 0;
+    element->refreshed = time(NULL);
+    element->stale_while_revalidate = 0;
+    element->stale_if_error = 0;
+    element->hits = 0;
+    element->validator = 0;
+    if (element->head_len > 0) {
+        freshness fresh;
+        freshness_of(element->segments[0]->data, element->head_len, NULL, 0, NULL, element->refreshed, &fresh);
+        element->expires = fresh.expires;
+        element->stale_while_revalidate = fresh.stale_while_revalidate;
+        element->stale_if_error = fresh.stale_if_error;
+        element->validator = fresh.validator;
+    }
+    element->id = __atomic_add_fetch(&next_element_id, 1, __ATOMIC_RELAXED);
+    element->size = ele_size;
+    element->time = time(NULL);
+    element->hash = key->hash;
+    element->refcount = 1; // the cache's own reference
+    element->region = REGION_WINDOW;
+    element->prev = NULL;
+    element->next = NULL;
+
+    shard_lock(shard);
+
+    // A newer copy replaces the old one instead of shadowing it
+    cache_slot* old = table_lookup(shard, key->hash, key->bytes, key->len);
+    if (old != NULL)
+        evict_locked(shard, old);
+
+    // Under plain LRU, make room for the new element by evicting from the cold end of the shard's list.
+    // W-TinyLFU makes room once the element is in its window
+    while (policy == CACHE_POLICY_LRU && shard->lists[REGION_WINDOW].tail != NULL &&
+        shard->cache_element_size + ele_size > shard->budget)
+        demote_element(shard, shard->lists[REGION_WINDOW].tail);
+
+    // Keep the table at most half full so probe runs stay short
+    if ((shard->table_used + 1) * 2 > shard->table_mask + 1 && table_grow(shard) < 0) {
+        shard_unlock(shard);
+        element_discard(element);
+        return -1;
+    }
+
+    table_place(shard->table, shard->table_mask, element);
+    shard->table_used++;
+    lru_push_front(shard, element, REGION_WINDOW);
+    shard->cache_element_size += ele_size;
+    if (policy == CACHE_POLICY_TINYLFU)
+        tinylfu_balance(shard);
+
+    shard_unlock(shard);
+    return 1;
+}
+
+static void segments_release(segment* chain){
+    while (chain != NULL) {
+        segment* next = chain->next;
+        segment_release(chain);
+        chain = next;
+    }
+}
+
+//segments holding a copy of data, each one sized to what it holds
+static segment* segments_copy(const char* data, int len){
+    segment* chain = NULL;
+    segment** link = &chain;
+    for (int pos = 0; pos < len; pos += SEGMENT_SIZE) {
+        int n = len - pos < SEGMENT_SIZE ? len - pos : SEGMENT_SIZE;
+        segment* seg = segment_new(n);
+        if (seg == NULL) {
+            segments_release(chain);
+            return NULL;
+        }
+        memcpy(seg->data, data + pos, n);
+        *link = seg;
+        link = &seg->next;
+    }
+    return chain;
+}
+
+int add_cache_element(char* data, int len, cache_key* key) {
+    segment* chain = segments_copy(data, len);
+    int ret = chain != NULL || len == 0 ? store_element(chain, len, key, NULL, 0) : -1;
+    segments_release(chain);
+    return ret;
+}
+
+int cache_identity_key(cache_key* key, cache_element* source, ParsedRequest* request){
+    //the id ties the variant to the stored response it was inflated from, a replaced response orphans it
+    char suffix[32];
+    int suffix_len=snprintf(suffix, sizeof(suffix), "\nidentity:%llu", (unsigned long long)source->id);
+    int len=source->key_len+suffix_len;
+    key->arena=request->arena;
+    key->bytes=key->arena!=NULL ? (char*)arena_alloc(key->arena, len+1) : (char*)malloc(len+1);
+    key->len=0;
+    if(key->bytes==NULL)
+        return -1;
+    memcpy(key->bytes, source->key, source->key_len);
+    memcpy(key->bytes+source->key_len, suffix, suffix_len+1);
+    key->len=len;
+    key->hash=cache_hash(key->bytes, len);
+    return 0;
+}
+
+int cache_store_identity(segment* chain, int len, cache_key* key){
+    return store_element(chain, len, key, NULL, 1);
+}
+
+cache_element* cache_lookup(ParsedRequest* request, cache_key* key){
+    if(cache_key_build(key, request, NULL)<0)
+        return NULL;
+
+    cache_element* hit=find(key);
+    if(hit!=NULL && hit->vary!=NULL){
+        //the base key only records which request headers the origin varies on
+        cache_key variant;
+        cache_element* marker=hit;
+        hit=NULL;
+        if(cache_key_build(&variant, request, marker->vary)==0){
+            hit=find(&variant);
+            cache_key_free(&variant);
+        }
+        cache_element_release(marker);
+    }
+    return hit;
+}
+
+cache_element* cache_lookup_identity(cache_element* source, ParsedRequest* request){
+    cache_key identity;
+    cache_element* inflated=NULL;
+    if(cache_identity_key(&identity, source, request)==0)
+        inflated=find(&identity);
+    cache_key_free(&identity);
+    return inflated;
+}
+
+int cache_store_response(segment* chain, int len, cache_key* key, ParsedRequest* request){
+    //the head has to fit the first segment, the same limit followers are matched by
+    int head_len=http_response_head_len(chain->data, len<SEGMENT_SIZE ? len : SEGMENT_SIZE);
+    if(head_len<0)
+        return 0;
+    freshness fresh;
+    freshness_of(chain->data, head_len, NULL, 0, request, time(NULL), &fresh);
+    if(!fresh.storable)
+        return 0;
+
+    int vary_len;
+    const char* vary_value=http_response_header(chain->data, head_len, "Vary", &vary_len);
+    if(vary_value==NULL)
+        return store_element(chain, len, key, NULL, 0);
+
+    char* vary=cache_normalize_vary(vary_value, vary_len);
+    if(vary==NULL)
+        return 0; //Vary: * never matches a later request
+    if(vary[0]=='\0'){
+        free(vary);
+        return store_element(chain, len, key, NULL, 0);
+    }
+
+    //marker under the base key, the response itself under the key extended by the varied headers
+    int ret=0;
+    cache_key variant;
+    if(store_element(NULL, 0, key, vary, 0)>0 && cache_key_build(&variant, request, vary)==0){
+        ret=store_element(chain, len, &variant, NULL, 1);
+        cache_key_free(&variant);
+    }
+    free(vary);
+    return ret;
+}
+
+int cache_element_use(cache_element* element, time_t now){
+    time_t expires=__atomic_load_n(&element->expires, __ATOMIC_RELAXED);
+    if(now<expires){
+        //a hot element is refreshed before it expires, so its clients never wait for the origin
+        int hits=__atomic_add_fetch(&element->hits, 1, __ATOMIC_RELAXED);
+        time_t lifetime=expires-__atomic_load_n(&element->refreshed, __ATOMIC_RELAXED);
+        time_t ahead=(lifetime+REFRESH_AHEAD_SHARE-1)/REFRESH_AHEAD_SHARE;
+        return hits>=REFRESH_AHEAD_HITS && now>=expires-ahead ? CACHE_REFRESH : CACHE_FRESH;
+    }
+    if(now<expires+__atomic_load_n(&element->stale_while_revalidate, __ATOMIC_RELAXED))
+        return CACHE_REFRESH;
+    return CACHE_STALE;
+}
+
+int cache_element_usable_on_error(cache_element* element, time_t now){
+    return now<__atomic_load_n(&element->expires, __ATOMIC_RELAXED)+__atomic_load_n(&element->stale_if_error, __ATOMIC_RELAXED);
+}
+
+void cache_refresh(cache_element* element, const char* head, int head_len){
+    freshness fresh;
+    time_t now=time(NULL);
+    freshness_of(head, head_len, element->segments[0]->data, element->head_len, NULL, now, &fresh);
+    //readers only compare against these, each is read on its own
+    __atomic_store_n(&element->refreshed, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&element->stale_while_revalidate, (int)fresh.stale_while_revalidate, __ATOMIC_RELAXED);
+    __atomic_store_n(&element->stale_if_error, (int)fresh.stale_if_error, __ATOMIC_RELAXED);
+    __atomic_store_n(&element->hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&element->expires, fresh.expires, __ATOMIC_RELAXED);
+}
+
+//evicts from the fullest shard, every shard already keeps itself within its own budget
+void remove_cache_element(){
+    cache_shard* victim=NULL;
+    for(int i=0;i<num_shards;i++){
+        if(victim==NULL || shards[i].cache_element_size>victim->cache_element_size)
+            victim=&shards[i];
+    }
+    if(victim==NULL)
+        return;
+
+    shard_lock(victim);
+    cache_element* element=coldest(victim);
+    if(element!=NULL)
+        demote_element(victim, element);
+    shard_unlock(victim);
+}
+
+/* Slab-aware eviction. When a size class runs out of chunks and the
+ * region of free pages, the allocator asks the cache to give memory back.
+ * A few of the coldest elements are searched for one that holds a chunk of
+ * the class asked for, so its chunk can be reused at once. Otherwise the
+ * coldest element goes, the pages it empties can serve any class. */
+
+//1 when element holds a chunk of chunk_size bytes, its segments are full but for the last
+static int element_holds_chunk(cache_element* element, size_t chunk_size){
+    size_t header_size=sizeof(cache_element)+element->key_len+1+
+        (element->vary!=NULL ? strlen(element->vary)+1 : 0)+element->segment_count*sizeof(segment*);
+    if(slab_chunk_size(header_size)==chunk_size)
+        return 1;
+    int count=element->segment_count;
+    return count>0 && (slab_chunk_size(sizeof(segment)+element->segments[0]->size)==chunk_size ||
+        slab_chunk_size(sizeof(segment)+element->segments[count-1]->size)==chunk_size);
+}
+
+static int cache_reclaim(size_t size){
+    cache_shard* victim=NULL;
+    for(int i=0;i<num_shards;i++){
+        if(victim==NULL || shards[i].cache_element_size>victim->cache_element_size)
+            victim=&shards[i];
+    }
+    if(victim==NULL)
+        return 0;
+
+    size_t chunk_size=slab_chunk_size(size);
+    shard_lock(victim);
+    //an element a reader pins frees nothing yet, so only unpinned ones count: the coldest, or one holding the class
+    cache_element* element=NULL;
+    cache_element* candidate=coldest(victim);
+    for(int i=0;i<CACHE_RECLAIM_SCAN && candidate!=NULL;i++,candidate=candidate->prev){
+        if(__atomic_load_n(&candidate->refcount, __ATOMIC_RELAXED)!=1)
+            continue;
+        if(element==NULL)
+            element=candidate;
+        if(element_holds_chunk(candidate, chunk_size)){
+            element=candidate;
+            break;
+        }
+    }
+    if(element!=NULL)
+        demote_element(victim, element);
+    shard_unlock(victim);
+    return element!=NULL;
+}
+
+void cache_set_demote(void (*demote)(cache_element* element)){
+    demote_hook=demote;
+}
+
+void cache_destroy(){
+    slab_set_reclaim(NULL);
+    demote_hook=NULL;
+    for(int i=0;i<num_shards;i++){
+        cache_shard* shard=&shards[i];
+        cache_element* element;
+        while((element=coldest(shard))!=NULL)
+            evict_element(shard, element);
+        free(shard->table);
+        sketch_free(&shard->sketch);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(shards);
+    shards=NULL;
+    num_shards=0;
+}
+
+void cache_print_stats(FILE* out){
+    fprintf(out, "%-6s %10s %10s %14s %14s %12s %10s\n", "shard", "elements", "bytes", "acquisitions", "contended", "wait us", "contended%");
+    for(int i=0;i<num_shards;i++){
+        cache_shard* shard=&shards[i];
+        //plain lock so reading the counters does not show up in them
+        pthread_mutex_lock(&shard->mutex);
+        size_t elements=shard->table_used;
+        size_t bytes=shard->cache_element_size;
+        unsigned long acquisitions=shard->acquisitions;
+        unsigned long contended=shard->contended;
+        unsigned long long wait_ns=shard->wait_ns;
+        pthread_mutex_unlock(&shard->mutex);
+
+        fprintf(out, "%-6d %10zu %10zu %14lu %14lu %12llu %9.2f%%\n", i, elements, bytes, acquisitions, contended,
+            wait_ns/1000, acquisitions ? 100.0*contended/acquisitions : 0.0);
+    }
+    fflush(out);
+}
@@ -0,0 +1,215 @@
+/*
+ * cache.h -- in-memory response cache shared by all workers.
+ *
+ * Elements are indexed by an open-addressing hash table keyed by a 64-bit
+ * hash of the URL and threaded on an intrusive doubly linked LRU list, so
+ * lookup, touch, insert and evict are all O(1).
+ *
+ * The cache is split into shards selected by the URL hash. Every shard has
+ * its own lock, table, LRU list and an equal share of the MAX_SIZE budget,
+ * so workers only contend when they touch the same shard. Each shard counts
+ * lock acquisitions and how many of them had to wait, which is what the
+ * shard count should be tuned by.
+ *
+ * What is evicted depends on the policy chosen at cache_init(). Plain LRU
+ * admits every response and evicts the least recently used. W-TinyLFU
+ * keeps a frequency sketch of every key looked up (see sketch.h). New
+ * elements enter a window of 1% of the shard, and whatever falls out of
+ * it only replaces the coldest elements of the main region when it is
+ * asked for more often than they are. The main region is an SLRU: elements
+ * used again while on probation are protected, up to 80% of it.
+ *
+ * Elements are reference counted. Readers pin an element while they send
+ * it, and eviction only unlinks it, so the memory is freed by whoever drops
+ * the last reference.
+ *
+ * The response bytes are not copied into the element. It takes references
+ * to the segments the origin response was received into (see segment.h),
+ * and a reader sends them with one iovec per segment.
+ *
+ * Elements and segments live in the slab region (see slab.h), and an
+ * element is accounted the size of the chunks it holds, so the budget is
+ * the memory the cache really uses. When the region runs dry before the
+ * budget does, the allocator has the cache evict, preferring cold elements
+ * whose chunks fit what is being allocated.
+ *
+ * Elements evicted for room are handed to the demotion hook first, which
+ * is how the disk tier (see disk_cache.h) keeps them.
+ *
+ * Responses are stored in the content coding the origin chose. A client
+ * that does not accept it is served an identity copy, which is only
+ * inflated and stored the first time such a client asks (see encoding.h).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "proxy_parse.h"
+#include "segment.h"
+
+#ifndef CACHE
+#define CACHE
+
+#define MAX_SIZE 200*(1<<20) //200MB
+#define MAX_ELEMENT_SIZE 10*(1<<20) //10MB
+
+#define CACHE_TABLE_SIZE 1024 //initial number of hash table slots per shard, grows at half load
+#define CACHE_SHARDS 16 //default number of shards
+#define CACHE_SLAB_RESERVE_PERCENT 10 //share of the slab region left out of the budget, for partly used pages and fetches
+
+#define CACHE_POLICY_LRU 0 //admit everything, evict the least recently used
+#define CACHE_POLICY_TINYLFU 1 //admit and evict by estimated popularity, see cache.c
+#define TINYLFU_WINDOW_PERCENT 1 //share of a shard taken by the admission window
+#define TINYLFU_PROTECTED_PERCENT 80 //share of the main region kept for elements used again
+#define SKETCH_OBJECT_SIZE (4*1024) //typical element size the frequency sketch is sized by
+#define CACHE_RECLAIM_SCAN 32 //coldest elements searched for one holding the size class the allocator lacks
+
+typedef struct cache_element cache_element;
+
+/* Canonical cache key: method, lowercased host, port and path, followed by
+ * the request headers named by the origin's Vary. The hash is computed once
+ * when the key is built and compared before any bytes are. */
+typedef struct cache_key {
+    uint64_t hash;
+    int len;
+    char* bytes;
+    struct arena* arena; //owner of bytes, NULL when they were malloc'd
+} cache_key;
+
+struct cache_element{
+    char* key; //canonical key bytes, stored right after the element
+    int key_len;
+    int derived; //found only through another element: a Vary variant or an identity copy, never demoted
+    char* vary; //NULL for responses, the varied header names for a base key marker
+    segment** segments; //the response in SEGMENT_SIZE pieces, stored after vary
+    int segment_count;
+    int len;
+    int head_len; //length of the response head, which lies in the first segment
+    int persistent; //the response is framed so the client connection can be reused
+    int encoding; //ENCODING_* content coding the response is stored in, see encoding.h
+    uint64_t id; //unique per stored response, names the identity variant inflated from it
+    time_t expires; //fresh before this time, moved on when a 304 refreshes the element
+    time_t refreshed; //stored or last revalidated, expires minus this is the lifetime
+    int stale_while_revalidate; //seconds past expires the element may be sent while it is refreshed
+    int stale_if_error; //seconds past expires the element may be sent when the origin fails
+    int hits; //uses since refreshed, what makes an element worth refreshing ahead of expiry
+    int validator; //the head has an ETag or Last-Modified to revalidate with
+    size_t size; //bytes of the slab chunks holding the element and its segments, accounted to the shard budget
+    time_t time; //last access
+    uint64_t hash; //cache_hash() of key
+    int refcount; //one for the cache while linked, one per reader pinning it
+    int region; //which LRU list of the shard the element is on, see cache.c
+    cache_element* prev; //LRU list, towards the most recently used end
+    cache_element* next; //LRU list, towards the least recently used end
+};
+
+/* Allocate shard_count shards (CACHE_SHARDS when shard_count < 1), each
+ * with its own table and lock, evicting by the CACHE_POLICY_* policy.
+ * Returns 0 or -1 */
+int cache_init(int shard_count, int policy);
+
+/* CACHE_POLICY_* named "lru" or "tinylfu", -1 for anything else */
+int cache_policy_of(const char* name);
+
+/* Drop every element and free the shards, cache_init() may be called again */
+void cache_destroy();
+
+/* 64-bit hash used to index the cache */
+uint64_t cache_hash(const char* key, size_t len);
+
+/* Build the canonical key of request into key, including the values of the
+ * comma separated, lowercased header names in vary (may be NULL).
+ * Returns 0 or -1. The bytes come from the request's arena when it has one,
+ * and are released with cache_key_free() */
+int cache_key_build(cache_key* key, ParsedRequest* request, const char* vary);
+void cache_key_free(cache_key* key);
+
+/* Vary header value as the comma separated, lowercased names used by
+ * cache_key_build(), or NULL for "*". Accept-Encoding is left out, as
+ * codings are negotiated from one stored copy, so the result may be empty.
+ * Free the result */
+char* cache_normalize_vary(const char* value, int len);
+
+/* Look up key and mark it most recently used, NULL on a miss. The element
+ * is pinned: its data stays valid even if it is evicted, until the caller
+ * drops it with cache_element_release() */
+cache_element* find(cache_key* key);
+
+/* Drop a reference taken by find(), the last one frees the element */
+void cache_element_release(cache_element* element);
+
+/* Another reference to a pinned element, dropped with cache_element_release() */
+void cache_element_ref(cache_element* element);
+
+/* Fill up to max iovecs with the bytes of element from offset on, one per
+ * segment. Returns how many were filled, 0 once offset reaches the end */
+int cache_element_iov(cache_element* element, size_t offset, struct iovec* iov, int max);
+
+/* Store a copy of data under key as it is, replacing an older copy and
+ * evicting least recently used elements until it fits. Returns 1 when
+ * stored, 0 when the element is too large and -1 on error */
+int add_cache_element(char* data, int len, cache_key* key);
+
+/* Build the base key of request into key and look up the response for it,
+ * following the Vary marker to the variant matching the request headers.
+ * The element is returned in the coding it was stored in, whether or not
+ * the request accepts it. Returns a pinned element or NULL. key is built
+ * even on a miss */
+cache_element* cache_lookup(ParsedRequest* request, cache_key* key);
+
+/* The identity copy inflated from source, pinned, or NULL when none was
+ * stored. Freshness is that of source, the copy is never checked itself */
+cache_element* cache_lookup_identity(cache_element* source, ParsedRequest* request);
+
+/* Store the raw origin response, the first len bytes of the segment chain,
+ * under the base key, or under the variant key when the response carries
+ * Vary. Responses that are not storable by the rules of freshness.h are
+ * skipped. The element references full segments instead of copying them, so
+ * they must not be written to afterwards. The head has to lie in the first
+ * segment. Same returns as add_cache_element */
+int cache_store_response(segment* chain, int len, cache_key* key, ParsedRequest* request);
+
+/* Key of the identity copy of source, from the request's arena like
+ * cache_key_build(). Returns 0 or -1 */
+int cache_identity_key(cache_key* key, cache_element* source, ParsedRequest* request);
+
+/* Store the identity response in the first len bytes of chain under a key
+ * from cache_identity_key(), by reference like cache_store_response() */
+int cache_store_identity(segment* chain, int len, cache_key* key);
+
+#define CACHE_FRESH 0 //send the element
+#define CACHE_REFRESH 1 //send the element and refresh it in the background
+#define CACHE_STALE 2 //revalidate the element before sending it
+
+#define REFRESH_AHEAD_HITS 8 //uses within one lifetime that make an element hot
+#define REFRESH_AHEAD_SHARE 10 //hot elements are refreshed in the last tenth of their lifetime
+
+/* Count a use of element at now and tell how it may be sent: CACHE_FRESH
+ * while fresh, CACHE_REFRESH when it is hot and about to expire or stale
+ * within its stale-while-revalidate window, CACHE_STALE otherwise */
+int cache_element_use(cache_element* element, time_t now);
+
+/* 1 when element may be sent at now in place of an origin error */
+int cache_element_usable_on_error(cache_element* element, time_t now);
+
+/* The origin answered a revalidation of element with a 304 whose head is
+ * given: move its expiry on without touching the stored body, and start
+ * counting its uses again */
+void cache_refresh(cache_element* element, const char* head, int head_len);
+
+/* Register the function handed every element evicted to make room, before
+ * the cache drops it. It runs under the shard lock and may pin the element
+ * with cache_element_ref() to keep it. Replaced elements are not passed */
+void cache_set_demote(void (*demote)(cache_element* element));
+
+/* Evict the coldest element of the fullest shard */
+void remove_cache_element();
+
+/* Write per-shard occupancy and lock contention counters to out */
+void cache_print_stats(FILE* out);
+
+#endif
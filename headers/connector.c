@@ -0,0 +1,251 @@
+/*
+  connector.c -- non-blocking connects to origins with Happy Eyeballs.
+*/
+
+#include "connector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+//direct mapped, a colliding failure simply replaces the older one
+typedef struct failure_slot {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    time_t until;
+} failure_slot;
+
+static pthread_mutex_t failures_lock;
+static failure_slot failures[CONNECT_FAILURE_SLOTS];
+
+int connector_init(){
+    if(pthread_mutex_init(&failures_lock, NULL)!=0){
+        fprintf(stderr, "Error initialising connector lock\n");
+        return -1;
+    }
+    memset(failures, 0, sizeof(failures));
+    return 0;
+}
+
+static failure_slot* failure_slot_of(const struct sockaddr_storage* addr, socklen_t len){
+    unsigned int h=2166136261u;
+    const unsigned char* bytes=(const unsigned char*)addr;
+    for(socklen_t i=0;i<len;i++)
+        h=(h^bytes[i])*16777619u;
+    return &failures[h%CONNECT_FAILURE_SLOTS];
+}
+
+static void remember_failure(const struct sockaddr_storage* addr, socklen_t len){
+    pthread_mutex_lock(&failures_lock);
+    failure_slot* slot=failure_slot_of(addr, len);
+    memcpy(&slot->addr, addr, len);
+    slot->len=len;
+    slot->until=time(NULL)+CONNECT_FAILURE_MEMORY;
+    pthread_mutex_unlock(&failures_lock);
+}
+
+static void forget_failure(const struct sockaddr_storage* addr, socklen_t len){
+    pthread_mutex_lock(&failures_lock);
+    failure_slot* slot=failure_slot_of(addr, len);
+    if(slot->len==len && memcmp(&slot->addr, addr, len)==0)
+        slot->until=0;
+    pthread_mutex_unlock(&failures_lock);
+}
+
+static int recently_failed(const struct sockaddr_storage* addr, socklen_t len){
+    pthread_mutex_lock(&failures_lock);
+    failure_slot* slot=failure_slot_of(addr, len);
+    int failed=slot->len==len && slot->until>time(NULL) && memcmp(&slot->addr, addr, len)==0;
+    pthread_mutex_unlock(&failures_lock);
+    return failed;
+}
+
+//close every attempt still running and stop the timers
+static void stop_race(event_loop* loop, connector* conn){
+    for(int i=0;i<conn->count;i++){
+        if(conn->attempts[i].watcher.fd>=0){
+            //closing the descriptor also removes it from the epoll set
+            close(conn->attempts[i].watcher.fd);
+            conn->attempts[i].watcher.fd=-1;
+        }
+    }
+    conn->running=0;
+    event_loop_timer_cancel(loop, &conn->attempt_timer);
+    event_loop_timer_cancel(loop, &conn->deadline_timer);
+    conn->active=0;
+}
+
+//the connector may be freed by the callback, nothing touches it afterwards
+static void finish_race(event_loop* loop, connector* conn, int fd, int timed_out){
+    stop_race(loop, conn);
+    conn->callback(loop, conn, fd, timed_out);
+}
+
+static void attempt_callback(event_loop* loop, io_watcher* watcher, uint32_t events);
+
+//start the next address that accepts a connect, returns -1 when none is left
+static int start_attempt(event_loop* loop, connector* conn){
+    while(conn->next<conn->count){
+        int index=conn->next++;
+        struct sockaddr_storage* addr=&conn->addrs[index];
+
+        int fd=socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(fd<0){
+            //no IPv6 on this host and similar, move on to the next family
+            continue;
+        }
+        if(connect(fd, (struct sockaddr*)addr, conn->lens[index])<0 && errno!=EINPROGRESS){
+            remember_failure(addr, conn->lens[index]);
+            close(fd);
+            continue;
+        }
+
+        connect_attempt* attempt=&conn->attempts[index];
+        attempt->watcher.fd=fd;
+        attempt->watcher.callback=attempt_callback;
+        attempt->watcher.data=attempt;
+        attempt->owner=conn;
+        attempt->addr_index=index;
+        //EPOLLOUT reports the end of the connect either way, SO_ERROR tells which
+        if(event_loop_add(loop, &attempt->watcher, EPOLLOUT | EPOLLET)<0){
+            perror("Error registering connect attempt");
+            close(fd);
+            attempt->watcher.fd=-1;
+            continue;
+        }
+        conn->running++;
+        if(conn->next<conn->count)
+            event_loop_timer_add(loop, &conn->attempt_timer, CONNECT_ATTEMPT_DELAY);
+        return 0;
+    }
+    return -1;
+}
+
+static void attempt_callback(event_loop* loop, io_watcher* watcher, uint32_t events){
+    connect_attempt* attempt=(connect_attempt*)watcher->data;
+    connector* conn=attempt->owner;
+    if(watcher->fd<0 || !conn->active)
+        return;
+
+    int error=0;
+    socklen_t error_len=sizeof(error);
+    if(getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &error, &error_len)<0)
+        error=errno;
+    if(error==0 && (events & EPOLLERR))
+        error=ECONNREFUSED;
+    if(error==EINPROGRESS || (error==0 && !(events & EPOLLOUT)))
+        return; //spurious wakeup, still connecting
+
+    struct sockaddr_storage* addr=&conn->addrs[attempt->addr_index];
+    socklen_t len=conn->lens[attempt->addr_index];
+    int fd=watcher->fd;
+    conn->running--;
+
+    if(error==0){
+        //the winner leaves this watcher, the caller registers it under its own
+        event_loop_remove(loop, watcher);
+        watcher->fd=-1;
+        forget_failure(addr, len);
+        finish_race(loop, conn, fd, 0);
+        return;
+    }
+
+    remember_failure(addr, len);
+    close(fd);
+    watcher->fd=-1;
+    //a failed attempt starts the next address right away instead of waiting for the delay
+    if(start_attempt(loop, conn)<0 && conn->running==0)
+        finish_race(loop, conn, -1, 0);
+}
+
+static void attempt_delay_passed(event_loop* loop, event_timer* timer){
+    connector* conn=(connector*)timer->data;
+    if(!conn->active)
+        return;
+    if(start_attempt(loop, conn)<0 && conn->running==0)
+        finish_race(loop, conn, -1, 0);
+}
+
+static void deadline_passed(event_loop* loop, event_timer* timer){
+    connector* conn=(connector*)timer->data;
+    if(!conn->active)
+        return;
+    //blackholed addresses are remembered like refused ones
+    for(int i=0;i<conn->count;i++){
+        if(conn->attempts[i].watcher.fd>=0)
+            remember_failure(&conn->addrs[i], conn->lens[i]);
+    }
+    finish_race(loop, conn, -1, 1);
+}
+
+//RFC 8305 ordering: families interleaved from the resolver's first choice, recent failures last
+static void order_addresses(connector* conn, const resolver_result* addrs, int port){
+    int first_family=addrs->addrs[0].ss_family;
+    int preferred[RESOLVER_MAX_ADDRS], other[RESOLVER_MAX_ADDRS];
+    int preferred_count=0, other_count=0;
+    for(int i=0;i<addrs->count;i++){
+        if(addrs->addrs[i].ss_family==first_family)
+            preferred[preferred_count++]=i;
+        else
+            other[other_count++]=i;
+    }
+
+    int interleaved[RESOLVER_MAX_ADDRS];
+    int count=0;
+    for(int i=0;i<preferred_count || i<other_count;i++){
+        if(i<preferred_count)
+            interleaved[count++]=preferred[i];
+        if(i<other_count)
+            interleaved[count++]=other[i];
+    }
+
+    conn->count=0;
+    for(int pass=0;pass<2;pass++){
+        for(int i=0;i<count;i++){
+            const struct sockaddr_storage* addr=&addrs->addrs[interleaved[i]];
+            socklen_t len=addrs->lens[interleaved[i]];
+            struct sockaddr_storage with_port=*addr;
+            if(with_port.ss_family==AF_INET6)
+                ((struct sockaddr_in6*)&with_port)->sin6_port=htons(port);
+            else
+                ((struct sockaddr_in*)&with_port)->sin_port=htons(port);
+            if(recently_failed(&with_port, len)!=(pass==1))
+                continue;
+            conn->addrs[conn->count]=with_port;
+            conn->lens[conn->count]=len;
+            conn->count++;
+        }
+    }
+}
+
+int connector_start(event_loop* loop, connector* conn, const resolver_result* addrs, int port,
+    unsigned long timeout_ms, connect_callback callback, void* data){
+    if(addrs->count<1)
+        return -1;
+    order_addresses(conn, addrs, port);
+    for(int i=0;i<RESOLVER_MAX_ADDRS;i++)
+        conn->attempts[i].watcher.fd=-1;
+    conn->next=0;
+    conn->running=0;
+    conn->callback=callback;
+    conn->data=data;
+    event_timer_init(&conn->attempt_timer, attempt_delay_passed, conn);
+    event_timer_init(&conn->deadline_timer, deadline_passed, conn);
+    conn->active=1;
+
+    if(start_attempt(loop, conn)<0){
+        conn->active=0;
+        return -1;
+    }
+    event_loop_timer_add(loop, &conn->deadline_timer, timeout_ms);
+    return 0;
+}
+
+void connector_cancel(event_loop* loop, connector* conn){
+    if(conn->active)
+        stop_race(loop, conn);
+}
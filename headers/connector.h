@@ -0,0 +1,69 @@
+/*
+ * connector.h -- non-blocking connects to origins with Happy Eyeballs.
+ *
+ * The resolved addresses of an origin are tried in RFC 8305 order: address
+ * families interleaved, starting with the family the resolver preferred.
+ * A new attempt starts every CONNECT_ATTEMPT_DELAY milliseconds, or as soon
+ * as the previous one fails, while earlier attempts keep running. The first
+ * socket to connect wins and the others are closed. The whole race is
+ * bounded by a deadline.
+ *
+ * Addresses that failed or timed out are remembered for
+ * CONNECT_FAILURE_MEMORY seconds and tried after every other address, so a
+ * dead address does not hold up each new connection.
+ */
+
+#include <time.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+#include "resolver.h"
+
+#ifndef CONNECTOR
+#define CONNECTOR
+
+#define CONNECT_ATTEMPT_DELAY 250 //milliseconds before racing the next address
+#define CONNECT_TIMEOUT 10000 //default milliseconds for the whole race
+#define CONNECT_FAILURE_MEMORY 30 //seconds a failed address is tried last
+#define CONNECT_FAILURE_SLOTS 256
+
+typedef struct connector connector;
+
+/* Called on the loop thread when the race is over. fd is the connected
+ * socket, not registered with the loop, or -1 with timed_out set when the
+ * deadline passed */
+typedef void (*connect_callback)(event_loop* loop, connector* conn, int fd, int timed_out);
+
+typedef struct connect_attempt {
+    io_watcher watcher; //fd is -1 while the slot is unused
+    connector* owner;
+    int addr_index;
+} connect_attempt;
+
+struct connector {
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS]; //in the order they are tried, ports set
+    socklen_t lens[RESOLVER_MAX_ADDRS];
+    int count;
+    int next; //next address to start
+    int running; //attempts in progress
+    connect_attempt attempts[RESOLVER_MAX_ADDRS];
+    event_timer attempt_timer; //starts the next attempt
+    event_timer deadline_timer; //ends the race
+    int active; //1 between connector_start() and the callback or connector_cancel()
+    connect_callback callback;
+    void* data;
+};
+
+/* Initialise the failure memory. Returns 0 or -1 */
+int connector_init();
+
+/* Race connects to the addresses of addrs on port, giving up after
+ * timeout_ms. callback runs once, never from within this call. Returns 0 or
+ * -1 when not a single attempt could be started */
+int connector_start(event_loop* loop, connector* conn, const resolver_result* addrs, int port,
+    unsigned long timeout_ms, connect_callback callback, void* data);
+
+/* Stop the race and close every attempt, the callback will not run */
+void connector_cancel(event_loop* loop, connector* conn);
+
+#endif
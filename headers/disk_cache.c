@@ -0,0 +1,550 @@
+/*
+  disk_cache.c -- second cache tier in segment files on disk.
+*/
+
+#include "disk_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "encoding.h"
+#include "freshness.h"
+
+#define DISK_MIN_BUCKETS 1024
+
+struct disk_file {
+    unsigned int id; //names the file, higher is newer
+    int fd;
+    size_t size; //bytes written, records never straddle two files
+    int refcount; //one while listed or spooling, one per entry
+    disk_entry* entries;
+    disk_file* next; //listed oldest first
+};
+
+struct disk_spool {
+    disk_file* file; //the response's own file, listed once complete
+    disk_entry* entry; //indexed once complete
+    off_t pos; //where the next bytes go
+    off_t end;
+    int failed;
+};
+
+//an evicted element waiting for the disk thread
+typedef struct demotion {
+    cache_element* element;
+    struct demotion* next;
+} demotion;
+
+static int enabled;
+static char* directory;
+static size_t capacity;
+static size_t segment_size; //DISK_SEGMENT_SIZE, less when the capacity is small
+static size_t max_object;
+
+//index, file list and totals
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static disk_entry** buckets;
+static size_t bucket_mask;
+static size_t entry_count;
+static disk_file* oldest;
+static disk_file* newest;
+static size_t total_bytes;
+static unsigned int next_file_id;
+static unsigned long hits;
+static unsigned long demoted;
+
+//demotion queue
+static pthread_mutex_t queue_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond=PTHREAD_COND_INITIALIZER;
+static demotion* queue_head;
+static demotion* queue_tail;
+static size_t queued_bytes;
+static unsigned long dropped;
+
+//file the disk thread appends demoted elements to, only the thread maps it
+static disk_file* active;
+static char* active_map;
+
+static void file_path(unsigned int id, char* path, size_t size){
+    snprintf(path, size, "%s/%08u.seg", directory, id);
+}
+
+static disk_file* file_new(){
+    disk_file* file=(disk_file*)calloc(1, sizeof(disk_file));
+    if(file==NULL)
+        return NULL;
+    char path[4096];
+    file->id=__atomic_fetch_add(&next_file_id, 1, __ATOMIC_RELAXED);
+    file_path(file->id, path, sizeof(path));
+    file->fd=open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(file->fd<0){
+        perror("Error creating disk cache file");
+        free(file);
+        return NULL;
+    }
+    file->refcount=1;
+    return file;
+}
+
+static void file_release(disk_file* file){
+    if(__atomic_sub_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL)==0){
+        close(file->fd);
+        free(file);
+    }
+}
+
+static void file_unlink(disk_file* file){
+    char path[4096];
+    file_path(file->id, path, sizeof(path));
+    unlink(path);
+}
+
+static disk_entry* entry_new(const char* key, int key_len, uint64_t hash, disk_file* file, off_t offset, size_t len){
+    //the key lives in the same allocation as the entry
+    disk_entry* entry=(disk_entry*)malloc(sizeof(disk_entry)+key_len+1);
+    if(entry==NULL)
+        return NULL;
+    memset(entry, 0, sizeof(*entry));
+    entry->key=(char*)(entry+1);
+    memcpy(entry->key, key, key_len);
+    entry->key[key_len]='\0';
+    entry->key_len=key_len;
+    entry->hash=hash;
+    __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+    entry->file=file;
+    entry->offset=offset;
+    entry->len=len;
+    entry->refcount=1;
+    return entry;
+}
+
+void disk_entry_release(disk_entry* entry){
+    if(__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL)==0){
+        file_release(entry->file);
+        free(entry);
+    }
+}
+
+int disk_entry_fd(disk_entry* entry){
+    return entry->file->fd;
+}
+
+/* index, lock must be held */
+
+static disk_entry** bucket_of(uint64_t hash){
+    return &buckets[hash & bucket_mask];
+}
+
+static void unindex_locked(disk_entry* entry){
+    disk_entry** link=bucket_of(entry->hash);
+    while(*link!=entry)
+        link=&(*link)->next_in_bucket;
+    *link=entry->next_in_bucket;
+
+    if(entry->file_prev!=NULL)
+        entry->file_prev->file_next=entry->file_next;
+    else
+        entry->file->entries=entry->file_next;
+    if(entry->file_next!=NULL)
+        entry->file_next->file_prev=entry->file_prev;
+    entry_count--;
+    //a reader sending it keeps it, and its file, until it lets go
+    disk_entry_release(entry);
+}
+
+static void grow_locked(){
+    size_t size=(bucket_mask+1)*2;
+    disk_entry** grown=(disk_entry**)calloc(size, sizeof(disk_entry*));
+    if(grown==NULL)
+        return;
+    for(size_t i=0;i<=bucket_mask;i++){
+        disk_entry* entry=buckets[i];
+        while(entry!=NULL){
+            disk_entry* next=entry->next_in_bucket;
+            entry->next_in_bucket=grown[entry->hash & (size-1)];
+            grown[entry->hash & (size-1)]=entry;
+            entry=next;
+        }
+    }
+    free(buckets);
+    buckets=grown;
+    bucket_mask=size-1;
+}
+
+static disk_entry* lookup_locked(const char* key, int key_len, uint64_t hash){
+    for(disk_entry* entry=*bucket_of(hash);entry!=NULL;entry=entry->next_in_bucket){
+        if(entry->hash==hash && entry->key_len==key_len && memcmp(entry->key, key, key_len)==0)
+            return entry;
+    }
+    return NULL;
+}
+
+//a newer record for the key replaces the older one, whose bytes stay in their file until it is dropped
+static void index_locked(disk_entry* entry){
+    disk_entry* old=lookup_locked(entry->key, entry->key_len, entry->hash);
+    if(old!=NULL)
+        unindex_locked(old);
+    if(entry_count>=(bucket_mask+1)*2)
+        grow_locked();
+    disk_entry** bucket=bucket_of(entry->hash);
+    entry->next_in_bucket=*bucket;
+    *bucket=entry;
+    entry->file_prev=NULL;
+    entry->file_next=entry->file->entries;
+    if(entry->file->entries!=NULL)
+        entry->file->entries->file_prev=entry;
+    entry->file->entries=entry;
+    entry_count++;
+}
+
+static void list_locked(disk_file* file){
+    file->next=NULL;
+    if(newest!=NULL)
+        newest->next=file;
+    else
+        oldest=file;
+    newest=file;
+}
+
+//delete the oldest files until the rest fit, like trimming a log. The file being appended to stays
+static void trim_locked(){
+    while(total_bytes>capacity && oldest!=NULL && oldest!=active){
+        disk_file* file=oldest;
+        oldest=file->next;
+        if(oldest==NULL)
+            newest=NULL;
+        while(file->entries!=NULL)
+            unindex_locked(file->entries);
+        total_bytes-=file->size;
+        file_unlink(file);
+        file_release(file);
+    }
+}
+
+disk_entry* disk_cache_lookup(cache_key* key){
+    if(!enabled)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    disk_entry* entry=lookup_locked(key->bytes, key->len, key->hash);
+    if(entry!=NULL){
+        __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+        hits++;
+    }
+    pthread_mutex_unlock(&lock);
+    return entry;
+}
+
+/* demotion, on the disk thread */
+
+static int record_write(char* at, const char* key, int key_len, uint64_t len){
+    disk_record record;
+    record.magic=DISK_RECORD_MAGIC;
+    record.key_len=key_len;
+    record.len=len;
+    memcpy(at, &record, sizeof(record));
+    memcpy(at+sizeof(record), key, key_len);
+    return sizeof(record)+key_len;
+}
+
+static void seal_active(){
+    munmap(active_map, segment_size);
+    //the unused end of the file goes back to the file system
+    ftruncate(active->fd, active->size);
+    pthread_mutex_lock(&lock);
+    active=NULL;
+    trim_locked();
+    pthread_mutex_unlock(&lock);
+    active_map=NULL;
+}
+
+static int open_active(){
+    disk_file* file=file_new();
+    if(file==NULL)
+        return -1;
+    //the blocks are reserved before mapping, a store into a hole of a full file system would raise SIGBUS
+    int err=posix_fallocate(file->fd, 0, segment_size);
+    if(err!=0)
+        errno=err;
+    if(err!=0 ||
+        (active_map=(char*)mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0))==MAP_FAILED){
+        perror("Error mapping disk cache file");
+        active_map=NULL;
+        file_unlink(file);
+        file_release(file);
+        return -1;
+    }
+    pthread_mutex_lock(&lock);
+    list_locked(file);
+    active=file;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+static void demote(cache_element* element){
+    size_t record_len=sizeof(disk_record)+element->key_len+element->len;
+    if(active!=NULL && active->size+record_len>segment_size)
+        seal_active();
+    if(active==NULL && open_active()<0)
+        return;
+
+    char* start=active_map+active->size;
+    int key_part=record_write(start, element->key, element->key_len, element->len);
+    char* at=start+key_part;
+    for(int i=0;i<element->segment_count;i++){
+        int n=element->len-i*SEGMENT_SIZE<SEGMENT_SIZE ? element->len-i*SEGMENT_SIZE : SEGMENT_SIZE;
+        memcpy(at, element->segments[i]->data, n);
+        at+=n;
+    }
+    //the bytes are in the page cache now, unmapping the pages keeps them out of the process
+    long page=sysconf(_SC_PAGESIZE);
+    char* from=active_map+(start-active_map)/page*page;
+    madvise(from, at-from, MADV_DONTNEED);
+
+    disk_entry* entry=entry_new(element->key, element->key_len, element->hash, active, active->size+key_part, element->len);
+    pthread_mutex_lock(&lock);
+    active->size+=record_len;
+    total_bytes+=record_len;
+    if(entry!=NULL){
+        entry->head_len=element->head_len;
+        entry->encoding=element->encoding;
+        entry->persistent=element->persistent;
+        entry->expires=__atomic_load_n(&element->expires, __ATOMIC_RELAXED);
+        index_locked(entry);
+        demoted++;
+    }
+    trim_locked();
+    pthread_mutex_unlock(&lock);
+}
+
+static void* disk_thread(void* arg){
+    while(1){
+        pthread_mutex_lock(&queue_lock);
+        while(queue_head==NULL)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        demotion* next=queue_head;
+        queue_head=next->next;
+        if(queue_head==NULL)
+            queue_tail=NULL;
+        queued_bytes-=next->element->len;
+        pthread_mutex_unlock(&queue_lock);
+
+        demote(next->element);
+        cache_element_release(next->element);
+        free(next);
+    }
+    return NULL;
+}
+
+void disk_cache_demote(cache_element* element){
+    //variants and identity copies are only found through another element, stale ones are never sent from disk
+    if(!enabled || element->derived || element->vary!=NULL || element->head_len<=0 ||
+        __atomic_load_n(&element->expires, __ATOMIC_RELAXED)<=time(NULL))
+        return;
+    demotion* d=(demotion*)malloc(sizeof(demotion));
+    if(d==NULL)
+        return;
+    pthread_mutex_lock(&queue_lock);
+    //a disk that cannot keep up drops demotions instead of holding evicted memory
+    if(queued_bytes+element->len>DISK_QUEUE_BYTES){
+        dropped++;
+        pthread_mutex_unlock(&queue_lock);
+        free(d);
+        return;
+    }
+    cache_element_ref(element);
+    d->element=element;
+    d->next=NULL;
+    if(queue_tail!=NULL)
+        queue_tail->next=d;
+    else
+        queue_head=d;
+    queue_tail=d;
+    queued_bytes+=element->len;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* spooling, on the thread receiving the response */
+
+disk_spool* disk_spool_begin(cache_key* key, const char* head, int head_len, size_t len){
+    if(!enabled || len>max_object)
+        return NULL;
+    disk_spool* spool=(disk_spool*)calloc(1, sizeof(disk_spool));
+    if(spool==NULL)
+        return NULL;
+    spool->file=file_new();
+    if(spool->file==NULL){
+        free(spool);
+        return NULL;
+    }
+    char header[sizeof(disk_record)];
+    disk_record record;
+    record.magic=DISK_RECORD_MAGIC;
+    record.key_len=key->len;
+    record.len=len;
+    memcpy(header, &record, sizeof(record));
+    spool->pos=sizeof(disk_record)+key->len;
+    spool->end=spool->pos+len;
+    spool->entry=entry_new(key->bytes, key->len, key->hash, spool->file, spool->pos, len);
+    if(spool->entry==NULL || pwrite(spool->file->fd, header, sizeof(header), 0)!=(ssize_t)sizeof(header) ||
+        pwrite(spool->file->fd, key->bytes, key->len, sizeof(header))!=key->len){
+        disk_spool_finish(spool, 0, 0);
+        return NULL;
+    }
+
+    freshness fresh;
+    freshness_of(head, head_len, NULL, 0, NULL, time(NULL), &fresh);
+    spool->entry->head_len=head_len;
+    spool->entry->encoding=encoding_of(head, head_len);
+    spool->entry->expires=fresh.expires;
+    return spool;
+}
+
+int disk_spool_write(disk_spool* spool, const char* data, size_t len){
+    if(spool->failed || spool->pos+(off_t)len>spool->end){
+        spool->failed=1;
+        return -1;
+    }
+    while(len>0){
+        ssize_t n=pwrite(spool->file->fd, data, len, spool->pos);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n<=0){
+            spool->failed=1;
+            return -1;
+        }
+        data+=n;
+        len-=n;
+        spool->pos+=n;
+    }
+    return 0;
+}
+
+int disk_spool_splice(disk_spool* spool, int fd, size_t len){
+    if(spool->pos+(off_t)len>spool->end)
+        spool->failed=1;
+    //the page cache takes the pipe's pages, nothing is copied through userspace
+    while(len>0 && !spool->failed){
+        loff_t pos=spool->pos;
+        ssize_t n=splice(fd, NULL, spool->file->fd, &pos, len, SPLICE_F_MOVE);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n<=0){
+            spool->failed=1;
+            break;
+        }
+        spool->pos=pos;
+        len-=n;
+    }
+    //what could not be stored still has to leave the pipe
+    char scratch[4096];
+    while(len>0){
+        ssize_t n=read(fd, scratch, len<sizeof(scratch) ? len : sizeof(scratch));
+        if(n<=0)
+            break;
+        len-=n;
+    }
+    return spool->failed ? -1 : 0;
+}
+
+void disk_spool_finish(disk_spool* spool, int complete, int persistent){
+    disk_file* file=spool->file;
+    if(complete && !spool->failed && spool->entry!=NULL && spool->pos==spool->end){
+        spool->entry->persistent=persistent;
+        file->size=spool->end;
+        pthread_mutex_lock(&lock);
+        //the spool's reference to the file becomes the list's
+        list_locked(file);
+        total_bytes+=file->size;
+        index_locked(spool->entry);
+        trim_locked();
+        pthread_mutex_unlock(&lock);
+        free(spool);
+        return;
+    }
+    file_unlink(file);
+    if(spool->entry!=NULL)
+        disk_entry_release(spool->entry);
+    file_release(file);
+    free(spool);
+}
+
+/* setup */
+
+//files of an earlier run, whose index is gone with it
+static int clear_directory(){
+    DIR* dir=opendir(directory);
+    if(dir==NULL)
+        return -1;
+    struct dirent* ent;
+    while((ent=readdir(dir))!=NULL){
+        size_t len=strlen(ent->d_name);
+        if(len>4 && strcmp(ent->d_name+len-4, ".seg")==0)
+            unlinkat(dirfd(dir), ent->d_name, 0);
+    }
+    closedir(dir);
+    return 0;
+}
+
+int disk_cache_init(const char* dir, size_t size){
+    if(mkdir(dir, 0755)<0 && errno!=EEXIST)
+        return -1;
+    directory=strdup(dir);
+    if(directory==NULL || clear_directory()<0)
+        return -1;
+
+    capacity=size;
+    max_object=size/DISK_MAX_OBJECT_SHARE;
+    //a quarter of a small capacity, but always room for the largest element the memory cache holds
+    segment_size=size/4<(size_t)DISK_SEGMENT_SIZE ? size/4 : (size_t)DISK_SEGMENT_SIZE;
+    if(segment_size<2*(size_t)MAX_ELEMENT_SIZE)
+        segment_size=2*(size_t)MAX_ELEMENT_SIZE;
+
+    size_t count=DISK_MIN_BUCKETS;
+    while(count<size/DISK_TYPICAL_OBJECT)
+        count<<=1;
+    buckets=(disk_entry**)calloc(count, sizeof(disk_entry*));
+    if(buckets==NULL)
+        return -1;
+    bucket_mask=count-1;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, disk_thread, NULL)!=0)
+        return -1;
+    pthread_detach(thread);
+    enabled=1;
+    return 0;
+}
+
+int disk_cache_enabled(){
+    return enabled;
+}
+
+void disk_cache_print_stats(FILE* out){
+    if(!enabled)
+        return;
+    pthread_mutex_lock(&lock);
+    size_t files=0;
+    for(disk_file* file=oldest;file!=NULL;file=file->next)
+        files++;
+    size_t bytes=total_bytes;
+    size_t entries=entry_count;
+    unsigned long hit_count=hits;
+    unsigned long demoted_count=demoted;
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_lock(&queue_lock);
+    size_t queued=queued_bytes;
+    unsigned long dropped_count=dropped;
+    pthread_mutex_unlock(&queue_lock);
+
+    fprintf(out, "disk %s: %zu files, %zu of %zu MB, %zu entries, %lu hits, %lu demoted, %lu dropped, %zu bytes queued\n",
+        directory, files, bytes>>20, capacity>>20, entries, hit_count, demoted_count, dropped_count, queued);
+    fflush(out);
+}
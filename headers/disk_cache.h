@@ -0,0 +1,111 @@
+/*
+ * disk_cache.h -- second cache tier in segment files on disk.
+ *
+ * Responses live in append-only files under one directory, found through
+ * an index kept in memory only. Elements the memory cache evicts are handed
+ * to a disk thread, which appends them to the current demotion file through
+ * a shared mapping of it and then drops the written pages from the process,
+ * so the bytes stay in the page cache without counting against its RSS.
+ * When a file reaches DISK_SEGMENT_SIZE the next one is started.
+ *
+ * Responses too large for the memory cache are spooled by the fetch that
+ * receives them, each into a file of its own, and indexed once complete.
+ *
+ * Every record starts with a disk_record header and the key, followed by
+ * the raw response, so a hit is one sendfile() from the record's offset.
+ * When the files outgrow the capacity, the oldest is deleted with every
+ * entry in it, the way a log is trimmed. Readers pin entries, and an entry
+ * pins its file, so a file deleted while it is sent stays readable.
+ *
+ * The index does not outlive the process. Files left by an earlier run are
+ * deleted at startup.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+#ifndef DISK_CACHE
+#define DISK_CACHE
+
+#define DISK_SEGMENT_SIZE (64*(1<<20)) //demoted elements are appended to files of this size
+#define DISK_CACHE_SIZE (10*1024) //default capacity in MB
+#define DISK_MAX_OBJECT_SHARE 8 //a spooled response may take at most this fraction of the capacity
+#define DISK_QUEUE_BYTES (16*(1<<20)) //evicted elements waiting for the disk thread, more are not demoted
+#define DISK_TYPICAL_OBJECT (64*1024) //sizes the index
+
+#define DISK_RECORD_MAGIC 0x31534b44 //"DKS1"
+
+/* Start of every record, followed by key_len key bytes and len response bytes */
+typedef struct disk_record {
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t len;
+} disk_record;
+
+typedef struct disk_file disk_file;
+typedef struct disk_entry disk_entry;
+
+struct disk_entry {
+    char* key;
+    int key_len;
+    uint64_t hash; //cache_hash() of key
+    disk_file* file;
+    off_t offset; //where the response starts in the file
+    size_t len;
+    int head_len;
+    int encoding; //ENCODING_* the response is stored in
+    int persistent; //the response is framed so the client connection can be reused
+    time_t expires; //fresh before this time, only fresh entries are sent
+    int refcount; //one for the index, one per reader
+    disk_entry* next_in_bucket;
+    disk_entry* file_prev; //entries of the same file, dropped together with it
+    disk_entry* file_next;
+};
+
+typedef struct disk_spool disk_spool;
+
+/* Use dir, created when missing, for up to capacity bytes, and start the
+ * disk thread. Returns 0 or -1 */
+int disk_cache_init(const char* dir, size_t capacity);
+
+/* 1 once disk_cache_init() succeeded */
+int disk_cache_enabled();
+
+/* Queue a copy of an element the memory cache is evicting, see
+ * cache_set_demote(). Elements that are stale, found only through another
+ * element, or arrive while the queue is full are not demoted */
+void disk_cache_demote(cache_element* element);
+
+/* Entry stored under key, pinned until disk_entry_release(), or NULL */
+disk_entry* disk_cache_lookup(cache_key* key);
+
+/* Descriptor to read entry from, valid while it is pinned */
+int disk_entry_fd(disk_entry* entry);
+
+void disk_entry_release(disk_entry* entry);
+
+/* Start storing a response of len bytes whose head is given under key.
+ * NULL when the tier is off, len is beyond the largest object or the file
+ * cannot be created */
+disk_spool* disk_spool_begin(cache_key* key, const char* head, int head_len, size_t len);
+
+/* Append len bytes of the response. Returns 0 or -1 */
+int disk_spool_write(disk_spool* spool, const char* data, size_t len);
+
+/* Append len bytes read from fd, a pipe holding at least len bytes. All of
+ * them are taken out of the pipe, even on failure. Returns 0 or -1 */
+int disk_spool_splice(disk_spool* spool, int fd, size_t len);
+
+/* Index the spooled response when complete and every byte arrived, with
+ * persistent as its framing allows, or delete it. Frees spool */
+void disk_spool_finish(disk_spool* spool, int complete, int persistent);
+
+/* Write file, entry and demotion counters to out */
+void disk_cache_print_stats(FILE* out);
+
+#endif
@@ -0,0 +1,294 @@
+/*
+  encoding.c -- content codings of cached responses.
+*/
+
+#include "encoding.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define DECODE_HEAD 0
+#define DECODE_BODY 1
+#define DECODE_LAST 2 //body inflated, the last chunk is still to be written
+#define DECODE_DONE 3
+
+#define CHUNK_LINE 6 //"%04x\r\n", the widest size line the chunks need
+#define CHUNK_MAX 0xffff
+
+//[start, end) without surrounding spaces and tabs
+static void trim(const char** start, const char** end){
+    while(*start<*end && (**start==' ' || **start=='\t'))
+        (*start)++;
+    while(*end>*start && ((*end)[-1]==' ' || (*end)[-1]=='\t'))
+        (*end)--;
+}
+
+static int token_is(const char* token, int len, const char* name){
+    return len==(int)strlen(name) && strncasecmp(token, name, len)==0;
+}
+
+static int coding_of(const char* token, int len){
+    if(len==0 || token_is(token, len, "identity"))
+        return ENCODING_IDENTITY;
+    if(token_is(token, len, "gzip") || token_is(token, len, "x-gzip"))
+        return ENCODING_GZIP;
+    if(token_is(token, len, "deflate"))
+        return ENCODING_DEFLATE;
+    return ENCODING_OTHER;
+}
+
+int encoding_of(const char* head, int head_len){
+    int len;
+    const char* value=http_response_header(head, head_len, "Content-Encoding", &len);
+    if(value==NULL)
+        return ENCODING_IDENTITY;
+    if(memchr(value, ',', len)!=NULL)
+        return ENCODING_OTHER;
+    return coding_of(value, len);
+}
+
+//q of "gzip;q=0.5", 1 without a weight
+static double item_weight(const char* params, const char* end){
+    while(params<end){
+        const char* semi=(const char*)memchr(params, ';', end-params);
+        const char* param_end=semi!=NULL ? semi : end;
+        const char* name=params;
+        trim(&name, &param_end);
+        if(param_end-name>2 && (name[0]=='q' || name[0]=='Q') && name[1]=='=')
+            return strtod(name+2, NULL);
+        params=semi!=NULL ? semi+1 : end;
+    }
+    return 1;
+}
+
+//an exact name wins over "*", a weight of 0 refuses the coding
+static int coding_accepted(const char* accept, const char* coding, int coding_len){
+    int wanted=coding_of(coding, coding_len);
+    if(wanted==ENCODING_IDENTITY)
+        return 1;
+    double exact=-1, wildcard=-1;
+    const char* end=accept+strlen(accept);
+    while(accept<end){
+        const char* comma=(const char*)memchr(accept, ',', end-accept);
+        const char* item_end=comma!=NULL ? comma : end;
+        const char* semi=(const char*)memchr(accept, ';', item_end-accept);
+        const char* name=accept;
+        const char* name_end=semi!=NULL ? semi : item_end;
+        trim(&name, &name_end);
+        int name_len=name_end-name;
+
+        if(name_len==1 && name[0]=='*')
+            wildcard=item_weight(name_end, item_end);
+        else if(name_len>0 && (wanted!=ENCODING_OTHER ? coding_of(name, name_len)==wanted :
+            name_len==coding_len && strncasecmp(name, coding, coding_len)==0))
+            exact=item_weight(name_end, item_end);
+        accept=comma!=NULL ? comma+1 : end;
+    }
+    return exact>=0 ? exact>0 : wildcard>0;
+}
+
+int encoding_accepted(ParsedRequest* request, const char* head, int head_len){
+    int len;
+    const char* value=http_response_header(head, head_len, "Content-Encoding", &len);
+    if(value==NULL)
+        return 1;
+    struct ParsedHeader* accept=ParsedHeader_getKnown(request, PARSED_HEADER_ACCEPT_ENCODING);
+
+    //every coding applied, "gzip, br" needs both
+    const char* end=value+len;
+    while(value<end){
+        const char* comma=(const char*)memchr(value, ',', end-value);
+        const char* coding_end=comma!=NULL ? comma : end;
+        const char* coding=value;
+        trim(&coding, &coding_end);
+        if(coding_of(coding, coding_end-coding)!=ENCODING_IDENTITY &&
+            (accept==NULL || !coding_accepted(accept->value, coding, coding_end-coding)))
+            return 0;
+        value=comma!=NULL ? comma+1 : end;
+    }
+    return 1;
+}
+
+//headers that describe the stored coding or framing, or belong to the origin connection
+static int header_dropped(const char* line, int len){
+    static const char* dropped[]={"Content-Encoding", "Content-Length", "Transfer-Encoding", "ETag",
+        "Connection", "Keep-Alive"};
+    for(size_t i=0;i<sizeof(dropped)/sizeof(dropped[0]);i++){
+        int name_len=strlen(dropped[i]);
+        if(len>name_len && line[name_len]==':' && strncasecmp(line, dropped[i], name_len)==0)
+            return 1;
+    }
+    return 0;
+}
+
+//the stored head without its coding and length, as an HTTP/1.1 chunked response or one ended by closing
+static int rewrite_head(response_decoder* decoder, const char* head, int head_len){
+    const char* framing=decoder->chunked ? "Transfer-Encoding: chunked\r\n\r\n" : "Connection: close\r\n\r\n";
+    decoder->head=(char*)malloc(head_len+strlen(framing)+1);
+    if(decoder->head==NULL)
+        return -1;
+
+    int out=0;
+    const char* line=head;
+    const char* end=head+head_len-2; //the blank line is written after the new headers
+    for(int first=1;line<end;first=0){
+        const char* eol=(const char*)memchr(line, '\n', end-line);
+        eol=eol!=NULL ? eol+1 : end;
+        if(first && decoder->chunked && eol-line>8 && strncmp(line, "HTTP/1.0", 8)==0){
+            //chunked needs HTTP/1.1, the proxy is the one sending this response
+            memcpy(decoder->head+out, "HTTP/1.1", 8);
+            memcpy(decoder->head+out+8, line+8, eol-line-8);
+            out+=eol-line;
+        }else if(first || !header_dropped(line, eol-line)){
+            memcpy(decoder->head+out, line, eol-line);
+            out+=eol-line;
+        }
+        line=eol;
+    }
+    strcpy(decoder->head+out, framing);
+    decoder->head_len=out+strlen(framing);
+    return 0;
+}
+
+int response_decoder_init(response_decoder* decoder, cache_element* source, int chunked){
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->source=source;
+    decoder->chunked=chunked;
+    if(source->segment_count==0 || source->head_len<=0 ||
+        (source->encoding!=ENCODING_GZIP && source->encoding!=ENCODING_DEFLATE))
+        return -1;
+    if(rewrite_head(decoder, source->segments[0]->data, source->head_len)<0)
+        return -1;
+
+    //gzip carries its own header, deflate is zlib wrapped unless inflate finds it is not
+    int window=source->encoding==ENCODING_GZIP ? 16+MAX_WBITS : MAX_WBITS;
+    if(inflateInit2(&decoder->strm, window)!=Z_OK){
+        free(decoder->head);
+        decoder->head=NULL;
+        return -1;
+    }
+    http_framing_init(&decoder->framing, 0);
+    decoder->state=DECODE_HEAD;
+    return 0;
+}
+
+//points strm at the next run of body bytes in the stored response, -1 once there are none left
+static int next_input(response_decoder* decoder){
+    cache_element* source=decoder->source;
+    while(decoder->pos<(size_t)source->len && decoder->framing.state!=HTTP_FRAME_DONE){
+        size_t offset=decoder->pos%SEGMENT_SIZE;
+        size_t n=SEGMENT_SIZE-offset;
+        if(n>source->len-decoder->pos)
+            n=source->len-decoder->pos;
+        const char* data=source->segments[decoder->pos/SEGMENT_SIZE]->data+offset;
+
+        int body_len;
+        int used=http_framing_body(&decoder->framing, data, n, &body_len);
+        if(used<=0)
+            return -1;
+        decoder->pos+=used;
+        if(body_len>0){
+            decoder->run=(const unsigned char*)data+used-body_len;
+            decoder->strm.next_in=(Bytef*)decoder->run;
+            decoder->strm.avail_in=body_len;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+//inflates into out until it is full or the body ends, returns the bytes written or -1
+static int inflate_into(response_decoder* decoder, char* out, int out_len, int* ended){
+    z_stream* strm=&decoder->strm;
+    strm->next_out=(Bytef*)out;
+    strm->avail_out=out_len;
+    *ended=0;
+    while(strm->avail_out>0){
+        if(strm->avail_in==0 && next_input(decoder)<0)
+            return -1; //the body ended before the compressed stream did
+        int ret=inflate(strm, Z_NO_FLUSH);
+        if(ret==Z_STREAM_END){
+            *ended=1;
+            break;
+        }
+        if(ret==Z_DATA_ERROR && decoder->source->encoding==ENCODING_DEFLATE && !decoder->raw &&
+            strm->total_out==0 && (size_t)((const unsigned char*)strm->next_in-decoder->run)>=strm->total_in){
+            //some servers send raw deflate without the zlib header, start over reading it that way
+            strm->avail_in+=strm->total_in;
+            strm->next_in-=strm->total_in;
+            if(inflateReset2(strm, -MAX_WBITS)!=Z_OK)
+                return -1;
+            decoder->raw=1;
+            continue;
+        }
+        if(ret!=Z_OK && ret!=Z_BUF_ERROR)
+            return -1;
+    }
+    return out_len-strm->avail_out;
+}
+
+int response_decoder_read(response_decoder* decoder, char* out, int out_len){
+    if(decoder->state==DECODE_HEAD){
+        int n=decoder->head_len-decoder->head_pos;
+        if(n>out_len)
+            n=out_len;
+        memcpy(out, decoder->head+decoder->head_pos, n);
+        decoder->head_pos+=n;
+        if(decoder->head_pos==decoder->head_len)
+            decoder->state=DECODE_BODY;
+        return n;
+    }
+
+    int written=0;
+    if(decoder->state==DECODE_BODY && !decoder->chunked){
+        //the body as it inflates, its end is the connection closing
+        int ended;
+        written=inflate_into(decoder, out, out_len, &ended);
+        if(written<0)
+            return -1;
+        if(ended)
+            decoder->state=DECODE_DONE;
+        return written;
+    }
+    if(decoder->state==DECODE_BODY){
+        //each read is one chunk, its size line written once the size is known
+        int room=out_len-CHUNK_LINE-2;
+        if(room>CHUNK_MAX)
+            room=CHUNK_MAX;
+        int ended;
+        int n=inflate_into(decoder, out+CHUNK_LINE, room, &ended);
+        if(n<0)
+            return -1;
+        if(n>0){
+            static const char hex[]="0123456789abcdef";
+            for(int i=0;i<4;i++)
+                out[i]=hex[(n>>(12-4*i)) & 0xf];
+            memcpy(out+4, "\r\n", 2);
+            memcpy(out+CHUNK_LINE+n, "\r\n", 2);
+            written=CHUNK_LINE+n+2;
+        }
+        if(ended)
+            decoder->state=DECODE_LAST;
+    }
+    if(decoder->state==DECODE_LAST && out_len-written>=5){
+        memcpy(out+written, "0\r\n\r\n", 5);
+        written+=5;
+        decoder->state=DECODE_DONE;
+    }
+    return written;
+}
+
+int response_decoder_head_done(response_decoder* decoder){
+    return decoder->state!=DECODE_HEAD;
+}
+
+void response_decoder_free(response_decoder* decoder){
+    if(decoder->head==NULL)
+        return;
+    inflateEnd(&decoder->strm);
+    http_framing_free(&decoder->framing);
+    free(decoder->head);
+    decoder->head=NULL;
+}
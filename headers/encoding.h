@@ -0,0 +1,70 @@
+/*
+ * encoding.h -- content codings of cached responses.
+ *
+ * The cache keeps a response in the content coding the origin sent it in,
+ * so a gzip body takes its compressed size in memory and goes out unchanged
+ * to every client whose Accept-Encoding takes gzip.
+ *
+ * A client that does not accept the stored coding is sent the response
+ * inflated by a response_decoder. The decoder walks the stored bytes, skips
+ * their chunk framing, and inflates the body a piece at a time as the
+ * client reads it. The length of the result is not known up front, so it
+ * goes out with chunked transfer coding, or to HTTP/1.0 clients, which do
+ * not know chunked, delimited by closing the connection. Nothing is
+ * inflated for clients that accept the coding.
+ */
+
+#include <zlib.h>
+
+#include "proxy_parse.h"
+#include "http_response.h"
+#include "cache.h"
+
+#ifndef ENCODING
+#define ENCODING
+
+#define ENCODING_IDENTITY 0
+#define ENCODING_GZIP 1
+#define ENCODING_DEFLATE 2
+#define ENCODING_OTHER 3 //a coding the proxy cannot undo, or several stacked
+
+#define DECODER_MIN_OUT 64 //smallest buffer response_decoder_read() fills
+
+/* ENCODING_* of the response whose head is given, from its Content-Encoding */
+int encoding_of(const char* head, int head_len);
+
+/* 1 when request's Accept-Encoding takes every content coding of the
+ * response whose head is given. A request without Accept-Encoding only
+ * takes identity, what clients that never ask for compression expect */
+int encoding_accepted(ParsedRequest* request, const char* head, int head_len);
+
+typedef struct response_decoder {
+    cache_element* source; //gzip or deflate response, pinned by the caller
+    size_t pos; //next byte of source to look at
+    http_framing framing; //tells the body apart from the head and chunk framing
+    z_stream strm;
+    const unsigned char* run; //body bytes strm.next_in was last pointed at
+    int raw; //deflate body sent without the zlib wrapper
+    char* head; //rewritten head, sent before the body
+    int head_len;
+    int head_pos;
+    int chunked; //body written as chunks, otherwise it ends where the connection is closed
+    int state;
+} response_decoder;
+
+/* Prepare to send source with identity coding, chunked or for a connection
+ * closed after it. Returns 0 or -1 */
+int response_decoder_init(response_decoder* decoder, cache_element* source, int chunked);
+
+/* Write the next bytes of the identity response into out, which holds at
+ * least DECODER_MIN_OUT bytes. Returns how many were written, 0 once the
+ * response is complete and -1 when the stored body is corrupt */
+int response_decoder_read(response_decoder* decoder, char* out, int out_len);
+
+/* 1 once the whole head has been returned by response_decoder_read() */
+int response_decoder_head_done(response_decoder* decoder);
+
+/* Release the inflate state, the source stays pinned */
+void response_decoder_free(response_decoder* decoder);
+
+#endif
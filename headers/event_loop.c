@@ -0,0 +1,385 @@
+/*
+  event_loop.c -- edge-triggered epoll reactor used by the proxy workers.
+*/
+
+#include "event_loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+int set_nonblocking(int fd){
+    int flags=fcntl(fd, F_GETFL, 0);
+    if(flags<0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void release_garbage(event_loop* loop){
+    for(int i=0;i<loop->garbage_len;i++)
+        free(loop->garbage[i]);
+    loop->garbage_len=0;
+}
+
+void event_loop_free_later(event_loop* loop, void* ptr){
+    if(loop->garbage_len==loop->garbage_cap){
+        int cap=loop->garbage_cap ? loop->garbage_cap*2 : 64;
+        void** grown=(void**)realloc(loop->garbage, cap*sizeof(void*));
+        if(grown==NULL){
+            //nothing else can reference ptr once the batch is over, leaking is the safe choice
+            fprintf(stderr, "Error growing loop garbage list\n");
+            return;
+        }
+        loop->garbage=grown;
+        loop->garbage_cap=cap;
+    }
+    loop->garbage[loop->garbage_len++]=ptr;
+}
+
+unsigned long long event_loop_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+void event_timer_init(event_timer* timer, timer_callback callback, void* data){
+    timer->deadline=0;
+    timer->index=-1;
+    timer->callback=callback;
+    timer->data=data;
+}
+
+static void heap_set(event_loop* loop, int index, event_timer* timer){
+    loop->timers[index]=timer;
+    timer->index=index;
+}
+
+static void heap_up(event_loop* loop, int index){
+    event_timer* timer=loop->timers[index];
+    while(index>0){
+        int parent=(index-1)/2;
+        if(loop->timers[parent]->deadline<=timer->deadline)
+            break;
+        heap_set(loop, index, loop->timers[parent]);
+        index=parent;
+    }
+    heap_set(loop, index, timer);
+}
+
+static void heap_down(event_loop* loop, int index){
+    event_timer* timer=loop->timers[index];
+    while(1){
+        int child=2*index+1;
+        if(child>=loop->timers_len)
+            break;
+        if(child+1<loop->timers_len && loop->timers[child+1]->deadline<loop->timers[child]->deadline)
+            child++;
+        if(loop->timers[child]->deadline>=timer->deadline)
+            break;
+        heap_set(loop, index, loop->timers[child]);
+        index=child;
+    }
+    heap_set(loop, index, timer);
+}
+
+void event_loop_timer_cancel(event_loop* loop, event_timer* timer){
+    int index=timer->index;
+    if(index<0)
+        return;
+    timer->index=-1;
+    loop->timers_len--;
+    if(index==loop->timers_len)
+        return;
+    //fill the hole with the last timer and restore the heap around it
+    event_timer* moved=loop->timers[loop->timers_len];
+    heap_set(loop, index, moved);
+    heap_up(loop, index);
+    heap_down(loop, moved->index);
+}
+
+int event_loop_timer_add(event_loop* loop, event_timer* timer, unsigned long ms){
+    event_loop_timer_cancel(loop, timer);
+    if(loop->timers_len==loop->timers_cap){
+        int cap=loop->timers_cap ? loop->timers_cap*2 : 64;
+        event_timer** grown=(event_timer**)realloc(loop->timers, cap*sizeof(event_timer*));
+        if(grown==NULL){
+            fprintf(stderr, "Error growing loop timer heap\n");
+            return -1;
+        }
+        loop->timers=grown;
+        loop->timers_cap=cap;
+    }
+    timer->deadline=event_loop_now()+ms;
+    heap_set(loop, loop->timers_len++, timer);
+    heap_up(loop, timer->index);
+    return 0;
+}
+
+//milliseconds epoll_wait may sleep, -1 without armed timers
+static int next_timeout(event_loop* loop){
+    if(loop->timers_len==0)
+        return -1;
+    unsigned long long now=event_loop_now();
+    unsigned long long deadline=loop->timers[0]->deadline;
+    if(deadline<=now)
+        return 0;
+    unsigned long long wait=deadline-now;
+    return wait>1000000 ? 1000000 : (int)wait;
+}
+
+static void run_timers(event_loop* loop){
+    unsigned long long now=event_loop_now();
+    while(loop->timers_len>0 && loop->timers[0]->deadline<=now){
+        event_timer* timer=loop->timers[0];
+        event_loop_timer_cancel(loop, timer);
+        //the callback may rearm the timer
+        timer->callback(loop, timer);
+    }
+}
+
+int event_loop_post(event_loop* loop, task_callback callback, void* arg){
+    loop_task* task=(loop_task*)malloc(sizeof(loop_task));
+    if(task==NULL)
+        return -1;
+    task->callback=callback;
+    task->arg=arg;
+    task->next=NULL;
+
+    pthread_mutex_lock(&loop->tasks_lock);
+    if(loop->tasks_tail!=NULL)
+        loop->tasks_tail->next=task;
+    else
+        loop->tasks_head=task;
+    loop->tasks_tail=task;
+    pthread_mutex_unlock(&loop->tasks_lock);
+
+    event_loop_wake(loop);
+    return 0;
+}
+
+static void run_tasks(event_loop* loop){
+    //detach the whole list, tasks posted while these run wake the loop again
+    pthread_mutex_lock(&loop->tasks_lock);
+    loop_task* task=loop->tasks_head;
+    loop->tasks_head=NULL;
+    loop->tasks_tail=NULL;
+    pthread_mutex_unlock(&loop->tasks_lock);
+
+    while(task!=NULL){
+        loop_task* next=task->next;
+        task->callback(loop, task->arg);
+        free(task);
+        task=next;
+    }
+}
+
+//interrupts epoll_wait, sockets are adopted before the loop waits again
+static void wake_callback(event_loop* loop, io_watcher* watcher, uint32_t events){
+    uint64_t value;
+    while(read(loop->wake_fd, &value, sizeof(value))>0);
+    run_tasks(loop);
+    if(loop->on_wake!=NULL)
+        loop->on_wake(loop);
+}
+
+//sharded mode: drain the accept backlog of our own listener, edge triggered
+static void listen_callback(event_loop* loop, io_watcher* watcher, uint32_t events){
+    while(1){
+        int fd=accept4(watcher->fd, NULL, NULL, SOCK_NONBLOCK);
+        if(fd<0){
+            if(errno==EINTR || errno==ECONNABORTED)
+                continue;
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK)
+                perror("Error accepting connection");
+            //the connections still queued raise no new edge, try again once descriptors may be free
+            if(errno==EMFILE || errno==ENFILE || errno==ENOBUFS || errno==ENOMEM)
+                event_loop_timer_add(loop, &loop->accept_timer, ACCEPT_RETRY_MS);
+            return;
+        }
+        loop->on_accept(loop, fd);
+    }
+}
+
+static void accept_retry(event_loop* loop, event_timer* timer){
+    listen_callback(loop, &loop->listen_watcher, EPOLLIN);
+}
+
+//take queued sockets from our own queue, then steal half of what each sibling has waiting
+static void adopt_sockets(event_loop* loop){
+    int fd;
+    while(accept_queue_pop(&loop->queue, &fd)==0)
+        loop->on_accept(loop, fd);
+
+    worker_pool* pool=loop->pool;
+    if(pool==NULL)
+        return;
+    for(int i=1;i<pool->size;i++){
+        event_loop* victim=&pool->loops[(loop->id+i)%pool->size];
+        size_t waiting=accept_queue_size(&victim->queue);
+        size_t steal=(waiting+1)/2;
+        while(steal>0 && accept_queue_pop(&victim->queue, &fd)==0){
+            loop->on_accept(loop, fd);
+            steal--;
+        }
+    }
+}
+
+int event_loop_init(event_loop* loop, int id, size_t queue_size, accept_callback on_accept){
+    memset(loop, 0, sizeof(*loop));
+    loop->id=id;
+    loop->on_accept=on_accept;
+
+    loop->epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epoll_fd<0){
+        perror("epoll_create1 failed");
+        return -1;
+    }
+
+    loop->wake_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(loop->wake_fd<0){
+        perror("eventfd failed");
+        close(loop->epoll_fd);
+        return -1;
+    }
+    pthread_mutex_init(&loop->tasks_lock, NULL);
+
+    if(accept_queue_init(&loop->queue, queue_size)<0){
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    loop->listen_watcher.fd=-1;
+    loop->wake_watcher.fd=loop->wake_fd;
+    loop->wake_watcher.callback=wake_callback;
+    loop->wake_watcher.data=NULL;
+    if(event_loop_add(loop, &loop->wake_watcher, EPOLLIN | EPOLLET)<0){
+        accept_queue_destroy(&loop->queue);
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    loop->running=1;
+    return 0;
+}
+
+int event_loop_add(event_loop* loop, io_watcher* watcher, uint32_t events){
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events=events;
+    ev.data.ptr=watcher;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watcher->fd, &ev);
+}
+
+int event_loop_modify(event_loop* loop, io_watcher* watcher, uint32_t events){
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events=events;
+    ev.data.ptr=watcher;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watcher->fd, &ev);
+}
+
+int event_loop_remove(event_loop* loop, io_watcher* watcher){
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+}
+
+int event_loop_listen(event_loop* loop, int fd){
+    if(set_nonblocking(fd)<0)
+        return -1;
+    loop->listen_watcher.fd=fd;
+    loop->listen_watcher.callback=listen_callback;
+    loop->listen_watcher.data=NULL;
+    event_timer_init(&loop->accept_timer, accept_retry, NULL);
+    return event_loop_add(loop, &loop->listen_watcher, EPOLLIN | EPOLLET);
+}
+
+int event_loop_pin(event_loop* loop, int cpu){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(loop->thread, sizeof(set), &set);
+}
+
+void event_loop_wake(event_loop* loop){
+    uint64_t one=1;
+    //EAGAIN only means the counter is saturated, the loop is awake either way
+    if(write(loop->wake_fd, &one, sizeof(one))<0 && errno!=EAGAIN)
+        perror("Error waking event loop");
+}
+
+void event_loop_run(event_loop* loop){
+    struct epoll_event events[MAX_EVENTS];
+
+    while(loop->running){
+        adopt_sockets(loop);
+
+        int n=epoll_wait(loop->epoll_fd, events, MAX_EVENTS, next_timeout(loop));
+        if(n<0){
+            if(errno==EINTR)
+                continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for(int i=0;i<n;i++){
+            io_watcher* watcher=(io_watcher*)events[i].data.ptr;
+            watcher->callback(loop, watcher, events[i].events);
+        }
+        run_timers(loop);
+        release_garbage(loop);
+    }
+}
+
+static void* loop_thread(void* arg){
+    event_loop_run((event_loop*)arg);
+    return NULL;
+}
+
+int event_loop_start(event_loop* loop){
+    return pthread_create(&loop->thread, NULL, loop_thread, loop);
+}
+
+int worker_pool_start(worker_pool* pool, int size, size_t queue_size, accept_callback on_accept, wake_callback_fn on_wake){
+    pool->loops=(event_loop*)calloc(size, sizeof(event_loop));
+    if(pool->loops==NULL)
+        return -1;
+    pool->size=size;
+    pool->next=0;
+
+    for(int i=0;i<size;i++){
+        if(event_loop_init(&pool->loops[i], i, queue_size, on_accept)<0)
+            return -1;
+        pool->loops[i].pool=pool;
+        pool->loops[i].on_wake=on_wake;
+    }
+    //start only once every queue exists, running loops steal from all of them
+    for(int i=0;i<size;i++){
+        if(event_loop_start(&pool->loops[i])!=0)
+            return -1;
+    }
+    return 0;
+}
+
+int worker_pool_submit(worker_pool* pool, int fd){
+    for(int attempt=0;attempt<pool->size;attempt++){
+        event_loop* loop=&pool->loops[pool->next];
+        pool->next=(pool->next+1)%pool->size;
+
+        if(accept_queue_push(&loop->queue, fd)==0){
+            event_loop_wake(loop);
+            //the owner is still busy with earlier sockets, let the next loop steal
+            if(pool->size>1 && accept_queue_size(&loop->queue)>1)
+                event_loop_wake(&pool->loops[pool->next]);
+            return 0;
+        }
+    }
+    return -1;
+}
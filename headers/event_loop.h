@@ -0,0 +1,173 @@
+/*
+ * event_loop.h -- edge-triggered epoll reactor used by the proxy workers.
+ *
+ * Every worker thread owns one event_loop. Sockets are registered through
+ * io_watcher objects whose callback runs on the owning loop thread, so a
+ * connection is only ever touched by a single thread.
+ *
+ * The loops of a worker_pool are the proxy's fixed set of workers. The
+ * acceptor submits client sockets to the pool, which pushes them onto the
+ * lock-free queue of one loop and wakes it through an eventfd. A loop that
+ * is about to go idle adopts its own queue and then steals from its
+ * siblings, so a busy worker never sits on sockets others could serve.
+ *
+ * In sharded mode every loop instead accepts on its own SO_REUSEPORT
+ * listening socket registered with event_loop_listen(), the kernel spreads
+ * incoming connections across the listeners and no socket crosses threads.
+ *
+ * Each loop also keeps a binary heap of one-shot timers ordered by their
+ * monotonic deadline, and epoll_wait sleeps at most until the earliest one.
+ * Other threads hand work to a loop with event_loop_post(), the task runs
+ * on the loop thread the next time it wakes.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "accept_queue.h"
+
+#ifndef EVENT_LOOP
+#define EVENT_LOOP
+
+#define MAX_EVENTS 256
+#define ACCEPT_QUEUE_SIZE 1024 //default per-loop queue of accepted sockets
+#define ACCEPT_RETRY_MS 100 //wait before accepting again after running out of descriptors
+
+typedef struct event_loop event_loop;
+typedef struct worker_pool worker_pool;
+typedef struct io_watcher io_watcher;
+typedef struct event_timer event_timer;
+typedef struct loop_task loop_task;
+
+/* Called on the loop thread with the epoll event mask that fired for fd */
+typedef void (*io_callback)(event_loop* loop, io_watcher* watcher, uint32_t events);
+
+/* Called on the loop thread for every socket the loop adopts */
+typedef void (*accept_callback)(event_loop* loop, int fd);
+
+/* Called on the loop thread after another thread woke it */
+typedef void (*wake_callback_fn)(event_loop* loop);
+
+/* Called on the loop thread for a task posted with event_loop_post() */
+typedef void (*task_callback)(event_loop* loop, void* arg);
+
+/* Called on the loop thread once the timer's deadline has passed */
+typedef void (*timer_callback)(event_loop* loop, event_timer* timer);
+
+struct io_watcher {
+    int fd;
+    io_callback callback;
+    void* data;
+};
+
+struct loop_task {
+    task_callback callback;
+    void* arg;
+    loop_task* next;
+};
+
+struct event_timer {
+    unsigned long long deadline; //monotonic milliseconds
+    int index; //position in the loop's heap, -1 while not armed
+    timer_callback callback;
+    void* data;
+};
+
+struct event_loop {
+    int id;
+    int epoll_fd;
+    int wake_fd; //eventfd, written by other threads to wake the loop
+    io_watcher wake_watcher;
+    io_watcher listen_watcher; //own listening socket in sharded mode, fd is -1 otherwise
+    event_timer accept_timer; //drains the listener again after accept ran out of descriptors
+    pthread_t thread;
+    volatile int running;
+
+    accept_callback on_accept;
+    wake_callback_fn on_wake; //may be NULL
+    void* data; //owned by the callbacks, only touched on the loop thread
+
+    worker_pool* pool; //siblings to steal accepted sockets from
+    accept_queue queue; //accepted sockets waiting to be adopted
+
+    //tasks posted by other threads, run in order on the loop thread
+    pthread_mutex_t tasks_lock;
+    loop_task* tasks_head;
+    loop_task* tasks_tail;
+
+    //armed timers, earliest deadline first
+    event_timer** timers;
+    int timers_len;
+    int timers_cap;
+
+    //memory released after the current batch of events has been dispatched
+    void** garbage;
+    int garbage_len;
+    int garbage_cap;
+};
+
+struct worker_pool {
+    event_loop* loops;
+    int size;
+    int next; //round robin cursor, only used by the acceptor thread
+};
+
+/* Set up the epoll instance, wakeup eventfd and accept queue.
+ * Returns 0 or -1 on error */
+int event_loop_init(event_loop* loop, int id, size_t queue_size, accept_callback on_accept);
+
+/* Run the loop on a new thread */
+int event_loop_start(event_loop* loop);
+
+/* Dispatch events on the calling thread until running is cleared */
+void event_loop_run(event_loop* loop);
+
+/* Register, modify or remove a watcher on the loop's epoll instance */
+int event_loop_add(event_loop* loop, io_watcher* watcher, uint32_t events);
+int event_loop_modify(event_loop* loop, io_watcher* watcher, uint32_t events);
+int event_loop_remove(event_loop* loop, io_watcher* watcher);
+
+/* Accept connections on the listening socket fd directly on this loop */
+int event_loop_listen(event_loop* loop, int fd);
+
+/* Restrict the loop thread to a single cpu */
+int event_loop_pin(event_loop* loop, int cpu);
+
+/* Prepare a timer that is not armed yet */
+void event_timer_init(event_timer* timer, timer_callback callback, void* data);
+
+/* Arm timer to fire after ms milliseconds, rearming it if already armed.
+ * Loop thread only. Returns 0 or -1 */
+int event_loop_timer_add(event_loop* loop, event_timer* timer, unsigned long ms);
+
+/* Disarm timer, harmless when it is not armed. Loop thread only */
+void event_loop_timer_cancel(event_loop* loop, event_timer* timer);
+
+/* Current monotonic time in milliseconds */
+unsigned long long event_loop_now();
+
+/* Run callback(loop, arg) on the loop thread. Safe to call from any thread.
+ * Returns 0 or -1 when the task could not be queued */
+int event_loop_post(event_loop* loop, task_callback callback, void* arg);
+
+/* Interrupt epoll_wait on the loop. Safe to call from any thread */
+void event_loop_wake(event_loop* loop);
+
+/* Create size loops, each with a queue of queue_size sockets, and start
+ * them on their own threads. on_wake (may be NULL) runs whenever a loop is
+ * woken with event_loop_wake(). Returns 0 or -1 on error */
+int worker_pool_start(worker_pool* pool, int size, size_t queue_size, accept_callback on_accept, wake_callback_fn on_wake);
+
+/* Queue an accepted socket on the next loop with room for it. Returns -1
+ * when every queue is full and the caller has to shed the connection */
+int worker_pool_submit(worker_pool* pool, int fd);
+
+/* free() ptr once the events of the current batch have been dispatched, so
+ * callbacks queued in the same batch never see freed memory */
+void event_loop_free_later(event_loop* loop, void* ptr);
+
+/* Set O_NONBLOCK on fd */
+int set_nonblocking(int fd);
+
+#endif
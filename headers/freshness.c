@@ -0,0 +1,224 @@
+/*
+  freshness.c -- HTTP expiration and validation of stored responses.
+*/
+
+#include "freshness.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_response.h"
+
+//Cache-Control directives the cache acts on
+typedef struct directives {
+    long max_age; //-1 when absent
+    long s_maxage;
+    long stale_while_revalidate; //-1 when absent, like the rest
+    long stale_if_error;
+    int no_store;
+    int no_cache;
+    int is_private;
+    int is_public;
+    int must_revalidate;
+} directives;
+
+static int name_is(const char* name, int len, const char* directive){
+    return len==(int)strlen(directive) && strncasecmp(name, directive, len)==0;
+}
+
+//delta-seconds argument, -1 when missing or not a number
+static long delta_seconds(const char* arg, int len){
+    if(len>=2 && arg[0]=='"' && arg[len-1]=='"'){
+        arg++;
+        len-=2;
+    }
+    if(len==0)
+        return -1;
+    long seconds=0;
+    for(int i=0;i<len;i++){
+        if(arg[i]<'0' || arg[i]>'9')
+            return -1;
+        //saturate, anything beyond a few decades is as good as forever
+        if(seconds<0x7fffffffL/10)
+            seconds=seconds*10+(arg[i]-'0');
+    }
+    return seconds;
+}
+
+static void parse_cache_control(const char* value, int len, directives* d){
+    const char* end=value+len;
+    while(value<end){
+        const char* comma=(const char*)memchr(value, ',', end-value);
+        const char* item_end=comma!=NULL ? comma : end;
+        while(value<item_end && (*value==' ' || *value=='\t'))
+            value++;
+        const char* eq=value;
+        while(eq<item_end && *eq!='=')
+            eq++;
+        const char* name_end=eq;
+        while(name_end>value && (name_end[-1]==' ' || name_end[-1]=='\t'))
+            name_end--;
+        const char* arg=eq<item_end ? eq+1 : item_end;
+        const char* arg_end=item_end;
+        while(arg<arg_end && (*arg==' ' || *arg=='\t'))
+            arg++;
+        while(arg_end>arg && (arg_end[-1]==' ' || arg_end[-1]=='\t'))
+            arg_end--;
+        int name_len=name_end-value;
+
+        //no-cache="Set-Cookie" and private="..." are taken for the whole response
+        if(name_is(value, name_len, "max-age"))
+            d->max_age=delta_seconds(arg, arg_end-arg);
+        else if(name_is(value, name_len, "s-maxage"))
+            d->s_maxage=delta_seconds(arg, arg_end-arg);
+        else if(name_is(value, name_len, "stale-while-revalidate"))
+            d->stale_while_revalidate=delta_seconds(arg, arg_end-arg);
+        else if(name_is(value, name_len, "stale-if-error"))
+            d->stale_if_error=delta_seconds(arg, arg_end-arg);
+        else if(name_is(value, name_len, "no-store"))
+            d->no_store=1;
+        else if(name_is(value, name_len, "no-cache"))
+            d->no_cache=1;
+        else if(name_is(value, name_len, "private"))
+            d->is_private=1;
+        else if(name_is(value, name_len, "public"))
+            d->is_public=1;
+        else if(name_is(value, name_len, "must-revalidate") || name_is(value, name_len, "proxy-revalidate"))
+            d->must_revalidate=1;
+        value=comma!=NULL ? comma+1 : end;
+    }
+}
+
+time_t freshness_parse_date(const char* value, int len){
+    //IMF-fixdate first, then the obsolete RFC 850 and asctime forms
+    static const char* formats[]={"%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y"};
+    char date[64];
+    if(value==NULL || len<=0 || len>=(int)sizeof(date))
+        return -1;
+    memcpy(date, value, len);
+    date[len]='\0';
+    for(int i=0;i<3;i++){
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* end=strptime(date, formats[i], &tm);
+        if(end!=NULL && *end=='\0')
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+//statuses whose responses may be stored with a lifetime guessed from Last-Modified
+static int heuristically_cacheable(int status){
+    static const int statuses[]={200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+    for(size_t i=0;i<sizeof(statuses)/sizeof(statuses[0]);i++){
+        if(statuses[i]==status)
+            return 1;
+    }
+    return 0;
+}
+
+//the response's header, or the stored one it refreshes when the response leaves it out
+static const char* header_or_stored(const char* head, int head_len, const char* stored_head, int stored_len,
+    const char* name, int* len){
+    const char* value=http_response_header(head, head_len, name, len);
+    if(value==NULL && stored_head!=NULL)
+        value=http_response_header(stored_head, stored_len, name, len);
+    return value;
+}
+
+void freshness_of(const char* head, int head_len, const char* stored_head, int stored_len,
+    ParsedRequest* request, time_t now, freshness* out){
+    directives d;
+    memset(&d, 0, sizeof(d));
+    d.max_age=-1;
+    d.s_maxage=-1;
+    d.stale_while_revalidate=-1;
+    d.stale_if_error=-1;
+    int len;
+    const char* value=header_or_stored(head, head_len, stored_head, stored_len, "Cache-Control", &len);
+    if(value!=NULL)
+        parse_cache_control(value, len, &d);
+    if(value==NULL){
+        value=header_or_stored(head, head_len, stored_head, stored_len, "Pragma", &len);
+        d.no_cache=value!=NULL && len>=8 && strncasecmp(value, "no-cache", 8)==0;
+    }
+
+    //Date and Age describe this response, never the stored one
+    const char* status_line=stored_head!=NULL ? stored_head : head;
+    int status_len=stored_head!=NULL ? stored_len : head_len;
+    int status=status_len>12 ? atoi(status_line+9) : 0;
+    value=http_response_header(head, head_len, "Date", &len);
+    time_t date=freshness_parse_date(value, value!=NULL ? len : 0);
+    if(date<0)
+        date=now;
+    value=http_response_header(head, head_len, "Age", &len);
+    long age=value!=NULL ? delta_seconds(value, len) : 0;
+    long initial_age=now>date ? (long)(now-date) : 0;
+    if(age>initial_age)
+        initial_age=age;
+
+    int has_etag=header_or_stored(head, head_len, stored_head, stored_len, "ETag", &len)!=NULL;
+    const char* modified=header_or_stored(head, head_len, stored_head, stored_len, "Last-Modified", &len);
+    time_t last_modified=freshness_parse_date(modified, modified!=NULL ? len : 0);
+    out->validator=has_etag || last_modified>=0;
+
+    long lifetime=0;
+    int explicit_lifetime=1;
+    if(d.s_maxage>=0){
+        lifetime=d.s_maxage;
+    }else if(d.max_age>=0){
+        lifetime=d.max_age;
+    }else if((value=header_or_stored(head, head_len, stored_head, stored_len, "Expires", &len))!=NULL){
+        //an Expires that does not parse means already expired
+        time_t expires=freshness_parse_date(value, len);
+        lifetime=expires>date ? (long)(expires-date) : 0;
+    }else{
+        explicit_lifetime=0;
+        if(last_modified>=0 && last_modified<date && heuristically_cacheable(status)){
+            lifetime=(long)(date-last_modified)/10;
+            if(lifetime>FRESHNESS_HEURISTIC_MAX)
+                lifetime=FRESHNESS_HEURISTIC_MAX;
+        }
+    }
+    if(d.no_cache)
+        lifetime=0;
+    out->expires=now-initial_age+lifetime;
+
+    //serving stale is what no-cache and must-revalidate forbid
+    int stale_allowed=!d.no_cache && !d.must_revalidate;
+    out->stale_while_revalidate=stale_allowed && d.stale_while_revalidate>0 ? d.stale_while_revalidate : 0;
+    out->stale_if_error=stale_allowed && d.stale_if_error>0 ? d.stale_if_error : 0;
+
+    //what a shared cache must not keep, or has no use keeping
+    out->storable=!d.no_store && !d.is_private &&
+        (heuristically_cacheable(status) || (explicit_lifetime && (status==302 || status==307))) &&
+        (lifetime>initial_age || out->validator);
+    if(request!=NULL && out->storable){
+        struct ParsedHeader* header=ParsedHeader_getKnown(request, PARSED_HEADER_CACHE_CONTROL);
+        if(header!=NULL){
+            directives asked;
+            memset(&asked, 0, sizeof(asked));
+            parse_cache_control(header->value, strlen(header->value), &asked);
+            if(asked.no_store)
+                out->storable=0;
+        }
+        //answers to authenticated requests are the user's own unless the origin says otherwise
+        if(ParsedHeader_get(request, "Authorization")!=NULL && !d.is_public && d.s_maxage<0 && !d.must_revalidate)
+            out->storable=0;
+    }
+}
+
+int freshness_request_revalidates(ParsedRequest* request){
+    struct ParsedHeader* header=ParsedHeader_getKnown(request, PARSED_HEADER_CACHE_CONTROL);
+    if(header!=NULL){
+        directives d;
+        memset(&d, 0, sizeof(d));
+        d.max_age=-1;
+        d.s_maxage=-1;
+        parse_cache_control(header->value, strlen(header->value), &d);
+        return d.no_cache || d.max_age==0;
+    }
+    header=ParsedHeader_getKnown(request, PARSED_HEADER_PRAGMA);
+    return header!=NULL && strncasecmp(header->value, "no-cache", 8)==0;
+}
@@ -0,0 +1,53 @@
+/*
+ * freshness.h -- HTTP expiration and validation of stored responses.
+ *
+ * The rules of RFC 9111 a shared cache needs: whether a response may be
+ * stored at all, and until when it may be sent without asking the origin.
+ * The freshness lifetime comes from s-maxage, max-age or Expires, in that
+ * order, and otherwise from the Last-Modified heuristic. It is counted from
+ * the response's age when it arrived, so a response that already spent
+ * time in another cache expires sooner.
+ *
+ * Once a response is stale it is revalidated with If-None-Match or
+ * If-Modified-Since built from its ETag and Last-Modified. A 304 answer
+ * refreshes the expiry of the stored copy from the headers it carries,
+ * taking the rest from the stored head.
+ *
+ * The stale-while-revalidate and stale-if-error extensions of RFC 5861
+ * give the time past expiry during which the stale copy may still be sent
+ * while it is refreshed in the background, or instead of an origin error.
+ */
+
+#include <time.h>
+
+#include "proxy_parse.h"
+
+#ifndef FRESHNESS
+#define FRESHNESS
+
+#define FRESHNESS_HEURISTIC_MAX (24*3600) //longest lifetime guessed from Last-Modified
+
+typedef struct freshness {
+    int storable; //0 for no-store, private, statuses that are not reusable, or nothing to reuse
+    time_t expires; //fresh before this time, may already be in the past
+    long stale_while_revalidate; //seconds past expires the copy may be sent while it is refreshed
+    long stale_if_error; //seconds past expires the copy may be sent when the origin fails
+    int validator; //1 when an ETag or Last-Modified allows revalidation
+} freshness;
+
+/* Freshness of the response whose head is given, received at now. When a
+ * 304 refreshes a stored response, stored_head supplies the headers the 304
+ * leaves out and its status, otherwise it is NULL. request is the request
+ * the response answers, NULL when refreshing */
+void freshness_of(const char* head, int head_len, const char* stored_head, int stored_len,
+    ParsedRequest* request, time_t now, freshness* out);
+
+/* 1 when request wants the stored response revalidated even if it is fresh:
+ * Cache-Control no-cache or max-age=0, or Pragma: no-cache */
+int freshness_request_revalidates(ParsedRequest* request);
+
+/* Seconds since the epoch of an HTTP-date in any of its three formats, -1
+ * when value is not one */
+time_t freshness_parse_date(const char* value, int len);
+
+#endif
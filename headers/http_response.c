@@ -0,0 +1,276 @@
+/*
+  http_response.c -- helpers for reading the head of an origin response.
+*/
+
+#include "http_response.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+int http_response_head_len(const char* buf, int len){
+    for(int i=0;i+3<len;i++){
+        if(buf[i]=='\r' && buf[i+1]=='\n' && buf[i+2]=='\r' && buf[i+3]=='\n')
+            return i+4;
+    }
+    return -1;
+}
+
+const char* http_response_header(const char* head, int head_len, const char* name, int* value_len){
+    int name_len=strlen(name);
+    const char* end=head+head_len;
+
+    //skip the status line
+    const char* line=(const char*)memchr(head, '\n', head_len);
+    if(line==NULL)
+        return NULL;
+    line++;
+
+    while(line<end){
+        const char* eol=(const char*)memchr(line, '\n', end-line);
+        if(eol==NULL)
+            eol=end;
+
+        if(eol-line>name_len && line[name_len]==':' && strncasecmp(line, name, name_len)==0){
+            const char* value=line+name_len+1;
+            const char* value_end=eol;
+            while(value<value_end && (*value==' ' || *value=='\t'))
+                value++;
+            while(value_end>value && (value_end[-1]=='\r' || value_end[-1]==' ' || value_end[-1]=='\t'))
+                value_end--;
+            *value_len=value_end-value;
+            return value;
+        }
+        line=eol+1;
+    }
+    return NULL;
+}
+
+void http_framing_init(http_framing* framing, int head_request){
+    memset(framing, 0, sizeof(*framing));
+    framing->state=HTTP_FRAME_HEAD;
+    framing->head_request=head_request;
+}
+
+void http_framing_free(http_framing* framing){
+    free(framing->head);
+    framing->head=NULL;
+    framing->head_len=0;
+}
+
+//"close" in "Keep-Alive, Close", case-insensitive and ignoring surrounding spaces
+static int value_has_token(const char* value, int value_len, const char* token){
+    int token_len=strlen(token);
+    const char* end=value+value_len;
+    while(value<end){
+        const char* comma=(const char*)memchr(value, ',', end-value);
+        const char* item_end=comma!=NULL ? comma : end;
+        while(value<item_end && (*value==' ' || *value=='\t'))
+            value++;
+        const char* trimmed=item_end;
+        while(trimmed>value && (trimmed[-1]==' ' || trimmed[-1]=='\t'))
+            trimmed--;
+        if(trimmed-value==token_len && strncasecmp(value, token, token_len)==0)
+            return 1;
+        value=item_end+1;
+    }
+    return 0;
+}
+
+//the head is complete: pick how the body is delimited and whether the connection survives it
+static int start_body(http_framing* framing, const char* head, int head_len){
+    if(head_len<12 || strncmp(head, "HTTP/1.", 7)!=0)
+        return -1;
+    int http11=head[7]=='1';
+    framing->status=atoi(head+9);
+    if(framing->status<100)
+        return -1;
+
+    int value_len;
+    const char* connection=http_response_header(head, head_len, "Connection", &value_len);
+    if(http11)
+        framing->keep_alive=connection==NULL || !value_has_token(connection, value_len, "close");
+    else
+        framing->keep_alive=connection!=NULL && value_has_token(connection, value_len, "keep-alive");
+
+    //read everything needed from the head before it is released
+    const char* encoding=http_response_header(head, head_len, "Transfer-Encoding", &value_len);
+    int chunked=encoding!=NULL && value_has_token(encoding, value_len, "chunked");
+    const char* length=http_response_header(head, head_len, "Content-Length", &value_len);
+    char* length_end=NULL;
+    unsigned long long content_length=length!=NULL ? strtoull(length, &length_end, 10) : 0;
+    if(length!=NULL && length_end==length)
+        return -1;
+    http_framing_free(framing);
+
+    if(framing->status>=100 && framing->status<200 && framing->status!=101){
+        //interim response, the final one follows on the same connection
+        framing->state=HTTP_FRAME_HEAD;
+        return 0;
+    }
+    if(framing->status==101){
+        framing->state=HTTP_FRAME_CLOSE;
+        framing->keep_alive=0;
+        return 0;
+    }
+    if(framing->head_request || framing->status==204 || framing->status==304){
+        framing->state=HTTP_FRAME_DONE;
+        return 0;
+    }
+    if(chunked){
+        framing->state=HTTP_FRAME_CHUNK_SIZE;
+        framing->remaining=0;
+        return 0;
+    }
+    //any other transfer coding is delimited by the end of the connection
+    if(encoding==NULL && length!=NULL){
+        framing->remaining=content_length;
+        framing->state=framing->remaining>0 ? HTTP_FRAME_LENGTH : HTTP_FRAME_DONE;
+        return 0;
+    }
+    framing->state=HTTP_FRAME_CLOSE;
+    framing->keep_alive=0;
+    return 0;
+}
+
+//collect head bytes, returns how many of data were used or -1
+static int feed_head(http_framing* framing, const char* data, int len){
+    //a head that arrives in one read is parsed where it lies, only split heads are collected
+    if(framing->head_len==0){
+        int end=http_response_head_len(data, len);
+        if(end>=0)
+            return start_body(framing, data, end)<0 ? -1 : end;
+    }
+
+    int take=len;
+    if(framing->head_len+take>HTTP_MAX_HEAD)
+        take=HTTP_MAX_HEAD-framing->head_len;
+    char* grown=(char*)realloc(framing->head, framing->head_len+take);
+    if(grown==NULL)
+        return -1;
+    framing->head=grown;
+
+    //the blank line may straddle two reads
+    int from=framing->head_len>3 ? framing->head_len-3 : 0;
+    memcpy(framing->head+framing->head_len, data, take);
+    framing->head_len+=take;
+    int end=http_response_head_len(framing->head+from, framing->head_len-from);
+    if(end<0){
+        if(framing->head_len==HTTP_MAX_HEAD)
+            return -1;
+        return take;
+    }
+
+    int used=from+end-(framing->head_len-take);
+    framing->head_len=from+end;
+    if(start_body(framing, framing->head, framing->head_len)<0)
+        return -1;
+    return used;
+}
+
+//stops after a run of body bytes when body_len is set, the run is the last *body_len bytes used
+static int framing_feed(http_framing* framing, const char* data, int len, int* body_len){
+    int pos=0;
+    while(pos<len && framing->state!=HTTP_FRAME_DONE){
+        char c=data[pos];
+        switch(framing->state){
+            case HTTP_FRAME_HEAD: {
+                int used=feed_head(framing, data+pos, len-pos);
+                if(used<0)
+                    return -1;
+                pos+=used;
+                break;
+            }
+            case HTTP_FRAME_LENGTH:
+            case HTTP_FRAME_CHUNK_DATA: {
+                size_t n=len-pos;
+                if(n>framing->remaining)
+                    n=framing->remaining;
+                pos+=n;
+                framing->remaining-=n;
+                if(framing->remaining==0)
+                    framing->state=framing->state==HTTP_FRAME_LENGTH ? HTTP_FRAME_DONE : HTTP_FRAME_CHUNK_END;
+                if(body_len!=NULL && n>0){
+                    *body_len=n;
+                    return pos;
+                }
+                break;
+            }
+            case HTTP_FRAME_CHUNK_SIZE:
+                pos++;
+                if(isxdigit((unsigned char)c)){
+                    int digit=isdigit((unsigned char)c) ? c-'0' : tolower((unsigned char)c)-'a'+10;
+                    if(framing->remaining>((size_t)-1)>>4)
+                        return -1;
+                    framing->remaining=framing->remaining*16+digit;
+                }else if(c==';' || c==' ' || c=='\t'){
+                    framing->state=HTTP_FRAME_CHUNK_EXT;
+                }else if(c=='\n'){
+                    framing->state=framing->remaining>0 ? HTTP_FRAME_CHUNK_DATA : HTTP_FRAME_TRAILER;
+                    framing->line_len=0;
+                }else if(c!='\r'){
+                    return -1;
+                }
+                break;
+            case HTTP_FRAME_CHUNK_EXT:
+                pos++;
+                if(c=='\n'){
+                    framing->state=framing->remaining>0 ? HTTP_FRAME_CHUNK_DATA : HTTP_FRAME_TRAILER;
+                    framing->line_len=0;
+                }
+                break;
+            case HTTP_FRAME_CHUNK_END:
+                pos++;
+                if(c=='\n'){
+                    framing->state=HTTP_FRAME_CHUNK_SIZE;
+                    framing->remaining=0;
+                }else if(c!='\r'){
+                    return -1;
+                }
+                break;
+            case HTTP_FRAME_TRAILER:
+                pos++;
+                //an empty line ends the trailer section and the response
+                if(c=='\n'){
+                    if(framing->line_len==0)
+                        framing->state=HTTP_FRAME_DONE;
+                    framing->line_len=0;
+                }else if(c!='\r'){
+                    framing->line_len++;
+                }
+                break;
+            case HTTP_FRAME_CLOSE:
+                if(body_len!=NULL)
+                    *body_len=len-pos;
+                pos=len;
+                break;
+        }
+    }
+    return pos;
+}
+
+int http_framing_feed(http_framing* framing, const char* data, int len){
+    return framing_feed(framing, data, len, NULL);
+}
+
+int http_framing_body(http_framing* framing, const char* data, int len, int* body_len){
+    *body_len=0;
+    return framing_feed(framing, data, len, body_len);
+}
+
+size_t http_framing_window(http_framing* framing){
+    if(framing->state==HTTP_FRAME_LENGTH)
+        return framing->remaining;
+    if(framing->state==HTTP_FRAME_CLOSE)
+        return (size_t)-1;
+    return 0;
+}
+
+void http_framing_skip(http_framing* framing, size_t n){
+    if(framing->state!=HTTP_FRAME_LENGTH)
+        return;
+    framing->remaining-=n;
+    if(framing->remaining==0)
+        framing->state=HTTP_FRAME_DONE;
+}
@@ -0,0 +1,75 @@
+/*
+ * http_response.h -- helpers for reading the head of an origin response.
+ *
+ * The proxy keeps responses as the raw bytes received from the origin.
+ * These helpers locate the end of the header block and look up header
+ * values in place, without copying or modifying the buffer.
+ *
+ * http_framing follows a response as it streams in, so the proxy knows
+ * where it ends on a keep-alive connection: by Content-Length, by chunked
+ * transfer coding, or by the origin closing the connection.
+ */
+
+#include <stddef.h>
+
+#ifndef HTTP_RESPONSE
+#define HTTP_RESPONSE
+
+#define HTTP_MAX_HEAD (64*1024) //larger response heads are rejected
+
+//http_framing states
+#define HTTP_FRAME_HEAD 0        //collecting the status line and headers
+#define HTTP_FRAME_LENGTH 1      //body of Content-Length bytes
+#define HTTP_FRAME_CHUNK_SIZE 2  //hex size line of the next chunk
+#define HTTP_FRAME_CHUNK_EXT 3   //chunk extension up to the end of the size line
+#define HTTP_FRAME_CHUNK_DATA 4
+#define HTTP_FRAME_CHUNK_END 5   //CRLF after the chunk data
+#define HTTP_FRAME_TRAILER 6     //trailer lines after the last chunk
+#define HTTP_FRAME_CLOSE 7       //body runs until the origin closes
+#define HTTP_FRAME_DONE 8
+
+typedef struct http_framing {
+    int state;
+    int head_request; //responses to HEAD never have a body
+    int status;
+    int keep_alive; //1 when the origin connection may carry another request
+    char* head; //head split across reads, collected until complete and then freed
+    int head_len;
+    size_t remaining; //body or chunk bytes still expected
+    int line_len; //length of the current trailer line
+} http_framing;
+
+/* Length of the status line and headers including the blank line, or -1
+ * when buf does not hold the complete head yet */
+int http_response_head_len(const char* buf, int len);
+
+/* Value of the first header called name (case-insensitive) within the
+ * head_len bytes of head, with surrounding whitespace trimmed. The value is
+ * not NUL terminated, its length is stored in value_len. NULL if absent */
+const char* http_response_header(const char* head, int head_len, const char* name, int* value_len);
+
+/* Start framing a new response, head_request is 1 for a HEAD request */
+void http_framing_init(http_framing* framing, int head_request);
+
+/* Feed received bytes. Returns how many of them belong to the response,
+ * fewer than len once it is complete, or -1 when the response is malformed.
+ * state is HTTP_FRAME_DONE once the whole response has been seen */
+int http_framing_feed(http_framing* framing, const char* data, int len);
+
+/* Feed like http_framing_feed(), but stop after the first run of body
+ * bytes, so chunk framing can be told apart from the payload. The run is
+ * the last *body_len of the bytes used, *body_len is 0 when none was found */
+int http_framing_body(http_framing* framing, const char* data, int len, int* body_len);
+
+/* Body bytes that may be relayed next without being looked at: the rest of
+ * a Content-Length body, (size_t)-1 for a close delimited one, 0 while the
+ * framing has to see the bytes */
+size_t http_framing_window(http_framing* framing);
+
+/* Account for n bytes relayed blindly, n is at most the window */
+void http_framing_skip(http_framing* framing, size_t n);
+
+/* Release the head buffer of an unfinished response */
+void http_framing_free(http_framing* framing);
+
+#endif
@@ -0,0 +1,411 @@
+/*
+  inflight.c -- single-flight table of origin fetches in progress.
+*/
+
+#include "inflight.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static pthread_mutex_t table_lock;
+static inflight* table[INFLIGHT_BUCKETS];
+
+static pthread_mutex_t pool_lock;
+static inflight* pool;
+static int pool_len;
+
+int inflight_init(){
+    if(pthread_mutex_init(&table_lock, NULL)!=0){
+        fprintf(stderr, "Error initialising inflight table lock\n");
+        return -1;
+    }
+    if(pthread_mutex_init(&pool_lock, NULL)!=0){
+        fprintf(stderr, "Error initialising inflight pool lock\n");
+        return -1;
+    }
+    memset(table, 0, sizeof(table));
+    pool=NULL;
+    pool_len=0;
+    return 0;
+}
+
+//into inline_bytes when the key fits there, malloc otherwise
+static int key_copy(cache_key* dst, cache_key* src, char* inline_bytes, size_t inline_size){
+    dst->bytes=(size_t)src->len<inline_size ? inline_bytes : (char*)malloc(src->len+1);
+    if(dst->bytes==NULL)
+        return -1;
+    memcpy(dst->bytes, src->bytes, src->len);
+    dst->bytes[src->len]='\0';
+    dst->len=src->len;
+    dst->hash=src->hash;
+    dst->arena=NULL;
+    return 0;
+}
+
+static int key_equal(cache_key* a, cache_key* b){
+    return a->hash==b->hash && a->len==b->len && memcmp(a->bytes, b->bytes, a->len)==0;
+}
+
+static inflight** bucket_of(cache_key* key){
+    return &table[key->hash%INFLIGHT_BUCKETS];
+}
+
+//caller holds table_lock
+static void table_unlink(inflight* flight){
+    inflight** link=bucket_of(&flight->key);
+    while(*link!=NULL){
+        if(*link==flight){
+            *link=flight->next_in_bucket;
+            flight->next_in_bucket=NULL;
+            return;
+        }
+        link=&(*link)->next_in_bucket;
+    }
+}
+
+//caller holds flight->lock
+static int add_loop(inflight* flight, event_loop* loop){
+    for(int i=0;i<flight->loops_len;i++){
+        if(flight->loops[i]==loop)
+            return 0;
+    }
+    if(flight->loops_len==flight->loops_cap){
+        int cap=flight->loops_cap ? flight->loops_cap*2 : 4;
+        event_loop** grown=(event_loop**)realloc(flight->loops, cap*sizeof(event_loop*));
+        if(grown==NULL)
+            return -1;
+        flight->loops=grown;
+        flight->loops_cap=cap;
+    }
+    flight->loops[flight->loops_len++]=loop;
+    return 0;
+}
+
+static void wake_followers(inflight* flight){
+    pthread_mutex_lock(&flight->lock);
+    for(int i=0;i<flight->loops_len;i++)
+        event_loop_wake(flight->loops[i]);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+//a pooled fetch keeps its loops array, the rest starts over
+static inflight* inflight_new(cache_key* key){
+    pthread_mutex_lock(&pool_lock);
+    inflight* flight=pool;
+    if(flight!=NULL){
+        pool=flight->next_in_bucket;
+        pool_len--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if(flight!=NULL){
+        event_loop** loops=flight->loops;
+        int loops_cap=flight->loops_cap;
+        memset(flight, 0, sizeof(inflight));
+        flight->loops=loops;
+        flight->loops_cap=loops_cap;
+    }else{
+        flight=(inflight*)calloc(1, sizeof(inflight));
+        if(flight==NULL)
+            return NULL;
+    }
+    if(key_copy(&flight->key, key, flight->key_inline, sizeof(flight->key_inline))<0){
+        free(flight->loops);
+        free(flight);
+        return NULL;
+    }
+    pthread_mutex_init(&flight->lock, NULL);
+    flight->capturing=1;
+    flight->joinable=1;
+    flight->refcount=1;
+    flight->state=INFLIGHT_RUNNING;
+    return flight;
+}
+
+inflight* inflight_join(cache_key* key, event_loop* loop, int* leader){
+    pthread_mutex_lock(&table_lock);
+    for(inflight* flight=*bucket_of(key);flight!=NULL;flight=flight->next_in_bucket){
+        if(!key_equal(&flight->key, key))
+            continue;
+        pthread_mutex_lock(&flight->lock);
+        if(add_loop(flight, loop)<0){
+            //cannot be woken, fetch on our own instead
+            pthread_mutex_unlock(&flight->lock);
+            break;
+        }
+        flight->followers++;
+        flight->refcount++;
+        pthread_mutex_unlock(&flight->lock);
+        pthread_mutex_unlock(&table_lock);
+        *leader=0;
+        return flight;
+    }
+
+    inflight* flight=inflight_new(key);
+    if(flight!=NULL){
+        inflight** bucket=bucket_of(key);
+        flight->next_in_bucket=*bucket;
+        *bucket=flight;
+    }
+    pthread_mutex_unlock(&table_lock);
+    *leader=1;
+    return flight;
+}
+
+inflight* inflight_start(cache_key* key){
+    pthread_mutex_lock(&table_lock);
+    for(inflight* flight=*bucket_of(key);flight!=NULL;flight=flight->next_in_bucket){
+        if(key_equal(&flight->key, key)){
+            pthread_mutex_unlock(&table_lock);
+            return NULL;
+        }
+    }
+    inflight* flight=inflight_new(key);
+    if(flight!=NULL){
+        inflight** bucket=bucket_of(key);
+        flight->next_in_bucket=*bucket;
+        *bucket=flight;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return flight;
+}
+
+inflight* inflight_private(cache_key* key){
+    inflight* flight=inflight_new(key);
+    if(flight!=NULL)
+        flight->joinable=0;
+    return flight;
+}
+
+//leave the table so no new follower joins, existing ones keep their references
+static void close_table_entry(inflight* flight){
+    pthread_mutex_lock(&table_lock);
+    pthread_mutex_lock(&flight->lock);
+    if(flight->joinable){
+        flight->joinable=0;
+        table_unlink(flight);
+    }
+    pthread_mutex_unlock(&flight->lock);
+    pthread_mutex_unlock(&table_lock);
+}
+
+void inflight_stop_capture(inflight* flight){
+    close_table_entry(flight);
+    //after the bytes already published, followers read it as the end of what they get
+    __atomic_store_n(&flight->capturing, 0, __ATOMIC_RELEASE);
+}
+
+//1 when len more bytes are to be buffered
+static int keep_capturing(inflight* flight, int len){
+    if(len<=0 || !flight->capturing)
+        return 0;
+    //too large for the cache, and never buffered whole for followers either
+    if(flight->len+len>(size_t)MAX_ELEMENT_SIZE)
+        inflight_stop_capture(flight);
+    return flight->capturing;
+}
+
+//tail segment space for the next bytes, NULL when the chain cannot grow
+static char* tail_space(inflight* flight, size_t len_now, int* space){
+    size_t offset=len_now%SEGMENT_SIZE;
+    if(flight->tail==NULL || (offset==0 && len_now>0)){
+        //the response may never be cached, receiving it must not evict what is
+        segment* chunk=segment_new_spare(SEGMENT_SIZE);
+        if(chunk==NULL){
+            fprintf(stderr, "Error growing inflight response\n");
+            return NULL;
+        }
+        if(flight->tail==NULL)
+            __atomic_store_n(&flight->head, chunk, __ATOMIC_RELEASE);
+        else
+            __atomic_store_n(&flight->tail->next, chunk, __ATOMIC_RELEASE);
+        flight->tail=chunk;
+    }
+    *space=SEGMENT_SIZE-offset;
+    return flight->tail->data+offset;
+}
+
+//the chain could not grow, so the bytes from here on are lost: never cache it or hand followers a gap
+static void capture_failed(inflight* flight){
+    inflight_stop_capture(flight);
+    wake_followers(flight);
+}
+
+char* inflight_reserve(inflight* flight, int* space){
+    if(!keep_capturing(flight, 1))
+        return NULL;
+    char* in=tail_space(flight, flight->len, space);
+    if(in==NULL)
+        capture_failed(flight);
+    return in;
+}
+
+void inflight_commit(inflight* flight, int len){
+    //keeps the size limit in force for bytes received in place
+    if(len<=0 || !keep_capturing(flight, len))
+        return;
+    __atomic_store_n(&flight->len, flight->len+len, __ATOMIC_RELEASE);
+    wake_followers(flight);
+}
+
+void inflight_append(inflight* flight, const char* data, int len){
+    if(!keep_capturing(flight, len))
+        return;
+
+    //only the leader writes, readers never look past the published length
+    size_t len_now=flight->len;
+    while(len>0){
+        int n;
+        char* space=tail_space(flight, len_now, &n);
+        if(space==NULL)
+            break;
+        if(n>len)
+            n=len;
+        memcpy(space, data, n);
+        data+=n;
+        len-=n;
+        len_now+=n;
+    }
+    //what was copied is published first, followers read it before they see capture end
+    __atomic_store_n(&flight->len, len_now, __ATOMIC_RELEASE);
+    if(len>0)
+        capture_failed(flight);
+    else
+        wake_followers(flight);
+}
+
+int inflight_append_fd(inflight* flight, int fd, int len){
+    char scratch[4096];
+    size_t len_now=flight->len;
+    int capture=keep_capturing(flight, len);
+    int ret=0;
+    while(len>0){
+        //bytes nobody can use are still taken out of the pipe
+        int n=sizeof(scratch);
+        char* space=capture ? tail_space(flight, len_now, &n) : NULL;
+        if(space==NULL){
+            if(capture){
+                //the bytes that follow are dropped, the capture must not be cached with a gap
+                __atomic_store_n(&flight->len, len_now, __ATOMIC_RELEASE);
+                capture_failed(flight);
+                capture=0;
+            }
+            space=scratch;
+            n=sizeof(scratch);
+        }
+        if(n>len)
+            n=len;
+        n=read(fd, space, n);
+        if(n<=0){
+            ret=-1;
+            break;
+        }
+        if(capture)
+            len_now+=n;
+        len-=n;
+    }
+    if(len_now!=flight->len){
+        __atomic_store_n(&flight->len, len_now, __ATOMIC_RELEASE);
+        wake_followers(flight);
+    }
+    return ret;
+}
+
+void inflight_set_head(inflight* flight, int head_state, const char* vary, cache_key* vary_key){
+    pthread_mutex_lock(&flight->lock);
+    if(vary!=NULL && vary_key!=NULL){
+        flight->vary=strdup(vary);
+        if(flight->vary==NULL || key_copy(&flight->vary_key, vary_key, NULL, 0)<0){
+            free(flight->vary);
+            flight->vary=NULL;
+            head_state=-1;
+        }
+    }
+    __atomic_store_n(&flight->head_state, head_state, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&flight->lock);
+    wake_followers(flight);
+}
+
+void inflight_finish(inflight* flight, int state){
+    close_table_entry(flight);
+    if(__atomic_load_n(&flight->head_state, __ATOMIC_ACQUIRE)==0)
+        __atomic_store_n(&flight->head_state, -1, __ATOMIC_RELEASE);
+    __atomic_store_n(&flight->state, state, __ATOMIC_RELEASE);
+    wake_followers(flight);
+}
+
+void inflight_detach(inflight* flight){
+    pthread_mutex_lock(&flight->lock);
+    flight->followers--;
+    pthread_mutex_unlock(&flight->lock);
+}
+
+void inflight_release(inflight* flight){
+    if(flight==NULL || __atomic_sub_fetch(&flight->refcount, 1, __ATOMIC_ACQ_REL)>0)
+        return;
+    //a cache element may still hold some of the segments
+    segment* chunk=flight->head;
+    while(chunk!=NULL){
+        segment* next=chunk->next;
+        segment_release(chunk);
+        chunk=next;
+    }
+    if(flight->key.bytes!=flight->key_inline)
+        free(flight->key.bytes);
+    free(flight->vary);
+    free(flight->vary_key.bytes);
+    pthread_mutex_destroy(&flight->lock);
+
+    pthread_mutex_lock(&pool_lock);
+    if(pool_len<INFLIGHT_POOL_SIZE){
+        flight->next_in_bucket=pool;
+        pool=flight;
+        pool_len++;
+        flight=NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if(flight!=NULL){
+        free(flight->loops);
+        free(flight);
+    }
+}
+
+size_t inflight_published(inflight* flight){
+    return __atomic_load_n(&flight->len, __ATOMIC_ACQUIRE);
+}
+
+int inflight_peek(inflight* flight, inflight_cursor* cursor, const char** data){
+    size_t published=inflight_published(flight);
+    if(cursor->pos>=published)
+        return 0;
+
+    if(cursor->chunk==NULL){
+        cursor->chunk=__atomic_load_n(&flight->head, __ATOMIC_ACQUIRE);
+        cursor->chunk_end=SEGMENT_SIZE;
+    }
+    while(cursor->pos>=cursor->chunk_end){
+        cursor->chunk=__atomic_load_n(&cursor->chunk->next, __ATOMIC_ACQUIRE);
+        cursor->chunk_end+=SEGMENT_SIZE;
+    }
+    size_t offset=cursor->pos%SEGMENT_SIZE;
+
+    size_t n=SEGMENT_SIZE-offset;
+    if(n>published-cursor->pos)
+        n=published-cursor->pos;
+    *data=cursor->chunk->data+offset;
+    return (int)n;
+}
+
+void inflight_advance(inflight* flight, inflight_cursor* cursor, int n){
+    //the chunk pointer moves lazily in inflight_peek(), the next chunk may not exist yet
+    cursor->pos+=n;
+}
+
+segment* inflight_captured(inflight* flight, int* len){
+    size_t total=inflight_published(flight);
+    if(!flight->capturing || total==0 || total>(size_t)MAX_ELEMENT_SIZE)
+        return NULL;
+    *len=(int)total;
+    return flight->head;
+}
@@ -0,0 +1,143 @@
+/*
+ * inflight.h -- single-flight table of origin fetches in progress.
+ *
+ * The first client to miss the cache for a key becomes the leader of an
+ * inflight fetch. Clients that miss the same key while it is running join
+ * as followers instead of contacting the origin. The leader receives the
+ * response into an append-only chain of SEGMENT_SIZE segments and publishes
+ * the new length, so followers on any worker read the bytes already received
+ * without taking a lock. The leader wakes the loops of its followers after
+ * every append and when the fetch ends. Once the response is complete the
+ * cache element takes references to the same segments.
+ *
+ * Nothing is buffered past MAX_ELEMENT_SIZE, followers or not, so a large
+ * download never sits in memory whole. Followers of a response announced
+ * as larger are turned away before they send anything, and those of one
+ * that only grows past it are cut off where the buffer ends.
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "event_loop.h"
+#include "cache.h"
+#include "segment.h"
+
+#ifndef INFLIGHT
+#define INFLIGHT
+
+#define INFLIGHT_BUCKETS 1024
+#define INFLIGHT_KEY_INLINE 256 //keys shorter than this are stored in the fetch itself
+#define INFLIGHT_POOL_SIZE 256 //finished fetches kept for reuse, so a miss does not call malloc
+
+#define INFLIGHT_RUNNING 0
+#define INFLIGHT_DONE 1
+#define INFLIGHT_FAILED 2
+
+typedef struct inflight inflight;
+
+struct inflight {
+    cache_key key;
+    pthread_mutex_t lock;
+
+    //response bytes, all segments but the tail are full
+    segment* head;
+    segment* tail;
+    size_t len; //published length, readers may use [0, len) without the lock
+    int capturing; //0 once the bytes cannot be cached, the leader then stops appending and followers are cut off
+
+    int state; //INFLIGHT_RUNNING, INFLIGHT_DONE or INFLIGHT_FAILED
+    int persistent; //set by the leader before finishing: clients may keep their connection after the response
+    int joinable; //1 while the fetch is in the table and new followers may join
+    int followers;
+    int refcount;
+
+    //set by the leader once the response head is complete
+    int head_state; //0 not yet known, 1 parsed, -1 followers cannot share the response, 2 the leader sent the stored copy instead
+    char* vary; //normalized Vary of the response, NULL without one
+    cache_key vary_key; //leader's variant key when vary is set
+
+    event_loop** loops; //loops of followers, woken on progress
+    int loops_len;
+    int loops_cap;
+
+    inflight* next_in_bucket; //also links the pool of finished fetches
+    char key_inline[INFLIGHT_KEY_INLINE];
+};
+
+/* Reader position inside an inflight response */
+typedef struct inflight_cursor {
+    segment* chunk; //segment holding pos, NULL before the first read
+    size_t chunk_end; //response offset where chunk ends
+    size_t pos;
+} inflight_cursor;
+
+/* Initialise the table. Returns 0 or -1 */
+int inflight_init();
+
+/* Join the running fetch for key as a follower woken on loop, or start a
+ * new one when there is none. *leader is set to 1 for a new fetch. Returns
+ * a referenced fetch or NULL on allocation failure */
+inflight* inflight_join(cache_key* key, event_loop* loop, int* leader);
+
+/* Start a fetch for key as its leader, unless one is already running. For
+ * a background refresh, which has no use for following. Returns a
+ * referenced fetch, or NULL when key is already being fetched or on
+ * allocation failure */
+inflight* inflight_start(cache_key* key);
+
+/* Start a fetch for key that nobody can join, for a follower that cannot
+ * share the response of the fetch it joined. NULL on allocation failure */
+inflight* inflight_private(cache_key* key);
+
+/* Leader only: append response bytes and wake the followers */
+void inflight_append(inflight* flight, const char* data, int len);
+
+/* Leader only: space at the end of the response to receive up to *space
+ * bytes into, NULL when nothing more is captured. Commit what was written
+ * with inflight_commit() */
+char* inflight_reserve(inflight* flight, int* space);
+
+/* Leader only: publish len bytes written to the space of inflight_reserve()
+ * and wake the followers */
+void inflight_commit(inflight* flight, int len);
+
+/* Leader only: append len bytes read from fd, a pipe holding at least len
+ * bytes. All of them are read even when they are not kept. Returns 0 or -1
+ * when the pipe came up short */
+int inflight_append_fd(inflight* flight, int fd, int len);
+
+/* Leader only: the response will not be cached. No new follower may join
+ * and buffering stops. Followers still reading get what was published, then
+ * see capturing cleared and have to finish on their own */
+void inflight_stop_capture(inflight* flight);
+
+/* Leader only: publish what followers need to decide whether they may share
+ * the response. vary and vary_key are copied, both may be NULL */
+void inflight_set_head(inflight* flight, int head_state, const char* vary, cache_key* vary_key);
+
+/* Leader only: end the fetch, take it out of the table and wake followers */
+void inflight_finish(inflight* flight, int state);
+
+/* Follower leaving before the end of the response */
+void inflight_detach(inflight* flight);
+
+/* Drop a reference, the last one frees the fetch */
+void inflight_release(inflight* flight);
+
+/* Published length, pairs with the leader's release store */
+size_t inflight_published(inflight* flight);
+
+/* Contiguous bytes available at the cursor, stored in *data. 0 when the
+ * reader has caught up with the published length */
+int inflight_peek(inflight* flight, inflight_cursor* cursor, const char** data);
+
+/* Move the cursor forward after n bytes were consumed */
+void inflight_advance(inflight* flight, inflight_cursor* cursor, int n);
+
+/* The captured response, *len bytes from the first segment on, NULL when
+ * capture was dropped or the response is too large to cache. The segments
+ * stay owned by the fetch, the cache takes its own references */
+segment* inflight_captured(inflight* flight, int* len);
+
+#endif
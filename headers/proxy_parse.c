@@ -5,12 +5,12 @@
 
 #include "proxy_parse.h"
 
-#define DEFAULT_NHDRS 8
+#include <pthread.h>
+#include <immintrin.h>
+
 #define MAX_REQ_LEN 65535
 #define MIN_REQ_LEN 4
 
-static const char *root_abs_path = "/";
-
 /* private function declartions */
 int ParsedRequest_printRequestLine(struct ParsedRequest *pr, 
 				   char * buf, size_t buflen,
@@ -33,10 +33,330 @@ void debug(const char * format, ...) {
 }
 
 
+/*
+ * Scanning kernels: find the first byte of a class that ends a field, 16 or
+ * 32 bytes at a time where the CPU allows it
+ */
+
+#define SCAN_LINE 0  /* request line: CTLs and DEL */
+#define SCAN_NAME 1  /* header name: anything that is not a token character */
+#define SCAN_VALUE 2 /* header value: CTLs other than HTAB, and DEL */
+
+/* Byte ranges the SSE4.2 kernel stops at, lo-hi pairs padded with an empty
+ * range. They may include harmless bytes that the stop table lets through,
+ * the only one is '|' inside "{-}" for names */
+static const char scan_ranges[3][16] = {
+     { '\x00', '\x1f', '\x7f', '\x7f', '\x01', '\x00', '\x01', '\x00',
+       '\x01', '\x00', '\x01', '\x00', '\x01', '\x00', '\x01', '\x00' },
+     { '\x00', ' ', '"', '"', '(', ')', ',', ',',
+       '/', '/', ':', '@', '[', ']', '{', '\xff' },
+     { '\x00', '\x08', '\x0a', '\x1f', '\x7f', '\x7f', '\x01', '\x00',
+       '\x01', '\x00', '\x01', '\x00', '\x01', '\x00', '\x01', '\x00' },
+};
+static const int scan_ranges_len[3] = { 4, 16, 6 };
+
+/* exact classes, 1 for bytes that end the field */
+static unsigned char scan_stop[3][256];
+
+/* the same classes below 0x80 by low nibble, bit n set when (n<<4)|nibble stops */
+static unsigned char scan_nibbles[3][16];
+
+typedef const char *(*ParsedRequest_scanFn)(const char *p, const char *end,
+					   int cls);
+
+static const char *ParsedRequest_scanScalar(const char *p, const char *end,
+					    int cls)
+{
+     const unsigned char *stop = scan_stop[cls];
+     while (p < end && !stop[(unsigned char)*p])
+	  p++;
+     return p;
+}
+
+__attribute__((target("sse4.2")))
+static const char *ParsedRequest_scanSse42(const char *p, const char *end,
+					   int cls)
+{
+     __m128i ranges = _mm_loadu_si128((const __m128i *)scan_ranges[cls]);
+     int ranges_len = scan_ranges_len[cls];
+     while (end-p >= 16) {
+	  __m128i data = _mm_loadu_si128((const __m128i *)p);
+	  int i = _mm_cmpestri(ranges, ranges_len, data, 16,
+			       _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES |
+			       _SIDD_UBYTE_OPS);
+	  if (i < 16) {
+	       p += i;
+	       if (scan_stop[cls][(unsigned char)*p])
+		    return p;
+	       p++;
+	       continue;
+	  }
+	  p += 16;
+     }
+     return ParsedRequest_scanScalar(p, end, cls);
+}
+
+__attribute__((target("avx2")))
+static const char *ParsedRequest_scanAvx2(const char *p, const char *end,
+					  int cls)
+{
+     /* exact test of 32 bytes: the low nibble picks a mask of the high
+      * nibbles 0-7 that stop, bytes from 0x80 up stop only in names */
+     __m256i table = _mm256_broadcastsi128_si256(
+	  _mm_loadu_si128((const __m128i *)scan_nibbles[cls]));
+     __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+				     0, 0, 0, 0, 0, 0, 0, 0,
+				     1, 2, 4, 8, 16, 32, 64, -128,
+				     0, 0, 0, 0, 0, 0, 0, 0);
+     __m256i low = _mm256_set1_epi8(0x0f);
+     /* most fields end within 16 bytes, try those before a full block */
+     if (end-p >= 16) {
+	  __m128i data = _mm_loadu_si128((const __m128i *)p);
+	  __m128i lo = _mm_and_si128(data, _mm256_castsi256_si128(low));
+	  __m128i hi = _mm_and_si128(_mm_srli_epi16(data, 4),
+				     _mm256_castsi256_si128(low));
+	  __m128i hit = _mm_and_si128(
+	       _mm_shuffle_epi8(_mm256_castsi256_si128(table), lo),
+	       _mm_shuffle_epi8(_mm256_castsi256_si128(bits), hi));
+	  unsigned int mask = 0xffff & ~(unsigned int)_mm_movemask_epi8(
+	       _mm_cmpeq_epi8(hit, _mm_setzero_si128()));
+	  if (cls == SCAN_NAME)
+	       mask |= (unsigned int)_mm_movemask_epi8(data);
+	  if (mask != 0)
+	       return p + __builtin_ctz(mask);
+	  p += 16;
+     }
+     while (end-p >= 32) {
+	  __m256i data = _mm256_loadu_si256((const __m256i *)p);
+	  __m256i lo = _mm256_and_si256(data, low);
+	  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(data, 4), low);
+	  __m256i hit = _mm256_and_si256(_mm256_shuffle_epi8(table, lo),
+					 _mm256_shuffle_epi8(bits, hi));
+	  unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(
+	       _mm256_cmpeq_epi8(hit, _mm256_setzero_si256()));
+	  if (cls == SCAN_NAME)
+	       mask |= (unsigned int)_mm256_movemask_epi8(data);
+	  if (mask != 0)
+	       return p + __builtin_ctz(mask);
+	  p += 32;
+     }
+     /* the tail kernel is legacy SSE, leaving the upper halves dirty would
+      * slow it and everything after it */
+     _mm256_zeroupper();
+     return ParsedRequest_scanSse42(p, end, cls);
+}
+
+static ParsedRequest_scanFn scan_fn;
+static const char *scan_name;
+
+/* the kernel choice and the header index tables are set up once */
+static pthread_once_t parse_once = PTHREAD_ONCE_INIT;
+static void ParsedRequest_init();
+
+static void ParsedRequest_scanInit()
+{
+     static const char *tchar = "!#$%&'*+-.^_`|~";
+     for (int c = 0; c < 256; c++) {
+	  scan_stop[SCAN_LINE][c] = c < 0x20 || c == 0x7f;
+	  scan_stop[SCAN_NAME][c] = !(isalnum(c) && c < 0x80) &&
+	       (c == 0 || strchr(tchar, c) == NULL);
+	  scan_stop[SCAN_VALUE][c] = (c < 0x20 && c != '\t') || c == 0x7f;
+     }
+     for (int cls = 0; cls < 3; cls++)
+	  for (int c = 0; c < 0x80; c++)
+	       if (scan_stop[cls][c])
+		    scan_nibbles[cls][c & 0x0f] |= 1 << (c >> 4);
+
+     /* the widest kernel the CPU runs */
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2")) {
+	  scan_fn = ParsedRequest_scanAvx2;
+	  scan_name = "avx2";
+     } else if (__builtin_cpu_supports("sse4.2")) {
+	  scan_fn = ParsedRequest_scanSse42;
+	  scan_name = "sse4.2";
+     } else {
+	  scan_fn = ParsedRequest_scanScalar;
+	  scan_name = "scalar";
+     }
+}
+
+int ParsedRequest_useScanner(const char *name)
+{
+     pthread_once(&parse_once, ParsedRequest_init);
+     if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2") &&
+	 __builtin_cpu_supports("sse4.2")) {
+	  scan_fn = ParsedRequest_scanAvx2;
+	  scan_name = "avx2";
+     } else if (strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+	  scan_fn = ParsedRequest_scanSse42;
+	  scan_name = "sse4.2";
+     } else if (strcmp(name, "scalar") == 0) {
+	  scan_fn = ParsedRequest_scanScalar;
+	  scan_name = "scalar";
+     } else {
+	  return -1;
+     }
+     return 0;
+}
+
+const char *ParsedRequest_scanner()
+{
+     pthread_once(&parse_once, ParsedRequest_init);
+     return scan_name;
+}
+
+/* first byte of class cls in [p, end), end when there is none */
+static const char *ParsedRequest_scan(const char *p, const char *end, int cls)
+{
+     return scan_fn(p, end, cls);
+}
+
+/*
+ * Header index: keys hash case-insensitively, well known names map to an id
+ * through a small open addressing table
+ */
+
+#define KNOWN_SLOTS 64
+
+static const char *known_names[PARSED_HEADER_KNOWN] = {
+     NULL, "Host", "Connection", "Proxy-Connection", "Content-Length",
+     "Transfer-Encoding", "Content-Encoding", "Accept-Encoding",
+     "Cache-Control", "Pragma", "If-Modified-Since", "If-None-Match",
+};
+static size_t known_lens[PARSED_HEADER_KNOWN];
+static unsigned int known_hashes[PARSED_HEADER_KNOWN];
+static unsigned char known_slots[KNOWN_SLOTS]; /* id, 0 for a free slot */
+
+/* FNV-1a of the lower cased key */
+static unsigned int ParsedHeader_hash(const char *key, size_t len)
+{
+     unsigned int hash = 2166136261u;
+     for (size_t i = 0; i < len; i++) {
+	  unsigned char c = key[i];
+	  if (c >= 'A' && c <= 'Z')
+	       c += 'a'-'A';
+	  hash ^= c;
+	  hash *= 16777619u;
+     }
+     return hash;
+}
+
+static void ParsedHeader_initKnown()
+{
+     for (int id = 1; id < PARSED_HEADER_KNOWN; id++) {
+	  known_lens[id] = strlen(known_names[id]);
+	  known_hashes[id] = ParsedHeader_hash(known_names[id], known_lens[id]);
+	  unsigned int slot = known_hashes[id] % KNOWN_SLOTS;
+	  while (known_slots[slot] != 0)
+	       slot = (slot+1) % KNOWN_SLOTS;
+	  known_slots[slot] = id;
+     }
+}
+
+static int ParsedHeader_id(const char *key, size_t len, unsigned int hash)
+{
+     for (unsigned int slot = hash % KNOWN_SLOTS; known_slots[slot] != 0;
+	  slot = (slot+1) % KNOWN_SLOTS) {
+	  int id = known_slots[slot];
+	  if (known_hashes[id] == hash && known_lens[id] == len &&
+	      strncasecmp(known_names[id], key, len) == 0)
+	       return id;
+     }
+     return PARSED_HEADER_OTHER;
+}
+
+/* hash and id of a new header at the end of the array */
+static void ParsedHeader_index(struct ParsedRequest *pr, struct ParsedHeader *ph,
+			       const char *key, size_t len)
+{
+     ph->hash = ParsedHeader_hash(key, len);
+     ph->id = ParsedHeader_id(key, len, ph->hash);
+     if (ph->id != PARSED_HEADER_OTHER && pr->known[ph->id] == 0)
+	  pr->known[ph->id] = ph - pr->headers + 1;
+}
+
+static void ParsedHeader_reindex(struct ParsedRequest *pr)
+{
+     memset(pr->known, 0, sizeof(pr->known));
+     for (size_t i = pr->headersused; i > 0; i--)
+	  pr->known[pr->headers[i-1].id] = i;
+     pr->known[PARSED_HEADER_OTHER] = 0;
+}
+
+static void ParsedRequest_init()
+{
+     ParsedRequest_scanInit();
+     ParsedHeader_initKnown();
+}
+
+/*
+ * String store: bump allocation from the inline store, then from heap blocks
+ * that live until the request is destroyed
+ */
+
+static char *ParsedRequest_alloc(struct ParsedRequest *pr, size_t len)
+{
+     if (pr->storeused + len > pr->storelen) {
+	  if (pr->arena)
+	       return (char *)arena_alloc(pr->arena, len);
+	  /* strings already handed out keep pointing into the old block */
+	  size_t size = len > PARSED_SPILL_BLOCK ? len : PARSED_SPILL_BLOCK;
+	  char *block = (char *)malloc(sizeof(char *) + size);
+	  if (!block)
+	       return NULL;
+	  memcpy(block, &pr->spill, sizeof(char *));
+	  pr->spill = block;
+	  pr->store = block + sizeof(char *);
+	  pr->storelen = size;
+	  pr->storeused = 0;
+     }
+     char *p = pr->store + pr->storeused;
+     pr->storeused += len;
+     return p;
+}
+
+static char *ParsedRequest_strndup(struct ParsedRequest *pr, 
+				   const char *s, size_t len)
+{
+     char *copy = ParsedRequest_alloc(pr, len+1);
+     if (copy) {
+	  memcpy(copy, s, len);
+	  copy[len] = '\0';
+     }
+     return copy;
+}
+
 /*
  *  ParsedHeader Public Methods
  */
 
+/* next free header slot, the array leaves the inline slots when they run out */
+static struct ParsedHeader *ParsedHeader_append(struct ParsedRequest *pr)
+{
+     if (pr->headerslen <= pr->headersused+1) {
+	  size_t len = pr->headerslen * 2;
+	  struct ParsedHeader *grown;
+	  if (pr->headers == pr->inline_headers || pr->arena) {
+	       grown = pr->arena ?
+		    (struct ParsedHeader *)arena_alloc(pr->arena, 
+			      len * sizeof(struct ParsedHeader)) :
+		    (struct ParsedHeader *)malloc(len * sizeof(struct ParsedHeader));
+	       if (grown)
+		    memcpy(grown, pr->headers, 
+			   pr->headersused * sizeof(struct ParsedHeader));
+	  } else {
+	       grown = (struct ParsedHeader *)realloc(pr->headers, 
+			len * sizeof(struct ParsedHeader));
+	  }
+	  if (!grown)
+	       return NULL;
+	  pr->headers = grown;
+	  pr->headerslen = len;
+     }
+     return pr->headers + pr->headersused++;
+}
+
 /* Set a header with key and value */
 int ParsedHeader_set(struct ParsedRequest *pr,    
 		     const char * key, const char * value)
@@ -44,61 +364,98 @@ int ParsedHeader_set(struct ParsedRequest *pr,
      struct ParsedHeader *ph;
      ParsedHeader_remove (pr, key);
 
-     if (pr->headerslen <= pr->headersused+1) {
-	  pr->headerslen = pr->headerslen * 2;
-	  pr->headers = 
-	       (struct ParsedHeader *)realloc(pr->headers, 
-		pr->headerslen * sizeof(struct ParsedHeader));
-	  if (!pr->headers)
-	       return -1;
-     }
-
-     ph = pr->headers + pr->headersused;
-     pr->headersused += 1;
-     
-     ph->key = (char *)malloc(strlen(key)+1);
-     memcpy(ph->key, key, strlen(key));
-     ph->key[strlen(key)] = '\0';
-
-     ph->value = (char *)malloc(strlen(value)+1);
-     memcpy(ph->value, value, strlen(value));
-     ph->value[strlen(value)] = '\0';
-
-     ph->keylen = strlen(key)+1;
-     ph->valuelen = strlen(value)+1;
+     size_t keylen = strlen(key);
+     size_t valuelen = strlen(value);
+     char *keycopy = ParsedRequest_strndup(pr, key, keylen);
+     char *valuecopy = ParsedRequest_strndup(pr, value, valuelen);
+     if (!keycopy || !valuecopy)
+	  return -1;
+
+     ph = ParsedHeader_append(pr);
+     if (!ph)
+	  return -1;
+     ph->key = keycopy;
+     ph->value = valuecopy;
+     ph->keylen = keylen+1;
+     ph->valuelen = valuelen+1;
+     ph->keyspan.off = -1;
+     ph->keyspan.len = keylen;
+     ph->valuespan.off = -1;
+     ph->valuespan.len = valuelen;
+     ParsedHeader_index(pr, ph, key, keylen);
      return 0;
 }
 
+static int ParsedHeader_matches(struct ParsedHeader *ph, const char *key,
+				size_t keylen, unsigned int hash, int id)
+{
+     if (id != PARSED_HEADER_OTHER)
+	  return ph->id == id;
+     return ph->hash == hash && (size_t)ph->keyspan.len == keylen &&
+	  ph->key && strncasecmp(ph->key, key, keylen) == 0;
+}
 
 /* get the parsedHeader with the specified key or NULL */
-struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, 
-				      const char * key)
+struct ParsedHeader* ParsedHeader_getn(struct ParsedRequest *pr, 
+				       const char * key, size_t keylen)
 {
-     size_t i = 0;
-     struct ParsedHeader * tmp;
-     while(pr->headersused > i)
-     {
-	  tmp = pr->headers + i;
-	  if(tmp->key && key && strcmp(tmp->key, key) == 0)
-	  {
-	       return tmp;
-	  }
-	  i++;
+     pthread_once(&parse_once, ParsedRequest_init);
+     unsigned int hash = ParsedHeader_hash(key, keylen);
+     int id = ParsedHeader_id(key, keylen, hash);
+     if (id != PARSED_HEADER_OTHER)
+	  return ParsedHeader_getKnown(pr, id);
+
+     /* names outside the table only compare when the hashes agree */
+     for (size_t i = 0; i < pr->headersused; i++) {
+	  struct ParsedHeader *ph = pr->headers + i;
+	  if (ParsedHeader_matches(ph, key, keylen, hash, id))
+	       return ph;
      }
      return NULL;
 }
 
-/* remove the specified key from parsedHeader */
+struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, 
+				      const char * key)
+{
+     if (!key)
+	  return NULL;
+     return ParsedHeader_getn(pr, key, strlen(key));
+}
+
+struct ParsedHeader* ParsedHeader_getKnown(struct ParsedRequest *pr, int id)
+{
+     if (id <= PARSED_HEADER_OTHER || id >= PARSED_HEADER_KNOWN ||
+	 pr->known[id] == 0)
+	  return NULL;
+     return pr->headers + pr->known[id] - 1;
+}
+
+/* remove every header with the specified key, keeping the rest in order */
 int ParsedHeader_remove(struct ParsedRequest *pr, const char *key)
 {
-     struct ParsedHeader *tmp;
-     tmp = ParsedHeader_get(pr, key);
-     if(tmp == NULL)
+     if (!key)
+	  return -1;
+     pthread_once(&parse_once, ParsedRequest_init);
+     size_t keylen = strlen(key);
+     unsigned int hash = ParsedHeader_hash(key, keylen);
+     int id = ParsedHeader_id(key, keylen, hash);
+     if (id != PARSED_HEADER_OTHER && pr->known[id] == 0)
 	  return -1;
 
-     free(tmp->key);
-     free(tmp->value);
-     tmp->key = NULL;
+     /* the strings belong to the request's store */
+     size_t kept = 0;
+     for (size_t i = 0; i < pr->headersused; i++) {
+	  struct ParsedHeader *ph = pr->headers + i;
+	  if (ParsedHeader_matches(ph, key, keylen, hash, id))
+	       continue;
+	  if (kept != i)
+	       pr->headers[kept] = *ph;
+	  kept++;
+     }
+     if (kept == pr->headersused)
+	  return -1;
+     pr->headersused = kept;
+     ParsedHeader_reindex(pr);
      return 0;
 }
 
@@ -132,10 +489,10 @@ int ParsedHeader_modify(struct ParsedRequest *pr, const char * key,
 
 void ParsedHeader_create(struct ParsedRequest *pr)
 {
-     pr->headers = 
-     (struct ParsedHeader *)malloc(sizeof(struct ParsedHeader)*DEFAULT_NHDRS);
-     pr->headerslen = DEFAULT_NHDRS;
+     pr->headers = pr->inline_headers;
+     pr->headerslen = PARSED_INLINE_HEADERS;
      pr->headersused = 0;
+     memset(pr->known, 0, sizeof(pr->known));
 } 
 
 
@@ -196,60 +553,47 @@ int ParsedHeader_printHeaders(struct ParsedRequest * pr, char * buf,
 }
 
 
-void ParsedHeader_destroyOne(struct ParsedHeader * ph)
-{
-     if(ph->key != NULL)
-     {
-	  free(ph->key);
-	  ph->key = NULL;
-	  free(ph->value);
-	  ph->value = NULL;
-	  ph->keylen = 0;
-	  ph->valuelen = 0;
-     }
-}
-
 void ParsedHeader_destroy(struct ParsedRequest * pr)
 {
-     size_t i = 0;
-     while(pr->headersused > i)
-     {
-	  ParsedHeader_destroyOne(pr->headers + i);
-	  i++;
-     }
+     /* keys and values live in the request's store */
      pr->headersused = 0;
-
-     free(pr->headers);
+     if (pr->headers != pr->inline_headers && !pr->arena)
+	  free(pr->headers);
+     pr->headers = NULL;
      pr->headerslen = 0;
 }
 
 
-int ParsedHeader_parse(struct ParsedRequest * pr, char * line)
+static void ParsedSpan_set(struct ParsedSpan *span, const char *buf,
+			   const char *from, const char *to)
 {
-     char * key;
-     char * value;
-     char * index1;
-     char * index2;
+     span->off = from-buf;
+     span->len = to-from;
+}
 
-     index1 = index(line, ':');
-     if(index1 == NULL)
-     {
-	  debug("No colon found\n");
+/* record the spans of a "key: value" line in [line, eol), the scanner has
+ * already found the colon and checked every byte */
+static int ParsedHeader_parse(struct ParsedRequest * pr, const char *buf,
+			      const char * line, const char *colon,
+			      const char *eol)
+{
+     const char *value = colon+1;
+     while (value < eol && (*value == ' ' || *value == '\t'))
+	  value++;
+     const char *value_end = eol;
+     while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+	  value_end--;
+
+     struct ParsedHeader *ph = ParsedHeader_append(pr);
+     if (!ph)
 	  return -1;
-     }
-     key = (char *)malloc((index1-line+1)*sizeof(char));
-     memcpy(key, line, index1-line);
-     key[index1-line]='\0';
-
-     index1 += 2;
-     index2 = strstr(index1, "\r\n");
-     value = (char *) malloc((index2-index1+1)*sizeof(char));
-     memcpy(value, index1, (index2-index1));
-     value[index2-index1] = '\0';
-
-     ParsedHeader_set(pr, key, value);
-     free(key);
-     free(value);
+     ph->key = NULL;
+     ph->value = NULL;
+     ParsedSpan_set(&ph->keyspan, buf, line, colon);
+     ParsedSpan_set(&ph->valuespan, buf, value, value_end);
+     ph->keylen = ph->keyspan.len+1;
+     ph->valuelen = ph->valuespan.len+1;
+     ParsedHeader_index(pr, ph, line, colon-line);
      return 0;
 }
 
@@ -259,35 +603,55 @@ int ParsedHeader_parse(struct ParsedRequest * pr, char * line)
 
 void ParsedRequest_destroy(struct ParsedRequest *pr)
 {
-     if(pr->buf != NULL)
-     {
-	  free(pr->buf);
-     }
-     if (pr->path != NULL) {
-	  free(pr->path);
-     }
      if(pr->headerslen > 0)
      {
 	  ParsedHeader_destroy(pr);
      }
-     free(pr);
+     /* every string, buf and path included, lives in the store */
+     while (pr->spill != NULL) {
+	  char *next;
+	  memcpy(&next, pr->spill, sizeof(char *));
+	  free(pr->spill);
+	  pr->spill = next;
+     }
+     if (!pr->arena)
+	  free(pr);
 }
 
 struct ParsedRequest* ParsedRequest_create()
+{
+     return ParsedRequest_createIn(NULL);
+}
+
+struct ParsedRequest* ParsedRequest_createIn(arena *a)
 {
      struct ParsedRequest *pr;
-     pr = (struct ParsedRequest *)malloc(sizeof(struct ParsedRequest));
+     if (a)
+	  pr = (struct ParsedRequest *)arena_alloc(a, sizeof(struct ParsedRequest));
+     else
+	  pr = (struct ParsedRequest *)malloc(sizeof(struct ParsedRequest));
      if (pr != NULL)
      {
+	  pr->arena = a;
 	  ParsedHeader_create(pr);
 	  pr->buf = NULL;
 	  pr->method = NULL;
 	  pr->protocol = NULL;
 	  pr->host = NULL;
+	  pr->port = NULL;
 	  pr->path = NULL;
 	  pr->version = NULL;
 	  pr->buf = NULL;
 	  pr->buflen = 0;
+	  pr->reqlen = 0;
+	  pr->parsestate = PARSE_REQUEST_LINE;
+	  pr->linestart = 0;
+	  pr->scanned = 0;
+	  pr->colon = 0;
+	  pr->store = pr->inline_store;
+	  pr->storelen = PARSED_INLINE_STORE;
+	  pr->storeused = 0;
+	  pr->spill = NULL;
      }
      return pr;
 }
@@ -335,206 +699,235 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr)
 }
 
 
-/* 
-   Parse request buffer
- 
-   Parameters: 
-   parse: ptr to a newly created ParsedRequest object
-   buf: ptr to the buffer containing the request (need not be NUL terminated)
-   and the trailing \r\n\r\n
-   buflen: length of the buffer including the trailing \r\n\r\n
-   
-   Return values:
-   -1: failure
-   0: success
-*/
-int 
-ParsedRequest_parse(struct ParsedRequest * parse, const char *buf, 
-		    int buflen)
+/* record the spans of "GET http://host:port/path HTTP/1.x" in [buf, eol) */
+static int ParsedRequest_parseRequestLine(struct ParsedRequest *parse,
+					  const char *buf, const char *eol)
 {
-     char *full_addr;
-     char *saveptr;
-     char *index;
-     char *currentHeader;
-
-     if (parse->buf != NULL) {
-	  debug("parse object already assigned to a request\n");
-	  return -1;
-     }
-   
-     if (buflen < MIN_REQ_LEN || buflen > MAX_REQ_LEN) {
-	  debug("invalid buflen %d", buflen);
-	  return -1;
-     }
-   
-     /* Create NUL terminated tmp buffer */
-     char *tmp_buf = (char *)malloc(buflen + 1); /* including NUL */
-     memcpy(tmp_buf, buf, buflen);
-     tmp_buf[buflen] = '\0';
-   
-     index = strstr(tmp_buf, "\r\n\r\n");
-     if (index == NULL) {
-	  debug("invalid request line, no end of header\n");
-	  free(tmp_buf);
-	  return -1;
-     }
-   
-     /* Copy request line into parse->buf */
-     index = strstr(tmp_buf, "\r\n");
-     if (parse->buf == NULL) {
-	  parse->buf = (char *) malloc((index-tmp_buf)+1);
-	  parse->buflen = (index-tmp_buf)+1;
-     }
-     memcpy(parse->buf, tmp_buf, index-tmp_buf);
-     parse->buf[index-tmp_buf] = '\0';
-
-     /* Parse request line */
-     parse->method = strtok_r(parse->buf, " ", &saveptr);
-     if (parse->method == NULL) {
+     const char *method_end = (const char *)memchr(buf, ' ', eol-buf);
+     if (method_end == NULL || method_end == buf) {
 	  debug( "invalid request line, no whitespace\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
 	  return -1;
      }
-     if (strcmp (parse->method, "GET")) {
-	  debug( "invalid request line, method not 'GET': %s\n", 
-		 parse->method);
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
+     if (method_end-buf != 3 || memcmp(buf, "GET", 3)) {
+	  debug( "invalid request line, method not 'GET': %.*s\n",
+		 (int)(method_end-buf), buf);
 	  return -1;
      }
+     ParsedSpan_set(&parse->methodspan, buf, buf, method_end);
 
-     full_addr = strtok_r(NULL, " ", &saveptr);
-
-     if (full_addr == NULL) {
+     const char *uri = method_end+1;
+     const char *uri_end = (const char *)memchr(uri, ' ', eol-uri);
+     if (uri_end == NULL || uri_end == uri) {
 	  debug( "invalid request line, no full address\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
 	  return -1;
      }
 
-     parse->version = full_addr + strlen(full_addr) + 1;
-
-     if (parse->version == NULL) {
-	  debug( "invalid request line, missing version\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
+     const char *version = uri_end+1;
+     if (eol-version < 5 || strncmp (version, "HTTP/", 5)) {
+	  debug( "invalid request line, unsupported version %.*s\n",
+		 (int)(eol-version), version);
 	  return -1;
      }
-     if (strncmp (parse->version, "HTTP/", 5)) {
-	  debug( "invalid request line, unsupported version %s\n", 
-		 parse->version);
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
-     }
-
+     ParsedSpan_set(&parse->versionspan, buf, version, eol);
 
-     parse->protocol = strtok_r(full_addr, "://", &saveptr);
-     if (parse->protocol == NULL) {
+     const char *scheme_end = (const char *)memchr(uri, ':', uri_end-uri);
+     if (scheme_end == NULL || scheme_end == uri || uri_end-scheme_end < 3 ||
+	 memcmp(scheme_end, "://", 3)) {
 	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
 	  return -1;
      }
-     
-     const char *rem = full_addr + strlen(parse->protocol) + strlen("://");
-     size_t abs_uri_len = strlen(rem);
+     ParsedSpan_set(&parse->protocolspan, buf, uri, scheme_end);
 
-     parse->host = strtok_r(NULL, "/", &saveptr);
-     if (parse->host == NULL) {
-	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
-     }
-     
-     if (strlen(parse->host) == abs_uri_len) {
+     const char *host = scheme_end+3;
+     const char *path = (const char *)memchr(host, '/', uri_end-host);
+     if (path == NULL) {
 	  debug("invalid request line, missing absolute path\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
 	  return -1;
      }
-
-     parse->path = strtok_r(NULL, " ", &saveptr);
-     if (parse->path == NULL) {          // replace empty abs_path with "/"
-	  int rlen = strlen(root_abs_path);
-	  parse->path = (char *)malloc(rlen + 1);
-	  strncpy(parse->path, root_abs_path, rlen + 1);
-     } else if (strncmp(parse->path, root_abs_path, strlen(root_abs_path)) == 0) {
+     if (path+1 < uri_end && path[1] == '/') {
 	  debug("invalid request line, path cannot begin "
 		"with two slash characters\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  parse->path = NULL;
 	  return -1;
-     } else {
-	  // copy parse->path, prefix with a slash
-	  char *tmp_path = parse->path;
-	  int rlen = strlen(root_abs_path);
-	  int plen = strlen(parse->path);
-	  parse->path = (char *)malloc(rlen + plen + 1);
-	  strncpy(parse->path, root_abs_path, rlen);
-	  strncpy(parse->path + rlen, tmp_path, plen + 1);
      }
+     /* the slash ending the host starts the path */
+     ParsedSpan_set(&parse->pathspan, buf, path, uri_end);
 
-     parse->host = strtok_r(parse->host, ":", &saveptr);
-     parse->port = strtok_r(NULL, "/", &saveptr);
-
-     if (parse->host == NULL) {
+     const char *colon = (const char *)memchr(host, ':', path-host);
+     const char *host_end = colon != NULL ? colon : path;
+     if (host_end == host) {
 	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  free(parse->path);
-	  parse->buf = NULL;
-	  parse->path = NULL;
 	  return -1;
      }
-
-     if (parse->port != NULL) {
-	  int port = strtol (parse->port, (char **)NULL, 10);
-	  if (port == 0 && errno == EINVAL) {
-	       debug("invalid request line, bad port: %s\n", parse->port);
-	       free(tmp_buf);
-	       free(parse->buf);
-	       free(parse->path);
-	       parse->buf = NULL;
-	       parse->path = NULL;
-	       return -1;
+     ParsedSpan_set(&parse->hostspan, buf, host, host_end);
+
+     parse->portspan.off = path-buf;
+     parse->portspan.len = 0;
+     if (colon != NULL && colon+1 < path) {
+	  for (const char *c = colon+1; c < path; c++) {
+	       if (!isdigit((unsigned char)*c)) {
+		    debug("invalid request line, bad port: %.*s\n",
+			  (int)(path-colon-1), colon+1);
+		    return -1;
+	       }
 	  }
+	  ParsedSpan_set(&parse->portspan, buf, colon+1, path);
      }
+     return 0;
+}
+
+/* NUL terminate span inside the request copy and return its start */
+static char *ParsedSpan_terminate(char *copy, struct ParsedSpan span)
+{
+     copy[span.off+span.len] = '\0';
+     return copy+span.off;
+}
 
-   
-     /* Parse headers */
-     int ret = 0;
-     currentHeader = strstr(tmp_buf, "\r\n")+2;
-     while (currentHeader[0] != '\0' && 
-	    !(currentHeader[0] == '\r' && currentHeader[1] == '\n')) {
-	  
-	  //debug("line %s %s", parse->version, currentHeader);
+/* One copy of the request into the store, every NUL terminated field points
+ * into it. Each field is followed by a delimiter that can take the NUL,
+ * except the host whose slash starts the path, so the path is copied apart */
+static int ParsedRequest_materialize(struct ParsedRequest *parse, const char *buf)
+{
+     char *copy = ParsedRequest_alloc(parse, parse->reqlen);
+     if (!copy)
+	  return -1;
+     parse->path = ParsedRequest_strndup(parse, buf+parse->pathspan.off,
+					 parse->pathspan.len);
+     if (!parse->path)
+	  return -1;
+     memcpy(copy, buf, parse->reqlen);
+     parse->buf = copy;
+     parse->buflen = parse->reqlen;
+
+     parse->method = ParsedSpan_terminate(copy, parse->methodspan);
+     parse->protocol = ParsedSpan_terminate(copy, parse->protocolspan);
+     parse->host = ParsedSpan_terminate(copy, parse->hostspan);
+     parse->port = parse->portspan.len > 0 ?
+	  ParsedSpan_terminate(copy, parse->portspan) : NULL;
+     parse->version = ParsedSpan_terminate(copy, parse->versionspan);
+
+     for (size_t i = 0; i < parse->headersused; i++) {
+	  struct ParsedHeader *ph = parse->headers+i;
+	  ph->key = ParsedSpan_terminate(copy, ph->keyspan);
+	  ph->value = ParsedSpan_terminate(copy, ph->valuespan);
+     }
+     return 0;
+}
 
-	  if (ParsedHeader_parse(parse, currentHeader)) {
-	       ret = -1;
+static int ParsedRequest_fail(struct ParsedRequest *parse)
+{
+     parse->parsestate = PARSE_FAILED;
+     parse->headersused = 0;
+     memset(parse->known, 0, sizeof(parse->known));
+     parse->buf = NULL;
+     return -1;
+}
+
+int
+ParsedRequest_feed(struct ParsedRequest * parse, const char *buf,
+		   int buflen)
+{
+     if (parse->parsestate == PARSE_DONE || parse->parsestate == PARSE_FAILED) {
+	  debug("parse object already assigned to a request\n");
+	  return -1;
+     }
+     pthread_once(&parse_once, ParsedRequest_init);
+
+     const char *end = buf + buflen;
+     while (1) {
+	  /* each byte is checked once, an incomplete line resumes where it stopped */
+	  const char *line = buf + parse->linestart;
+	  const char *p = line + parse->scanned;
+	  if (p >= end)
 	       break;
+
+	  if (parse->parsestate == PARSE_HEADERS && parse->colon == 0) {
+	       if (p == line && *p == '\r') {
+		    /* the empty line: only now are the strings built */
+		    if (p+1 == end)
+			 break;
+		    if (p[1] != '\n') {
+			 debug("invalid request, line not ended by \\r\\n\n");
+			 return ParsedRequest_fail(parse);
+		    }
+		    parse->reqlen = p+2-buf;
+		    if (parse->reqlen > MAX_REQ_LEN ||
+			ParsedRequest_materialize(parse, buf) < 0)
+			 return ParsedRequest_fail(parse);
+		    parse->parsestate = PARSE_DONE;
+		    return parse->reqlen;
+	       }
+	       p = ParsedRequest_scan(p, end, SCAN_NAME);
+	       if (p == end) {
+		    parse->scanned = p-line;
+		    break;
+	       }
+	       if (*p != ':' || p == line) {
+		    debug("No colon found\n");
+		    return ParsedRequest_fail(parse);
+	       }
+	       parse->colon = p-line;
+	       p++;
 	  }
 
-	  currentHeader = strstr(currentHeader, "\r\n");
-	  if (currentHeader == NULL || strlen (currentHeader) < 2)
+	  /* the rest of the line up to its \r */
+	  p = ParsedRequest_scan(p, end,
+		    parse->parsestate == PARSE_REQUEST_LINE ? SCAN_LINE : SCAN_VALUE);
+	  if (p == end || (*p == '\r' && p+1 == end)) {
+	       parse->scanned = p-line;
 	       break;
+	  }
+	  if (*p != '\r' || p[1] != '\n') {
+	       debug("invalid request, bad character or line not ended by \\r\\n\n");
+	       return ParsedRequest_fail(parse);
+	  }
 
-	  currentHeader += 2;
+	  if (parse->parsestate == PARSE_REQUEST_LINE) {
+	       if (ParsedRequest_parseRequestLine(parse, buf, p) < 0)
+		    return ParsedRequest_fail(parse);
+	       parse->parsestate = PARSE_HEADERS;
+	  } else if (ParsedHeader_parse(parse, buf, line, line+parse->colon, p)) {
+	       return ParsedRequest_fail(parse);
+	  }
+	  parse->linestart = p+2-buf;
+	  parse->scanned = 0;
+	  parse->colon = 0;
+     }
+
+     if (buflen >= MAX_REQ_LEN) {
+	  debug("invalid request, longer than %d bytes\n", MAX_REQ_LEN);
+	  return ParsedRequest_fail(parse);
+     }
+     return 0;
+}
+
+/*
+   Parse request buffer
+
+   Parameters:
+   parse: ptr to a newly created ParsedRequest object
+   buf: ptr to the buffer containing the request (need not be NUL terminated)
+   and the trailing \r\n\r\n
+   buflen: length of the buffer including the trailing \r\n\r\n
+
+   Return values:
+   -1: failure
+   0: success
+*/
+int
+ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
+		    int buflen)
+{
+     if (buflen < MIN_REQ_LEN || buflen > MAX_REQ_LEN) {
+	  debug("invalid buflen %d", buflen);
+	  return -1;
+     }
+
+     int len = ParsedRequest_feed(parse, buf, buflen);
+     if (len == 0) {
+	  debug("invalid request line, no end of header\n");
+	  return -1;
      }
-     free(tmp_buf);
-     return ret;
+     return len < 0 ? -1 : 0;
 }
 
 /* 
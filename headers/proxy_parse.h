@@ -14,27 +14,85 @@
 
 #include <ctype.h>
 
+#include "arena.h"
+
 #ifndef PROXY_PARSE
 #define PROXY_PARSE
 
 #define DEBUG 1
 
-/* 
+#define PARSED_INLINE_HEADERS 16 /* headers held without allocating */
+#define PARSED_INLINE_STORE 2048 /* string bytes held without allocating */
+#define PARSED_SPILL_BLOCK 1024 /* minimum heap block once the inline store is full */
+
+/* Well known headers, resolved when a header is parsed or set so that
+   ParsedHeader_getKnown finds them without comparing names */
+#define PARSED_HEADER_OTHER 0
+#define PARSED_HEADER_HOST 1
+#define PARSED_HEADER_CONNECTION 2
+#define PARSED_HEADER_PROXY_CONNECTION 3
+#define PARSED_HEADER_CONTENT_LENGTH 4
+#define PARSED_HEADER_TRANSFER_ENCODING 5
+#define PARSED_HEADER_CONTENT_ENCODING 6
+#define PARSED_HEADER_ACCEPT_ENCODING 7
+#define PARSED_HEADER_CACHE_CONTROL 8
+#define PARSED_HEADER_PRAGMA 9
+#define PARSED_HEADER_IF_MODIFIED_SINCE 10
+#define PARSED_HEADER_IF_NONE_MATCH 11
+#define PARSED_HEADER_KNOWN 12
+
+/* ParsedRequest_feed progress */
+#define PARSE_REQUEST_LINE 0
+#define PARSE_HEADERS 1
+#define PARSE_DONE 2
+#define PARSE_FAILED 3
+
+/*
+   ParsedSpan: a view of part of a request as an offset and a length into the
+   buffer given to ParsedRequest_parse. Spans of headers added with
+   ParsedHeader_set have an offset of -1.
+*/
+struct ParsedSpan {
+     int off;
+     int len;
+};
+
+/*
+   ParsedHeader: any header after the request line is a key-value pair with the
+   format "key:value\r\n" and is maintained in the ParsedHeader array
+   within ParsedRequest
+*/
+struct ParsedHeader {
+     char * key;
+     size_t keylen;
+     char * value;
+     size_t valuelen;
+     struct ParsedSpan keyspan;
+     struct ParsedSpan valuespan; /* without surrounding whitespace */
+     unsigned int hash; /* of the lower cased key */
+     int id; /* PARSED_HEADER_*, PARSED_HEADER_OTHER for the rest */
+};
+
+/*
    ParsedRequest objects are created from parsing a buffer containing a HTTP
    request. The request buffer consists of a request line followed by a number
    of headers. Request line fields such as method, protocol etc. are stored
    explicitly. Headers such as 'Content-Length' and their values are maintained
-   in a linked list. Each node in this list is a ParsedHeader and contains a
-   key-value pair.
+   in an array of ParsedHeader key-value pairs.
+
+   Parsing does not allocate for a typical request. Every field is recorded as
+   a ParsedSpan into the caller's buffer, and the NUL terminated strings point
+   into one copy of the request kept in the inline store. The store and the
+   header array only spill to the heap for requests that do not fit them.
 
    The buf and buflen fields are used internally to maintain the parsed request
    line.
  */
 struct ParsedRequest {
-     char *method; 
-     char *protocol; 
-     char *host; 
-     char *port; 
+     char *method;
+     char *protocol;
+     char *host;
+     char *port;
      char *path;
      char *version;
      char *buf;
@@ -42,18 +100,32 @@ struct ParsedRequest {
      struct ParsedHeader *headers;
      size_t headersused;
      size_t headerslen;
-};
+     /* 1 + position of the first header with each id, 0 when absent */
+     int known[PARSED_HEADER_KNOWN];
 
-/* 
-   ParsedHeader: any header after the request line is a key-value pair with the
-   format "key:value\r\n" and is maintained in the ParsedHeader linked list
-   within ParsedRequest
-*/
-struct ParsedHeader {
-     char * key;
-     size_t keylen;
-     char * value;
-     size_t valuelen;
+     /* views into the parsed buffer, portspan has a length of 0 when absent */
+     struct ParsedSpan methodspan;
+     struct ParsedSpan protocolspan;
+     struct ParsedSpan hostspan;
+     struct ParsedSpan portspan;
+     struct ParsedSpan pathspan;
+     struct ParsedSpan versionspan;
+     int reqlen; /* bytes up to and including the empty line */
+
+     /* where ParsedRequest_feed resumes */
+     int parsestate;
+     int linestart; /* offset of the line being parsed */
+     int scanned; /* bytes of that line already checked */
+     int colon; /* offset of the colon in a header line, 0 until it is found */
+
+     /* bump storage for NUL terminated strings */
+     char *store;
+     size_t storelen;
+     size_t storeused;
+     char *spill; /* heap blocks, chained through their first bytes */
+     struct arena *arena; /* holds the request and what spills, NULL for the heap */
+     char inline_store[PARSED_INLINE_STORE];
+     struct ParsedHeader inline_headers[PARSED_INLINE_HEADERS];
 };
 
 
@@ -61,10 +133,32 @@ struct ParsedHeader {
  * request buffer */
 struct ParsedRequest* ParsedRequest_create();
 
+/* ParsedRequest_create drawing the object, and whatever outgrows its inline
+   store, from a. ParsedRequest_destroy then frees nothing, the memory goes
+   back with arena_reset */
+struct ParsedRequest* ParsedRequest_createIn(arena *a);
+
 /* Parse the request buffer in buf given that buf is of length buflen */
 int ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
 			int buflen);
 
+/* Parse a request as it arrives. buf holds every byte received so far and
+   buflen grows between calls; bytes already seen must not change. Each call
+   only looks at the bytes added since the last one. Returns the length of
+   the request including its empty line once it is complete (bytes after it
+   belong to the next request), 0 when more bytes are needed, or -1 when the
+   request is malformed or longer than 65535 bytes */
+int ParsedRequest_feed(struct ParsedRequest * parse, const char *buf,
+		       int buflen);
+
+/* Header bytes are checked by the widest scanning kernel the CPU supports.
+   Select one by name, "avx2", "sse4.2" or "scalar", before parsing starts,
+   to compare them. Returns 0 or -1 when the CPU lacks it */
+int ParsedRequest_useScanner(const char *name);
+
+/* Name of the scanning kernel in use */
+const char *ParsedRequest_scanner();
+
 /* Destroy the parsing object. */
 void ParsedRequest_destroy(struct ParsedRequest *pr);
 
@@ -95,13 +189,22 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr);
  */
 size_t ParsedHeader_headersLen(struct ParsedRequest *pr);
 
-/* Set, get, and remove null-terminated header keys and values */
+/* Set, get, and remove null-terminated header keys and values. Keys compare
+   case-insensitively, get returns the first header with the key, and remove
+   drops every one of them, moving the headers after them down */
 int ParsedHeader_set(struct ParsedRequest *pr, const char * key, 
 		      const char * value);
 struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, 
 				      const char * key);
 int ParsedHeader_remove (struct ParsedRequest *pr, const char * key);
 
+/* ParsedHeader_get for a key of keylen bytes that need not be NUL terminated */
+struct ParsedHeader* ParsedHeader_getn(struct ParsedRequest *pr, 
+				       const char * key, size_t keylen);
+
+/* First header with a PARSED_HEADER_* id, in constant time */
+struct ParsedHeader* ParsedHeader_getKnown(struct ParsedRequest *pr, int id);
+
 /* debug() prints out debugging info if DEBUG is set to 1 */
 void debug(const char * format, ...);
 
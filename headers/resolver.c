@@ -0,0 +1,342 @@
+/*
+  resolver.c -- asynchronous host name resolution with a TTL cache.
+*/
+
+#include "resolver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define NAME_RESOLVING 0 //nothing usable yet, lookups wait
+#define NAME_RESOLVED 1
+#define NAME_FAILED 2
+
+typedef struct resolver_name resolver_name;
+typedef struct hosts_entry hosts_entry;
+
+struct resolver_name {
+    char* name;
+    int state;
+    time_t expires;
+    int hits; //lookups since the last resolution
+    int queued; //1 while a resolver thread owns a job for the name
+    resolver_result result;
+    resolver_query* waiters;
+    resolver_name* next;
+    resolver_name* job_next;
+};
+
+struct hosts_entry {
+    char* name;
+    struct sockaddr_storage addr;
+    socklen_t len;
+    hosts_entry* next;
+};
+
+static pthread_mutex_t resolver_lock;
+static pthread_cond_t jobs_ready;
+static resolver_name* buckets[RESOLVER_BUCKETS];
+static int name_count;
+static resolver_name* jobs_head;
+static resolver_name* jobs_tail;
+static hosts_entry* hosts; //stub answers, NULL when DNS is used
+
+static unsigned int name_bucket(const char* name){
+    unsigned int h=2166136261u;
+    for(const char* p=name;*p;p++)
+        h=(h^(unsigned char)tolower((unsigned char)*p))*16777619u;
+    return h%RESOLVER_BUCKETS;
+}
+
+static int parse_numeric(const char* name, struct sockaddr_storage* addr, socklen_t* len){
+    memset(addr, 0, sizeof(*addr));
+    struct sockaddr_in* in4=(struct sockaddr_in*)addr;
+    if(inet_pton(AF_INET, name, &in4->sin_addr)==1){
+        in4->sin_family=AF_INET;
+        *len=sizeof(struct sockaddr_in);
+        return 0;
+    }
+    //bracketed literals come straight from URLs
+    char literal[INET6_ADDRSTRLEN];
+    const char* v6=name;
+    size_t name_len=strlen(name);
+    if(name[0]=='[' && name_len>2 && name_len-2<sizeof(literal) && name[name_len-1]==']'){
+        memcpy(literal, name+1, name_len-2);
+        literal[name_len-2]='\0';
+        v6=literal;
+    }
+    struct sockaddr_in6* in6=(struct sockaddr_in6*)addr;
+    if(inet_pton(AF_INET6, v6, &in6->sin6_addr)==1){
+        in6->sin6_family=AF_INET6;
+        *len=sizeof(struct sockaddr_in6);
+        return 0;
+    }
+    return -1;
+}
+
+//"127.0.0.1 origin.test www.origin.test", # starts a comment
+static int load_hosts(const char* path){
+    FILE* file=fopen(path, "r");
+    if(file==NULL){
+        perror("Error opening hosts file");
+        return -1;
+    }
+    char line[512];
+    while(fgets(line, sizeof(line), file)!=NULL){
+        char* comment=strchr(line, '#');
+        if(comment!=NULL)
+            *comment='\0';
+        char* save=NULL;
+        char* address=strtok_r(line, " \t\r\n", &save);
+        if(address==NULL)
+            continue;
+        struct sockaddr_storage addr;
+        socklen_t len;
+        if(parse_numeric(address, &addr, &len)<0){
+            fprintf(stderr, "Ignoring hosts entry with bad address %s\n", address);
+            continue;
+        }
+        char* name;
+        while((name=strtok_r(NULL, " \t\r\n", &save))!=NULL){
+            hosts_entry* entry=(hosts_entry*)malloc(sizeof(hosts_entry));
+            if(entry==NULL || (entry->name=strdup(name))==NULL){
+                free(entry);
+                fclose(file);
+                return -1;
+            }
+            entry->addr=addr;
+            entry->len=len;
+            //appended, so addresses keep the order of the file
+            entry->next=NULL;
+            hosts_entry** tail=&hosts;
+            while(*tail!=NULL)
+                tail=&(*tail)->next;
+            *tail=entry;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+//runs on a resolver thread without the lock
+static int resolve_name(const char* name, resolver_result* result){
+    result->count=0;
+    if(hosts!=NULL){
+        for(hosts_entry* entry=hosts;entry!=NULL && result->count<RESOLVER_MAX_ADDRS;entry=entry->next){
+            if(strcasecmp(entry->name, name)==0){
+                result->addrs[result->count]=entry->addr;
+                result->lens[result->count]=entry->len;
+                result->count++;
+            }
+        }
+        return result->count>0 ? 0 : -1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+    hints.ai_flags=AI_ADDRCONFIG;
+    struct addrinfo* info=NULL;
+    if(getaddrinfo(name, NULL, &hints, &info)!=0)
+        return -1;
+    for(struct addrinfo* ai=info;ai!=NULL && result->count<RESOLVER_MAX_ADDRS;ai=ai->ai_next){
+        if(ai->ai_addrlen>sizeof(struct sockaddr_storage))
+            continue;
+        memcpy(&result->addrs[result->count], ai->ai_addr, ai->ai_addrlen);
+        result->lens[result->count]=ai->ai_addrlen;
+        result->count++;
+    }
+    freeaddrinfo(info);
+    return result->count>0 ? 0 : -1;
+}
+
+//caller holds resolver_lock
+static void queue_job(resolver_name* entry){
+    if(entry->queued)
+        return;
+    entry->queued=1;
+    entry->job_next=NULL;
+    if(jobs_tail!=NULL)
+        jobs_tail->job_next=entry;
+    else
+        jobs_head=entry;
+    jobs_tail=entry;
+    pthread_cond_signal(&jobs_ready);
+}
+
+static void deliver(event_loop* loop, void* arg){
+    resolver_query* query=(resolver_query*)arg;
+    if(!query->cancelled)
+        query->callback(loop, query);
+    free(query);
+}
+
+static void* resolver_thread(void* arg){
+    while(1){
+        pthread_mutex_lock(&resolver_lock);
+        while(jobs_head==NULL)
+            pthread_cond_wait(&jobs_ready, &resolver_lock);
+        resolver_name* entry=jobs_head;
+        jobs_head=entry->job_next;
+        if(jobs_head==NULL)
+            jobs_tail=NULL;
+        //names are never freed while queued, so the copy outlives the unlock
+        char* name=strdup(entry->name);
+        pthread_mutex_unlock(&resolver_lock);
+
+        resolver_result result;
+        int status=name!=NULL ? resolve_name(name, &result) : -1;
+        free(name);
+
+        pthread_mutex_lock(&resolver_lock);
+        time_t now=time(NULL);
+        entry->queued=0;
+        entry->hits=0;
+        if(status==0){
+            entry->result=result;
+            entry->state=NAME_RESOLVED;
+            entry->expires=now+RESOLVER_POSITIVE_TTL;
+        }else if(entry->state!=NAME_RESOLVED || entry->expires<=now){
+            entry->state=NAME_FAILED;
+            entry->expires=now+RESOLVER_NEGATIVE_TTL;
+        }
+        //a failed background refresh keeps serving the old answer until it expires
+        resolver_query* waiters=entry->waiters;
+        entry->waiters=NULL;
+        int served_status=entry->state==NAME_RESOLVED ? 0 : -1;
+        resolver_result served=entry->result;
+        pthread_mutex_unlock(&resolver_lock);
+
+        while(waiters!=NULL){
+            resolver_query* next=waiters->next;
+            waiters->status=served_status;
+            waiters->result=served;
+            if(event_loop_post(waiters->loop, deliver, waiters)<0){
+                //the loop cannot be told, the query stays unanswered rather than touched on this thread
+                fprintf(stderr, "Error delivering resolver answer\n");
+            }
+            waiters=next;
+        }
+    }
+    return NULL;
+}
+
+int resolver_init(int threads, const char* hosts_file){
+    if(pthread_mutex_init(&resolver_lock, NULL)!=0 || pthread_cond_init(&jobs_ready, NULL)!=0){
+        fprintf(stderr, "Error initialising resolver lock\n");
+        return -1;
+    }
+    if(hosts_file!=NULL && load_hosts(hosts_file)<0)
+        return -1;
+    if(hosts_file!=NULL && hosts==NULL)
+        fprintf(stderr, "Hosts file %s has no entries, every name will fail\n", hosts_file);
+
+    if(threads<1)
+        threads=RESOLVER_THREADS;
+    for(int i=0;i<threads;i++){
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, resolver_thread, NULL)!=0){
+            fprintf(stderr, "Error starting resolver thread\n");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+//caller holds resolver_lock, drops expired names that nobody is waiting on
+static void expire_names(time_t now){
+    for(int i=0;i<RESOLVER_BUCKETS;i++){
+        resolver_name** link=&buckets[i];
+        while(*link!=NULL){
+            resolver_name* entry=*link;
+            if(!entry->queued && entry->waiters==NULL && entry->expires<=now){
+                *link=entry->next;
+                free(entry->name);
+                free(entry);
+                name_count--;
+            }else{
+                link=&entry->next;
+            }
+        }
+    }
+}
+
+int resolver_lookup(const char* name, event_loop* loop, resolver_callback callback, void* data,
+    resolver_result* result, resolver_query** query){
+    *query=NULL;
+
+    //numeric hosts never touch the cache
+    if(parse_numeric(name, &result->addrs[0], &result->lens[0])==0){
+        result->count=1;
+        return 0;
+    }
+
+    time_t now=time(NULL);
+    pthread_mutex_lock(&resolver_lock);
+    unsigned int bucket=name_bucket(name);
+    resolver_name* entry=buckets[bucket];
+    while(entry!=NULL && strcasecmp(entry->name, name)!=0)
+        entry=entry->next;
+
+    if(entry!=NULL && entry->state!=NAME_RESOLVING && entry->expires>now){
+        entry->hits++;
+        //hot names are refreshed before they expire, lookups keep the current answer meanwhile
+        if(entry->state==NAME_RESOLVED && entry->hits>=RESOLVER_HOT_HITS && entry->expires-now<=RESOLVER_REFRESH_AHEAD)
+            queue_job(entry);
+        int status=entry->state==NAME_RESOLVED ? 0 : -1;
+        if(status==0)
+            *result=entry->result;
+        pthread_mutex_unlock(&resolver_lock);
+        return status;
+    }
+
+    if(entry==NULL){
+        if(name_count>=RESOLVER_MAX_NAMES)
+            expire_names(now);
+        entry=(resolver_name*)calloc(1, sizeof(resolver_name));
+        if(entry==NULL || (entry->name=strdup(name))==NULL){
+            free(entry);
+            pthread_mutex_unlock(&resolver_lock);
+            return -1;
+        }
+        for(char* p=entry->name;*p;p++)
+            *p=tolower((unsigned char)*p);
+        entry->next=buckets[bucket];
+        buckets[bucket]=entry;
+        name_count++;
+    }
+
+    resolver_query* waiter=(resolver_query*)calloc(1, sizeof(resolver_query));
+    if(waiter==NULL){
+        pthread_mutex_unlock(&resolver_lock);
+        return -1;
+    }
+    waiter->loop=loop;
+    waiter->callback=callback;
+    waiter->data=data;
+
+    //expired or never resolved: wait for the resolution already queued or queue one
+    entry->state=NAME_RESOLVING;
+    waiter->next=entry->waiters;
+    entry->waiters=waiter;
+    queue_job(entry);
+    pthread_mutex_unlock(&resolver_lock);
+
+    *query=waiter;
+    return 1;
+}
+
+void resolver_cancel(resolver_query* query){
+    //the answer is still delivered to the loop, which frees the query without calling back
+    query->cancelled=1;
+}
@@ -0,0 +1,69 @@
+/*
+ * resolver.h -- asynchronous host name resolution with a TTL cache.
+ *
+ * Names are resolved by a small pool of resolver threads running
+ * getaddrinfo(), so a worker never blocks on DNS. Answers are cached by
+ * lowercased name: successful ones for RESOLVER_POSITIVE_TTL seconds and
+ * failures for RESOLVER_NEGATIVE_TTL seconds. Lookups of a name that is
+ * already being resolved wait for that resolution instead of starting
+ * another one. A name that keeps being looked up is refreshed in the
+ * background shortly before it expires, so hot origins never wait on DNS.
+ *
+ * With a hosts file the resolver answers only from that file, which makes
+ * the proxy testable without a real DNS server. Numeric addresses are
+ * answered directly in both modes.
+ */
+
+#include <sys/socket.h>
+
+#include "event_loop.h"
+
+#ifndef RESOLVER
+#define RESOLVER
+
+#define RESOLVER_MAX_ADDRS 8 //addresses kept per name
+#define RESOLVER_POSITIVE_TTL 60 //seconds a resolved name is cached
+#define RESOLVER_NEGATIVE_TTL 5 //seconds a failed name is cached
+#define RESOLVER_REFRESH_AHEAD 10 //seconds before expiry a hot name is refreshed
+#define RESOLVER_HOT_HITS 2 //lookups within one TTL that make a name hot
+#define RESOLVER_THREADS 2
+#define RESOLVER_MAX_NAMES 4096 //expired names are dropped beyond this
+#define RESOLVER_BUCKETS 1024
+
+/* Addresses of a name, ports are left 0 */
+typedef struct resolver_result {
+    int count;
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+    socklen_t lens[RESOLVER_MAX_ADDRS];
+} resolver_result;
+
+typedef struct resolver_query resolver_query;
+
+/* Called on the loop thread of the lookup once the name is resolved */
+typedef void (*resolver_callback)(event_loop* loop, resolver_query* query);
+
+struct resolver_query {
+    event_loop* loop;
+    resolver_callback callback;
+    void* data;
+    int cancelled; //only touched on the loop thread
+    int status; //0 resolved, -1 failed
+    resolver_result result;
+    resolver_query* next;
+};
+
+/* Start threads resolver threads (RESOLVER_THREADS when < 1). With a
+ * hosts_file, names are answered from it instead of DNS. Returns 0 or -1 */
+int resolver_init(int threads, const char* hosts_file);
+
+/* Resolve name for a connection on loop. Returns 0 with *result filled when
+ * the answer is cached, -1 when the name is known not to resolve, or 1 when
+ * the answer is pending: *query is set and callback runs later on the loop
+ * thread. The query is freed after the callback returns */
+int resolver_lookup(const char* name, event_loop* loop, resolver_callback callback, void* data,
+    resolver_result* result, resolver_query** query);
+
+/* Loop thread only: the callback of a pending query will not run */
+void resolver_cancel(resolver_query* query);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+  segment.c -- reference counted blocks of response bytes.
+*/
+
+#include "segment.h"
+
+#include "slab.h"
+
+static segment* segment_init(segment* seg, int size){
+    if(seg==NULL)
+        return NULL;
+    seg->next=NULL;
+    seg->refcount=1;
+    seg->size=size;
+    return seg;
+}
+
+segment* segment_new(int size){
+    return segment_init((segment*)slab_alloc(sizeof(segment)+size), size);
+}
+
+segment* segment_new_spare(int size){
+    return segment_init((segment*)slab_alloc_spare(sizeof(segment)+size), size);
+}
+
+void segment_ref(segment* seg){
+    __atomic_add_fetch(&seg->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void segment_release(segment* seg){
+    if(seg!=NULL && __atomic_sub_fetch(&seg->refcount, 1, __ATOMIC_ACQ_REL)==0)
+        slab_free(seg);
+}
@@ -0,0 +1,42 @@
+/*
+ * segment.h -- reference counted blocks of response bytes.
+ *
+ * An origin response is received into a chain of SEGMENT_SIZE segments.
+ * The fetch that fills them holds one reference to each, and a cache
+ * element built from the finished response takes its own references to the
+ * same segments instead of copying the bytes. Whoever drops the last
+ * reference frees the segment, so a response may leave the cache while a
+ * fetch or a reader still uses it, and the other way around.
+ *
+ * Segments are allocated from the cache's slab region (see slab.h). A full
+ * segment is exactly the largest size class.
+ */
+
+#ifndef SEGMENT
+#define SEGMENT
+
+#define SEGMENT_SIZE (16*1024)
+
+typedef struct segment segment;
+
+struct segment {
+    segment* next; //next segment of the response being received, NULL at the tail
+    int refcount;
+    int size; //capacity of data, SEGMENT_SIZE but for trimmed tails
+    char data[];
+};
+
+/* New segment with room for size bytes and one reference, NULL when out of memory */
+segment* segment_new(int size);
+
+/* segment_new() for a fetch in flight, from what the region has free or
+ * from malloc, never by making the cache evict (see slab_alloc_spare()) */
+segment* segment_new_spare(int size);
+
+/* Take another reference */
+void segment_ref(segment* seg);
+
+/* Drop a reference, the last one frees the segment */
+void segment_release(segment* seg);
+
+#endif
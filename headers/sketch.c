@@ -0,0 +1,105 @@
+/*
+  sketch.c -- approximate access frequencies for cache admission.
+*/
+
+#include "sketch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SKETCH_DEPTH 4
+#define DOORKEEPER_BITS_PER_KEY 8
+#define DOORKEEPER_PROBES 3
+
+//odd constants, one per row, so the rows pick unrelated counters for the same key
+static const uint64_t seeds[SKETCH_DEPTH]={0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL};
+
+static size_t power_of_two(size_t n){
+    size_t size=1;
+    while(size<n)
+        size<<=1;
+    return size;
+}
+
+static uint64_t mix(uint64_t hash, uint64_t seed){
+    uint64_t h=(hash+seed)*0x9e3779b97f4a7c15ULL;
+    h^=h>>32;
+    h*=0xd6e8feb86659fd93ULL;
+    return h^(h>>32);
+}
+
+int sketch_init(frequency_sketch* sketch, size_t capacity){
+    memset(sketch, 0, sizeof(*sketch));
+    if(capacity<64)
+        capacity=64;
+    //one word per tracked key holds the four counters of about four keys
+    size_t words=power_of_two(capacity);
+    size_t bits=power_of_two(capacity*DOORKEEPER_BITS_PER_KEY);
+    sketch->table=(uint64_t*)calloc(words, sizeof(uint64_t));
+    sketch->doorkeeper=(uint64_t*)calloc(bits/64, sizeof(uint64_t));
+    if(sketch->table==NULL || sketch->doorkeeper==NULL){
+        sketch_free(sketch);
+        return -1;
+    }
+    sketch->table_mask=words-1;
+    sketch->doorkeeper_mask=bits-1;
+    sketch->sample_size=capacity*SKETCH_SAMPLE_FACTOR;
+    return 0;
+}
+
+void sketch_free(frequency_sketch* sketch){
+    free(sketch->table);
+    free(sketch->doorkeeper);
+    sketch->table=NULL;
+    sketch->doorkeeper=NULL;
+}
+
+//1 when every probe bit was already set, sets them when add is 1
+static int doorkeeper_check(frequency_sketch* sketch, uint64_t hash, int add){
+    int present=1;
+    for(int i=0;i<DOORKEEPER_PROBES;i++){
+        size_t bit=(hash>>(i*21)) & sketch->doorkeeper_mask;
+        uint64_t mask=1ULL<<(bit & 63);
+        if(!(sketch->doorkeeper[bit>>6] & mask)){
+            present=0;
+            if(add)
+                sketch->doorkeeper[bit>>6]|=mask;
+        }
+    }
+    return present;
+}
+
+//halve every counter and forget the doorkeeper, so old popularity fades
+static void sketch_reset(frequency_sketch* sketch){
+    for(size_t i=0;i<=sketch->table_mask;i++)
+        sketch->table[i]=(sketch->table[i]>>1) & 0x7777777777777777ULL;
+    memset(sketch->doorkeeper, 0, (sketch->doorkeeper_mask+1)/8);
+    sketch->additions/=2;
+}
+
+void sketch_increment(frequency_sketch* sketch, uint64_t hash){
+    //a key's first access is only remembered by the doorkeeper
+    if(doorkeeper_check(sketch, hash, 1)){
+        for(int i=0;i<SKETCH_DEPTH;i++){
+            uint64_t h=mix(hash, seeds[i]);
+            uint64_t* word=&sketch->table[h & sketch->table_mask];
+            int shift=((h>>32) & 15)*4;
+            if(((*word>>shift) & 0xf)<SKETCH_MAX)
+                *word+=1ULL<<shift;
+        }
+    }
+    if(++sketch->additions>=sketch->sample_size)
+        sketch_reset(sketch);
+}
+
+int sketch_frequency(frequency_sketch* sketch, uint64_t hash){
+    int frequency=SKETCH_MAX;
+    for(int i=0;i<SKETCH_DEPTH;i++){
+        uint64_t h=mix(hash, seeds[i]);
+        int count=(sketch->table[h & sketch->table_mask]>>(((h>>32) & 15)*4)) & 0xf;
+        if(count<frequency)
+            frequency=count;
+    }
+    return frequency+doorkeeper_check(sketch, hash, 0);
+}
@@ -0,0 +1,48 @@
+/*
+ * sketch.h -- approximate access frequencies for cache admission.
+ *
+ * A count-min sketch of 4-bit counters, four per key, sixteen to a 64-bit
+ * word. A key's frequency is the smallest of its four counters, which
+ * overestimates only when every one of them collides with a more popular
+ * key.
+ *
+ * In front of the counters sits a doorkeeper, a Bloom filter of the keys
+ * seen once. A key's first access only sets its doorkeeper bits, so the
+ * long tail of keys requested a single time never touches the counters
+ * and cannot inflate the frequency of popular ones.
+ *
+ * After a sample of accesses ten times the capacity, every counter is
+ * halved and the doorkeeper cleared. The frequencies then follow recent
+ * popularity instead of all time totals.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef SKETCH
+#define SKETCH
+
+#define SKETCH_MAX 15 //largest counter value
+#define SKETCH_SAMPLE_FACTOR 10 //accesses per tracked key between two halvings
+
+typedef struct frequency_sketch {
+    uint64_t* table; //4-bit counters
+    size_t table_mask; //number of words-1, a power of two
+    uint64_t* doorkeeper; //bits set by keys seen since the last halving
+    size_t doorkeeper_mask; //number of bits-1, a power of two
+    size_t additions; //accesses counted since the last halving
+    size_t sample_size;
+} frequency_sketch;
+
+/* Size the sketch to track about capacity keys. Returns 0 or -1 */
+int sketch_init(frequency_sketch* sketch, size_t capacity);
+
+void sketch_free(frequency_sketch* sketch);
+
+/* Count an access to the key with the given cache_hash() */
+void sketch_increment(frequency_sketch* sketch, uint64_t hash);
+
+/* Estimated recent accesses to the key, 0 to SKETCH_MAX+1 */
+int sketch_frequency(frequency_sketch* sketch, uint64_t hash);
+
+#endif
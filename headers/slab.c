@@ -0,0 +1,291 @@
+/*
+  slab.c -- size-class allocator for cache memory.
+*/
+
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "segment.h"
+
+#define SLAB_MAX_CLASSES 64
+#define SLAB_MAX_CHUNK (SEGMENT_SIZE+sizeof(segment)) //largest class, exactly one full segment
+
+typedef struct slab_page {
+    struct slab_page* prev; //free page list or the class's partial list
+    struct slab_page* next;
+    int cls; //class the page is carved for, -1 while free
+    int used; //chunks handed out
+    int carved; //chunks cut so far, the rest of the page is untouched
+    void* free; //chunks given back, linked through their first word
+} slab_page;
+
+typedef struct slab_class {
+    pthread_mutex_t lock;
+    size_t chunk_size;
+    int per_page;
+    slab_page* partial; //pages with a chunk left to hand out
+    size_t pages;
+    size_t used; //chunks handed out
+    unsigned long reclaims; //times the class ran dry and asked the cache to evict
+} slab_class;
+
+static char* region;
+static size_t region_size;
+static slab_page* pages;
+static size_t page_count;
+static slab_page* free_pages;
+static size_t free_page_count;
+static pthread_mutex_t pages_lock=PTHREAD_MUTEX_INITIALIZER;
+
+static slab_class classes[SLAB_MAX_CLASSES];
+static int class_count;
+static int huge;
+static int (*reclaim_hook)(size_t size);
+
+//memory the region could not supply, updated atomically
+static unsigned long heap_allocations;
+static unsigned long heap_outstanding;
+
+static size_t round_up(size_t n, size_t unit){
+    return (n+unit-1)/unit*unit;
+}
+
+//smallest class holding size bytes, -1 when none does
+static int class_of(size_t size){
+    if(class_count==0 || size>classes[class_count-1].chunk_size)
+        return -1;
+    //few enough classes that a scan beats anything cleverer
+    int cls=0;
+    while(classes[cls].chunk_size<size)
+        cls++;
+    return cls;
+}
+
+int slab_init(size_t size, int huge_pages){
+    size=round_up(size, SLAB_HUGE_PAGE_SIZE);
+    void* mem=MAP_FAILED;
+    if(huge_pages){
+        mem=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if(mem==MAP_FAILED)
+            fprintf(stderr, "No huge pages reserved for the cache, asking for transparent ones\n");
+    }
+    huge=mem!=MAP_FAILED;
+    if(mem==MAP_FAILED){
+        mem=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(mem==MAP_FAILED)
+            return -1;
+        if(huge_pages)
+            madvise(mem, size, MADV_HUGEPAGE);
+    }
+    //touched now so the memory is the process's from the start, not faulted in under load
+    memset(mem, 0, size);
+
+    page_count=size/SLAB_PAGE_SIZE;
+    pages=(slab_page*)calloc(page_count, sizeof(slab_page));
+    if(pages==NULL){
+        munmap(mem, size);
+        return -1;
+    }
+    region=(char*)mem;
+    region_size=size;
+    free_pages=NULL;
+    for(size_t i=page_count;i-->0;){
+        pages[i].cls=-1;
+        pages[i].next=free_pages;
+        free_pages=&pages[i];
+    }
+    free_page_count=page_count;
+
+    size_t chunk=SLAB_MIN_CHUNK;
+    class_count=0;
+    while(class_count<SLAB_MAX_CLASSES){
+        if(chunk>SLAB_MAX_CHUNK || class_count==SLAB_MAX_CLASSES-1)
+            chunk=SLAB_MAX_CHUNK;
+        slab_class* c=&classes[class_count++];
+        pthread_mutex_init(&c->lock, NULL);
+        c->chunk_size=chunk;
+        c->per_page=SLAB_PAGE_SIZE/chunk;
+        if(chunk==SLAB_MAX_CHUNK)
+            break;
+        chunk=round_up(chunk*SLAB_GROWTH_PERCENT/100, 16);
+    }
+    return 0;
+}
+
+void slab_set_reclaim(int (*reclaim)(size_t size)){
+    reclaim_hook=reclaim;
+}
+
+static slab_page* page_take(){
+    pthread_mutex_lock(&pages_lock);
+    slab_page* page=free_pages;
+    if(page!=NULL){
+        free_pages=page->next;
+        free_page_count--;
+    }
+    pthread_mutex_unlock(&pages_lock);
+    return page;
+}
+
+static void page_put(slab_page* page){
+    page->cls=-1;
+    pthread_mutex_lock(&pages_lock);
+    page->prev=NULL;
+    page->next=free_pages;
+    free_pages=page;
+    free_page_count++;
+    pthread_mutex_unlock(&pages_lock);
+}
+
+static void partial_push(slab_class* c, slab_page* page){
+    page->prev=NULL;
+    page->next=c->partial;
+    if(c->partial!=NULL)
+        c->partial->prev=page;
+    c->partial=page;
+}
+
+static void partial_unlink(slab_class* c, slab_page* page){
+    if(page->prev!=NULL)
+        page->prev->next=page->next;
+    else
+        c->partial=page->next;
+    if(page->next!=NULL)
+        page->next->prev=page->prev;
+    page->prev=NULL;
+    page->next=NULL;
+}
+
+static int page_full(slab_class* c, slab_page* page){
+    return page->free==NULL && page->carved==c->per_page;
+}
+
+//a chunk of class cls, NULL when neither its pages nor the region have one
+static void* class_alloc(int cls){
+    slab_class* c=&classes[cls];
+    pthread_mutex_lock(&c->lock);
+    slab_page* page=c->partial;
+    if(page==NULL){
+        page=page_take();
+        if(page==NULL){
+            c->reclaims++;
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        page->cls=cls;
+        page->used=0;
+        page->carved=0;
+        page->free=NULL;
+        partial_push(c, page);
+        c->pages++;
+    }
+    void* chunk;
+    if(page->free!=NULL){
+        chunk=page->free;
+        page->free=*(void**)chunk;
+    }else{
+        chunk=region+(page-pages)*(size_t)SLAB_PAGE_SIZE+(size_t)page->carved*c->chunk_size;
+        page->carved++;
+    }
+    page->used++;
+    c->used++;
+    if(page_full(c, page))
+        partial_unlink(c, page);
+    pthread_mutex_unlock(&c->lock);
+    return chunk;
+}
+
+//reclaim_tries calls of the reclaim hook at most before falling back to malloc
+static void* alloc_chunk(size_t size, int reclaim_tries){
+    int cls=class_of(size);
+    if(cls>=0){
+        //the class lock is not held while the cache evicts, eviction frees into the region
+        for(int tries=0;tries<=reclaim_tries;tries++){
+            void* chunk=class_alloc(cls);
+            if(chunk!=NULL)
+                return chunk;
+            if(reclaim_hook==NULL || tries==reclaim_tries || !reclaim_hook(size))
+                break;
+        }
+    }
+    void* ptr=malloc(size);
+    if(ptr!=NULL){
+        __atomic_add_fetch(&heap_allocations, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&heap_outstanding, 1, __ATOMIC_RELAXED);
+    }
+    return ptr;
+}
+
+void* slab_alloc(size_t size){
+    return alloc_chunk(size, SLAB_RECLAIM_TRIES);
+}
+
+void* slab_alloc_spare(size_t size){
+    return alloc_chunk(size, 0);
+}
+
+int slab_owns(const void* ptr){
+    return (const char*)ptr>=region && (const char*)ptr<region+region_size;
+}
+
+void slab_free(void* ptr){
+    if(ptr==NULL)
+        return;
+    if(!slab_owns(ptr)){
+        __atomic_sub_fetch(&heap_outstanding, 1, __ATOMIC_RELAXED);
+        free(ptr);
+        return;
+    }
+    //the page keeps its class for as long as one of its chunks is out, so reading it unlocked is safe
+    slab_page* page=&pages[((char*)ptr-region)/SLAB_PAGE_SIZE];
+    slab_class* c=&classes[page->cls];
+    pthread_mutex_lock(&c->lock);
+    int was_full=page_full(c, page);
+    *(void**)ptr=page->free;
+    page->free=ptr;
+    page->used--;
+    c->used--;
+    if(page->used==0){
+        //an empty page goes back to the region, whichever class runs dry next can take it
+        if(!was_full)
+            partial_unlink(c, page);
+        c->pages--;
+        page_put(page);
+    }else if(was_full){
+        partial_push(c, page);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+size_t slab_chunk_size(size_t size){
+    int cls=class_of(size);
+    return cls>=0 ? classes[cls].chunk_size : round_up(size, 16);
+}
+
+void slab_print_stats(FILE* out){
+    pthread_mutex_lock(&pages_lock);
+    size_t free_count=free_page_count;
+    pthread_mutex_unlock(&pages_lock);
+    fprintf(out, "slab region %zu MB%s, %zu of %zu pages free, %lu heap allocations, %lu outstanding\n",
+        region_size>>20, huge ? " on huge pages" : "", free_count, page_count,
+        __atomic_load_n(&heap_allocations, __ATOMIC_RELAXED), __atomic_load_n(&heap_outstanding, __ATOMIC_RELAXED));
+    fprintf(out, "%-6s %10s %8s %12s %12s %10s\n", "class", "chunk", "pages", "used", "free", "reclaims");
+    for(int i=0;i<class_count;i++){
+        slab_class* c=&classes[i];
+        pthread_mutex_lock(&c->lock);
+        size_t used=c->used;
+        size_t free_chunks=c->pages*c->per_page-c->used;
+        size_t class_pages=c->pages;
+        unsigned long reclaims=c->reclaims;
+        pthread_mutex_unlock(&c->lock);
+        if(class_pages==0 && reclaims==0)
+            continue;
+        fprintf(out, "%-6d %10zu %8zu %12zu %12zu %10lu\n", i, c->chunk_size, class_pages, used, free_chunks, reclaims);
+    }
+    fflush(out);
+}
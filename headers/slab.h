@@ -0,0 +1,70 @@
+/*
+ * slab.h -- size-class allocator for cache memory.
+ *
+ * One region of the cache's size is mapped and touched at startup,
+ * optionally backed by huge pages. It is cut into SLAB_PAGE_SIZE pages, and
+ * a page is handed to one size class at a time and carved into chunks of
+ * that class's size. The classes grow by a quarter from SLAB_MIN_CHUNK up
+ * to a full segment, so a chunk wastes at most a fifth of itself and a
+ * full segment wastes nothing. A page whose chunks are all free again goes
+ * back to the region, where any class can take it.
+ *
+ * Segments and cache elements are allocated here, so what the cache
+ * accounts for an element is the size of the chunks it holds, and the
+ * process never holds more cache memory than the region. When a class has
+ * no free chunk and the region no free page, the reclaim hook registered
+ * by the cache evicts elements until one turns up. Fetches in flight only
+ * take what is free, so receiving a response never evicts the cache; the
+ * segments they took from malloc are copied into the region when the
+ * response is stored.
+ *
+ * Memory that cannot come from the region, because it is too large for any
+ * class, the region was never mapped, or reclaiming freed nothing, comes
+ * from malloc and is counted in the stats. The cache stores no element
+ * that would hold such memory.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifndef SLAB
+#define SLAB
+
+#define SLAB_PAGE_SIZE (1<<20) //unit a size class takes from the region
+#define SLAB_HUGE_PAGE_SIZE (2<<20) //the region is a multiple of this, so huge pages can back it
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH_PERCENT 125 //each class's chunk size relative to the one below
+#define SLAB_RECLAIM_TRIES 64 //reclaim hook calls one allocation may make before falling back to malloc
+
+/* Map and prefault a region of size bytes, rounded up to huge pages. With
+ * huge_pages it is backed by reserved huge pages, or failing that by
+ * transparent ones. Returns 0 or -1 */
+int slab_init(size_t size, int huge_pages);
+
+/* Register the function called when the class a chunk of size bytes comes
+ * from is exhausted. It frees what it can and returns 0 once there is
+ * nothing left to free */
+void slab_set_reclaim(int (*reclaim)(size_t size));
+
+/* size bytes from the smallest class that holds them, or from malloc */
+void* slab_alloc(size_t size);
+
+/* Like slab_alloc(), but when the class and the region are exhausted it
+ * falls back to malloc at once instead of having the cache evict. For
+ * memory the cache has not admitted, such as fetches in flight */
+void* slab_alloc_spare(size_t size);
+
+/* Return memory from slab_alloc() */
+void slab_free(void* ptr);
+
+/* 1 when ptr is a chunk of the region, 0 when it came from malloc */
+int slab_owns(const void* ptr);
+
+/* Bytes slab_alloc(size) actually takes: the class's chunk size, or size
+ * rounded up like malloc does when no class holds it */
+size_t slab_chunk_size(size_t size);
+
+/* Write region and per-class occupancy to out */
+void slab_print_stats(FILE* out);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+  upstream_pool.c -- idle keep-alive connections to origin servers.
+*/
+
+#include "upstream_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+typedef struct idle_socket idle_socket;
+typedef struct upstream_host upstream_host;
+
+struct idle_socket {
+    int fd;
+    time_t since;
+    idle_socket* next;
+};
+
+struct upstream_host {
+    char* host;
+    int port;
+    idle_socket* idle; //most recently parked first
+    int idle_count;
+    upstream_host* next;
+};
+
+static pthread_mutex_t pool_lock;
+static upstream_host* buckets[UPSTREAM_BUCKETS];
+static time_t last_expire;
+
+int upstream_pool_init(){
+    if(pthread_mutex_init(&pool_lock, NULL)!=0){
+        fprintf(stderr, "Error initialising upstream pool lock\n");
+        return -1;
+    }
+    memset(buckets, 0, sizeof(buckets));
+    last_expire=time(NULL);
+    return 0;
+}
+
+static unsigned int host_bucket(const char* host, int port){
+    unsigned int h=2166136261u;
+    for(const char* p=host;*p;p++)
+        h=(h^(unsigned char)(*p|0x20))*16777619u;
+    h=(h^port)*16777619u;
+    return h%UPSTREAM_BUCKETS;
+}
+
+//caller holds pool_lock
+static upstream_host* host_entry(const char* host, int port, int create){
+    upstream_host** bucket=&buckets[host_bucket(host, port)];
+    for(upstream_host* entry=*bucket;entry!=NULL;entry=entry->next){
+        if(entry->port==port && strcasecmp(entry->host, host)==0)
+            return entry;
+    }
+    if(!create)
+        return NULL;
+
+    upstream_host* entry=(upstream_host*)calloc(1, sizeof(upstream_host));
+    if(entry==NULL)
+        return NULL;
+    entry->host=strdup(host);
+    if(entry->host==NULL){
+        free(entry);
+        return NULL;
+    }
+    entry->port=port;
+    entry->next=*bucket;
+    *bucket=entry;
+    return entry;
+}
+
+//an idle socket must have nothing to read: EOF means the origin closed it, data means it is out of sync
+static int socket_alive(int fd){
+    char byte;
+    int n=recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n<0 && (errno==EAGAIN || errno==EWOULDBLOCK);
+}
+
+//caller holds pool_lock, closes the sockets idle since before deadline
+static void expire_host(upstream_host* entry, time_t deadline){
+    idle_socket** link=&entry->idle;
+    while(*link!=NULL){
+        idle_socket* sock=*link;
+        if(sock->since<deadline){
+            *link=sock->next;
+            close(sock->fd);
+            free(sock);
+            entry->idle_count--;
+        }else{
+            link=&sock->next;
+        }
+    }
+}
+
+//caller holds pool_lock
+static void expire_locked(time_t now){
+    last_expire=now;
+    for(int i=0;i<UPSTREAM_BUCKETS;i++){
+        for(upstream_host* entry=buckets[i];entry!=NULL;entry=entry->next)
+            expire_host(entry, now-UPSTREAM_IDLE_TIMEOUT);
+    }
+}
+
+void upstream_pool_expire(){
+    pthread_mutex_lock(&pool_lock);
+    expire_locked(time(NULL));
+    pthread_mutex_unlock(&pool_lock);
+}
+
+int upstream_pool_acquire(const char* host, int port){
+    int fd=-1;
+    time_t now=time(NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    //sweep at most once a second, piggybacking on pool traffic
+    if(now!=last_expire)
+        expire_locked(now);
+    upstream_host* entry=host_entry(host, port, 0);
+    while(entry!=NULL && entry->idle!=NULL){
+        idle_socket* sock=entry->idle;
+        entry->idle=sock->next;
+        entry->idle_count--;
+        int alive=socket_alive(sock->fd);
+        if(alive)
+            fd=sock->fd;
+        else
+            close(sock->fd);
+        free(sock);
+        if(alive)
+            break;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return fd;
+}
+
+void upstream_pool_release(const char* host, int port, int fd){
+    idle_socket* sock=(idle_socket*)malloc(sizeof(idle_socket));
+    if(sock==NULL){
+        close(fd);
+        return;
+    }
+    sock->fd=fd;
+    sock->since=time(NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    upstream_host* entry=host_entry(host, port, 1);
+    if(entry==NULL || entry->idle_count>=UPSTREAM_MAX_IDLE){
+        pthread_mutex_unlock(&pool_lock);
+        close(fd);
+        free(sock);
+        return;
+    }
+    sock->next=entry->idle;
+    entry->idle=sock;
+    entry->idle_count++;
+    pthread_mutex_unlock(&pool_lock);
+}
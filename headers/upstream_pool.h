@@ -0,0 +1,39 @@
+/*
+ * upstream_pool.h -- idle keep-alive connections to origin servers.
+ *
+ * Once a response has been read completely from an origin that allows it,
+ * the socket is parked here under its (host, port) instead of being closed,
+ * and the next request to the same origin skips DNS and the TCP handshake.
+ * Parked sockets are not registered with any event loop, so whichever
+ * worker takes one out adds it to its own.
+ *
+ * Each origin keeps at most UPSTREAM_MAX_IDLE sockets, newest first. A
+ * socket idle for longer than UPSTREAM_IDLE_TIMEOUT seconds is closed, and
+ * every socket is checked for a pending close or stray bytes before it is
+ * handed out again.
+ */
+
+#include <time.h>
+#include <pthread.h>
+
+#ifndef UPSTREAM_POOL
+#define UPSTREAM_POOL
+
+#define UPSTREAM_MAX_IDLE 8 //idle sockets kept per origin
+#define UPSTREAM_IDLE_TIMEOUT 30 //seconds before an idle socket is closed
+#define UPSTREAM_BUCKETS 256
+
+/* Initialise the pool. Returns 0 or -1 */
+int upstream_pool_init();
+
+/* Take a live idle socket to host:port out of the pool, -1 if there is none */
+int upstream_pool_acquire(const char* host, int port);
+
+/* Park a socket whose last response was read completely. The caller must
+ * have removed it from its event loop. Closed when the origin is at its limit */
+void upstream_pool_release(const char* host, int port, int fd);
+
+/* Close every socket idle for longer than UPSTREAM_IDLE_TIMEOUT */
+void upstream_pool_expire();
+
+#endif
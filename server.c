@@ -12,17 +12,36 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <signal.h>
 #include <time.h>
-#include <zlib.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
 
 #include "headers/proxy_parse.h"
-
-#define MAX_CLIENTS 400
+#include "headers/event_loop.h"
+#include "headers/cache.h"
+#include "headers/inflight.h"
+#include "headers/http_response.h"
+#include "headers/upstream_pool.h"
+#include "headers/resolver.h"
+#include "headers/connector.h"
+#include "headers/encoding.h"
+#include "headers/freshness.h"
+#include "headers/slab.h"
+#include "headers/disk_cache.h"
+
+#define MAX_CLIENTS 400 //listen backlog
 #define MAX_BYTES 4096
 
-#define MAX_SIZE 200*(1<<20) //200MB
-#define MAX_ELEMENT_SIZE 10*(1<<20) //10MB
+#define ZEROCOPY_MIN_BYTES (64*1024) //smaller hits are cheaper to copy than to track MSG_ZEROCOPY completions for
+#define CACHED_IOV 64 //segments of a cache hit handed to one sendmsg
+#define SPLICE_MIN_BYTES (64*1024) //shorter bodies are cheaper to copy than to move through pipes
+#define RELAY_PIPE_SIZE (256*1024)
+
+#define CLIENT_IDLE_TIMEOUT 15000 //milliseconds a client may take to send its next request
+#define CLIENT_MAX_REQUESTS 100 //requests served on one client connection before it is closed
+#define POOL_SWEEP_INTERVAL 1000 //milliseconds between closing expired idle origin sockets
 
 #define MAX_BLOCKED_WEBSITES 10
 
@@ -30,28 +49,139 @@ const char* blocked_websites[MAX_BLOCKED_WEBSITES] = {
     "www.blockedwebsite.com"
 };
 
-typedef struct cache_element cache_element;
-
-struct cache_element{
-    char* url;
-    char* data; 
-    int len;
-    time_t time;
-    cache_element* next;
+//phases of a proxied request, each one advanced by socket readiness on the event loop
+enum connection_state {
+    CONN_READ_REQUEST,   //collecting the request from the client
+    CONN_RESOLVE,        //waiting for the resolver to answer for the origin's name
+    CONN_CONNECT_REMOTE, //non-blocking connect to the origin in progress
+    CONN_SEND_REQUEST,   //writing the rebuilt request to the origin
+    CONN_RELAY_RESPONSE, //reading from the origin and writing to the client
+    CONN_SEND_CACHED,    //writing a pinned cache element to the client
+    CONN_FOLLOW,         //writing the response of another client's fetch as it arrives
+    CONN_SEND_DECODED,   //writing a cache element inflated for a client that does not take its coding
+    CONN_SEND_DISK,      //writing a disk cache entry to the client with sendfile
+    CONN_CLOSED
 };
 
-cache_element* head;
-int cache_element_size;
+typedef struct connection connection;
 
-cache_element* find(char* url);
-int add_cache_element(char* data, int len, char* url, ParsedRequest* request);
-void remove_cache_element();
+struct connection{
+    int state;
+    io_watcher client;
+    io_watcher remote;
+
+    char* buffer; //request bytes received from the client, pipelined requests included
+    int len;
+    int request_len; //bytes of buffer taken by the request being served
+    int keep_alive; //1 when the client may send another request after this response
+    int requests; //responses completed on this connection
+    event_timer idle_timer; //closes the connection while waiting too long for a request
+    cache_key key; //canonical cache key of the request
+    ParsedRequest* request;
+    struct arena arena; //the request, its key and the rebuilt request, reset once the response is done
+
+    char* upstream_request; //rebuilt request, kept until the response starts in case a pooled socket was stale
+    int upstream_request_len;
+    int upstream_request_pos;
+    int remote_port;
+    resolver_query* dns; //pending name lookup, NULL otherwise
+    resolver_result addrs; //addresses of the origin once resolved
+    connector connect; //connect race to the origin addresses
+    int reused; //1 when the origin socket came out of the upstream pool
+    http_framing framing; //where the origin response ends
+    size_t response_bytes; //response bytes received from the origin
+
+    char* out; //bytes waiting to be written to the client, in out_buf or in a segment of the fetch
+    char* out_buf; //read buffer for response bytes that are not captured
+    int out_len;
+    int out_pos;
+
+    int splicing; //1 while the body moves from origin to client through relay_pipe
+    int relay_pipe[2]; //-1 until a large body is first spliced on this connection
+    int capture_pipe[2]; //copy of the relayed bytes for the inflight buffer
+    int pipe_size; //capacity of both pipes
+    int pipe_len; //bytes in relay_pipe not yet sent to the client
+    disk_spool* spool; //leader only: disk copy of a spliced response too large for the memory cache
+
+    inflight* flight; //origin fetch this connection leads or follows, NULL before a miss
+    int leader; //1 when this connection reads the origin for flight
+    int client_gone; //leader whose client hung up, still reading for its followers
+    int background; //leader refreshing a cache element, it never had a client
+    inflight_cursor cursor; //follower position in the response
+    int follow_checked; //follower verified the response matches its request
+    connection* follow_prev; //followers waiting on the same loop
+    connection* follow_next;
+
+    cache_element* stale; //leader only: pinned stored response the origin is asked to revalidate
+    cache_element* cached; //pinned cache hit being sent, released once the kernel is done with it
+    response_decoder decoder; //inflates cached when the client does not take its coding
+    int decoding;
+    int cached_pos;
+    disk_entry* disk; //pinned disk hit being sent
+    size_t disk_pos;
+    int zerocopy; //1 while MSG_ZEROCOPY is used for the current hit
+    int zerocopy_enabled; //SO_ZEROCOPY has been set on the client socket
+    unsigned int zerocopy_sent; //MSG_ZEROCOPY sends the kernel may still read from
+    unsigned int zerocopy_done; //sends reported complete on the error queue
+};
 
 int port = 8080;
 int proxy_socketId; //server socket descriptor
-pthread_t threadId[MAX_CLIENTS]; //thread ID of clients
-sem_t semaphore; //Lock for creation of threads
-pthread_mutex_t mutex; //Lock for cache_element access
+int num_workers=0; //number of event loops, 0 sizes the pool to the number of cores
+int queue_size=ACCEPT_QUEUE_SIZE; //accepted sockets each worker may have waiting
+int cache_shards=CACHE_SHARDS; //independently locked slices of the cache
+int cache_policy=CACHE_POLICY_LRU; //what the cache admits and evicts, CACHE_POLICY_*
+int huge_pages=0; //1 backs the cache's slab region with huge pages
+char* disk_dir=NULL; //directory of the disk cache tier, NULL keeps the cache in memory only
+size_t disk_size=DISK_CACHE_SIZE; //MB the disk tier may take
+int single_listener=0; //1 keeps one acceptor thread feeding the workers instead of SO_REUSEPORT shards
+char* hosts_file=NULL; //answer names from this file instead of DNS, for testing
+unsigned long connect_timeout=CONNECT_TIMEOUT; //milliseconds to connect to an origin before answering 504
+worker_pool pool;
+
+//per worker state, kept in loop->data and only touched on the loop thread
+typedef struct worker {
+    connection* followers; //woken whenever a fetch they follow makes progress
+    event_timer pool_timer; //first worker only, closes expired idle origin sockets
+} worker;
+
+void read_request(event_loop* loop, connection* conn);
+void relay_response(event_loop* loop, connection* conn);
+void serve_hit(event_loop* loop, connection* conn, cache_element* element);
+void lookup_request(event_loop* loop, connection* conn, int stored);
+void send_disk(event_loop* loop, connection* conn);
+void fetch_failed(event_loop* loop, connection* conn, int status_code);
+connection* connection_new(int socket);
+
+void sweep_pool(event_loop* loop, event_timer* timer){
+    upstream_pool_expire();
+    event_loop_timer_add(loop, timer, POOL_SWEEP_INTERVAL);
+}
+
+worker* worker_of(event_loop* loop){
+    if(loop->data==NULL){
+        worker* w=(worker*)calloc(1, sizeof(worker));
+        if(w==NULL)
+            return NULL;
+        event_timer_init(&w->pool_timer, sweep_pool, NULL);
+        if(loop->id==0)
+            event_loop_timer_add(loop, &w->pool_timer, POOL_SWEEP_INTERVAL);
+        loop->data=w;
+    }
+    return (worker*)loop->data;
+}
+
+void follow_unlink(event_loop* loop, connection* conn){
+    worker* w=(worker*)loop->data;
+    if(conn->follow_prev!=NULL)
+        conn->follow_prev->follow_next=conn->follow_next;
+    else if(w!=NULL && w->followers==conn)
+        w->followers=conn->follow_next;
+    if(conn->follow_next!=NULL)
+        conn->follow_next->follow_prev=conn->follow_prev;
+    conn->follow_prev=NULL;
+    conn->follow_next=NULL;
+}
 
 int is_website_blocked(const char* host) {
     for (int i = 0; i < MAX_BLOCKED_WEBSITES; i++) {
@@ -62,53 +192,6 @@ int is_website_blocked(const char* host) {
     return 0;  // Website is not blocked
 }
 
-int decompress_data(const char* input_data, int input_len, char** output_data, int* output_len) {
-    z_stream strm;
-    memset(&strm, 0, sizeof(strm));
-
-    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) { // 16 + MAX_WBITS for automatic gzip detection
-        return -1; // Error initializing inflation
-    }
-
-    strm.avail_in = input_len;
-    strm.next_in = (unsigned char*)input_data;
-
-    *output_len = input_len * 2; // Start with a buffer twice the input size
-    *output_data = (char*)malloc(*output_len);
-    if (*output_data == NULL) {
-        inflateEnd(&strm);
-        return -1; // Memory allocation failure
-    }
-
-    strm.avail_out = *output_len;
-    strm.next_out = (unsigned char*)*output_data;
-
-    int ret = inflate(&strm, Z_NO_FLUSH);
-    while (ret == Z_OK) {
-        if (strm.avail_out == 0) { // If output buffer is full, increase its size
-            *output_len *= 2;
-            *output_data = (char*)realloc(*output_data, *output_len);
-            if (*output_data == NULL) {
-                inflateEnd(&strm);
-                return -1; // Memory allocation failure
-            }
-            strm.avail_out = *output_len - strm.avail_out;
-            strm.next_out = (unsigned char*)*output_data + strm.avail_out;
-        }
-        ret = inflate(&strm, Z_NO_FLUSH);
-    }
-
-    if (ret != Z_STREAM_END) {
-        free(*output_data);
-        inflateEnd(&strm);
-        return -1; // Decompression failed
-    }
-
-    *output_len -= strm.avail_out;
-    inflateEnd(&strm); // Cleanup
-    return 0; // Success
-}
-
 int send_error(int socket, int status_code){
     char str[1024];
     char currentTime[50];
@@ -137,16 +220,31 @@ int send_error(int socket, int status_code){
             title="404 Not Found";
             body="<BODY><H1>404 Not Found</H1>\n</BODY>";
             break;
+        case 431:
+            status_message="431 Request Header Fields Too Large";
+            title="431 Request Header Fields Too Large";
+            body="<BODY><H1>431 Request Header Fields Too Large</H1>\n</BODY>";
+            break;
         case 500:
             status_message="500 Internal Server Error";
             title="500 Internal Server Error";
             body="<BODY><H1>500 Internal Server Error</H1>\n</BODY>";
             break;
+        case 503:
+            status_message="503 Service Unavailable";
+            title="503 Service Unavailable";
+            body="<BODY><H1>503 Service Unavailable</H1>\n</BODY>";
+            break;
         case 501:
             status_message="501 Not Implemented";
             title="501 Not Implemented";
             body="<BODY><H1>501 Not Implemented</H1>\n</BODY>";
             break;
+        case 504:
+            status_message="504 Gateway Timeout";
+            title="504 Gateway Timeout";
+            body="<BODY><H1>504 Gateway Timeout</H1>\n</BODY>";
+            break;
         case 505:
             status_message="505 HTTP Version Not Supported";
             title="505 HTTP Version Not Supported";
@@ -156,16 +254,20 @@ int send_error(int socket, int status_code){
             return -1;
     }
 
+    char page[512];
+    int page_len=snprintf(page, sizeof(page), "<HTML><HEAD><TITLE>%s</TITLE></HEAD>\n%s</HTML>", title, body);
+
+    //every caller closes the client connection after the error
     snprintf(str, sizeof(str),
         "HTTP/1.1 %s\r\n"
-        "Content-Length: %ld\r\n"
+        "Content-Length: %d\r\n"
         "Content-Type: text/html\r\n"
-        "Connection: keep-alive\r\n"
+        "Connection: close\r\n"
         "Date: %s\r\n"
         "Server: TheOklama\r\n"
         "\r\n"
-        "<HTML><HEAD><TITLE>%s</TITLE></HEAD>\n%s</HTML>",
-        status_message, strlen(body) + strlen(title) + 100, currentTime, title, body);
+        "%s",
+        status_message, page_len, currentTime, page);
 
     printf("%s\n", status_message);
 
@@ -177,39 +279,770 @@ int send_error(int socket, int status_code){
     return 1;
 }
 
-int connectRemoteServer(char* host_addr, int port){
-    int remote_socket=socket(AF_INET, SOCK_STREAM, 0);
-    if(remote_socket<0){
-        printf("Error creating remote socket\n");
+//1 for HTTP/1.0 requests, whose clients cannot parse chunked framing
+int request_http10(ParsedRequest* request){
+    return request->version!=NULL && strncmp(request->version, "HTTP/1.0", 8)==0;
+}
+
+int checkHTTPversion(char* msg){
+    int v=-1;
+
+    if(strncmp(msg, "HTTP/1.1", 8)==0)
+        v=1;
+    else if(strncmp(msg, "HTTP/1.0", 8)==0)
+        v=1;
+    else
+        v=-1;
+
+    return v;
+}
+
+//drop everything that belongs to the request being served, the client socket stays open
+void close_relay_pipes(connection* conn){
+    for(int i=0;i<2;i++){
+        if(conn->relay_pipe[i]>=0)
+            close(conn->relay_pipe[i]);
+        if(conn->capture_pipe[i]>=0)
+            close(conn->capture_pipe[i]);
+        conn->relay_pipe[i]=-1;
+        conn->capture_pipe[i]=-1;
+    }
+    conn->pipe_len=0;
+}
+
+void release_request(event_loop* loop, connection* conn){
+    //closing the descriptor also removes it from the epoll set
+    if(conn->remote.fd>=0){
+        close(conn->remote.fd);
+        conn->remote.fd=-1;
+    }
+
+    if(conn->dns!=NULL){
+        resolver_cancel(conn->dns);
+        conn->dns=NULL;
+    }
+    connector_cancel(loop, &conn->connect);
+
+    if(conn->flight!=NULL){
+        //a leader going away ends the fetch, its followers see it failed
+        if(conn->leader){
+            if(__atomic_load_n(&conn->flight->state, __ATOMIC_ACQUIRE)==INFLIGHT_RUNNING)
+                inflight_finish(conn->flight, INFLIGHT_FAILED);
+        }else{
+            follow_unlink(loop, conn);
+            inflight_detach(conn->flight);
+        }
+        inflight_release(conn->flight);
+        conn->flight=NULL;
+    }
+    conn->leader=0;
+    conn->client_gone=0;
+    conn->follow_checked=0;
+    memset(&conn->cursor, 0, sizeof(conn->cursor));
+
+    cache_key_free(&conn->key);
+    conn->upstream_request=NULL;
+    conn->upstream_request_len=0;
+    conn->upstream_request_pos=0;
+    conn->reused=0;
+    conn->addrs.count=0;
+    conn->response_bytes=0;
+    http_framing_free(&conn->framing);
+    conn->out_len=0;
+    conn->out_pos=0;
+    //a response cut short may leave bytes in the pipes, they must not reach the next one
+    if(conn->pipe_len>0)
+        close_relay_pipes(conn);
+    conn->splicing=0;
+    if(conn->spool!=NULL){
+        disk_spool_finish(conn->spool, 0, 0);
+        conn->spool=NULL;
+    }
+    if(conn->request!=NULL){
+        ParsedRequest_destroy(conn->request);
+        conn->request=NULL;
+    }
+    if(conn->decoding){
+        response_decoder_free(&conn->decoder);
+        conn->decoding=0;
+    }
+    if(conn->stale!=NULL){
+        cache_element_release(conn->stale);
+        conn->stale=NULL;
+    }
+    if(conn->cached!=NULL){
+        cache_element_release(conn->cached);
+        conn->cached=NULL;
+    }
+    conn->cached_pos=0;
+    if(conn->disk!=NULL){
+        disk_entry_release(conn->disk);
+        conn->disk=NULL;
+    }
+    conn->disk_pos=0;
+    //everything above that came from the arena goes back in one step
+    arena_reset(&conn->arena);
+}
+
+void close_connection(event_loop* loop, connection* conn){
+    if(conn->state==CONN_CLOSED)
+        return;
+    conn->state=CONN_CLOSED;
+
+    event_loop_timer_cancel(loop, &conn->idle_timer);
+    release_request(loop, conn);
+    if(conn->client.fd>=0){
+        shutdown(conn->client.fd, SHUT_RDWR);
+        close(conn->client.fd);
+    }
+    free(conn->buffer);
+    free(conn->out_buf);
+    arena_free(&conn->arena);
+    close_relay_pipes(conn);
+
+    //other events for this connection may still be queued in the current batch
+    event_loop_free_later(loop, conn);
+}
+
+//the response was sent completely: wait for the next request on a persistent connection, or close
+void end_response(event_loop* loop, connection* conn, int persistent){
+    conn->requests++;
+    if(!persistent || !conn->keep_alive || conn->client_gone || conn->requests>=CLIENT_MAX_REQUESTS){
+        close_connection(loop, conn);
+        return;
+    }
+
+    release_request(loop, conn);
+    //pipelined requests that already arrived move to the front of the buffer
+    conn->len-=conn->request_len;
+    memmove(conn->buffer, conn->buffer+conn->request_len, conn->len);
+    conn->buffer[conn->len]='\0';
+    conn->request_len=0;
+
+    conn->state=CONN_READ_REQUEST;
+    event_loop_timer_add(loop, &conn->idle_timer, CLIENT_IDLE_TIMEOUT);
+    read_request(loop, conn);
+}
+
+//a client kept its connection open without sending a complete request in time
+void client_idle(event_loop* loop, event_timer* timer){
+    connection* conn=(connection*)timer->data;
+    if(conn->state==CONN_READ_REQUEST){
+        printf("Client idle, closing connection\n");
+        close_connection(loop, conn);
+    }
+}
+
+//complete is 0 when the relay broke off, a partial response must never be served from the cache
+void finish_response(event_loop* loop, connection* conn, int complete){
+    if(!complete && conn->stale!=NULL){
+        //the revalidation broke off before anything reached the client
+        fetch_failed(loop, conn, 502);
+        return;
+    }
+    if(complete){
+        //stored before the fetch leaves the inflight table, so later misses find it in the cache
+        //the element shares the segments the response was received into, explicit length as it may be binary
+        int len;
+        segment* chain=inflight_captured(conn->flight, &len);
+        if(chain!=NULL)
+            cache_store_response(chain, len, &conn->key, conn->request);
+    }
+    //a self-delimited response lets both the origin and the client connections carry another request
+    int persistent=complete && conn->framing.state==HTTP_FRAME_DONE && conn->framing.keep_alive;
+    if(conn->spool!=NULL){
+        disk_spool_finish(conn->spool, complete, persistent);
+        conn->spool=NULL;
+    }
+    conn->flight->persistent=persistent;
+    inflight_finish(conn->flight, complete ? INFLIGHT_DONE : INFLIGHT_FAILED);
+
+    //park the origin socket in the pool instead of closing it
+    if(persistent && conn->remote.fd>=0){
+        event_loop_remove(loop, &conn->remote);
+        upstream_pool_release(conn->request->host, conn->remote_port, conn->remote.fd);
+        conn->remote.fd=-1;
+    }
+    printf("Done\n");
+    if(!complete){
+        close_connection(loop, conn);
+        return;
+    }
+    end_response(loop, conn, persistent);
+}
+
+//count MSG_ZEROCOPY sends the kernel has finished with, they arrive as ranges on the error queue
+void reap_zerocopy(connection* conn){
+    char control[128];
+    while(1){
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control=control;
+        msg.msg_controllen=sizeof(control);
+        if(recvmsg(conn->client.fd, &msg, MSG_ERRQUEUE)<0)
+            return;
+
+        for(struct cmsghdr* cm=CMSG_FIRSTHDR(&msg);cm!=NULL;cm=CMSG_NXTHDR(&msg, cm)){
+            struct sock_extended_err* serr=(struct sock_extended_err*)CMSG_DATA(cm);
+            if(serr->ee_errno==0 && serr->ee_origin==SO_EE_ORIGIN_ZEROCOPY)
+                conn->zerocopy_done+=serr->ee_data-serr->ee_info+1;
+        }
+    }
+}
+
+//cache hit: write the pinned element straight from cache memory, no copy and no origin round trip
+void send_cached(event_loop* loop, connection* conn){
+    cache_element* element=conn->cached;
+
+    while(conn->cached_pos<element->len){
+        //one iovec per segment of the element
+        struct iovec iov[CACHED_IOV];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov=iov;
+        msg.msg_iovlen=cache_element_iov(element, conn->cached_pos, iov, CACHED_IOV);
+
+        int flags=MSG_NOSIGNAL;
+        if(conn->zerocopy)
+            flags|=MSG_ZEROCOPY;
+
+        int bytes_send=sendmsg(conn->client.fd, &msg, flags);
+        if(bytes_send<0){
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                return; //resumed on EPOLLOUT from the client
+            if(errno==ENOBUFS && conn->zerocopy){
+                conn->zerocopy=0; //out of pinned page budget, plain copies from here on
+                continue;
+            }
+            printf("Error sending data to client\n");
+            close_connection(loop, conn);
+            return;
+        }
+        if(flags & MSG_ZEROCOPY)
+            conn->zerocopy_sent++;
+        conn->cached_pos+=bytes_send;
+    }
+
+    //the kernel may still be reading the element, keep it pinned until every send completed
+    if(conn->zerocopy_done!=conn->zerocopy_sent){
+        reap_zerocopy(conn);
+        if(conn->zerocopy_done!=conn->zerocopy_sent)
+            return; //resumed on EPOLLERR when completions are queued
+    }
+
+    printf("Data retrived from cache_element\n\n");
+    end_response(loop, conn, element->persistent);
+}
+
+//the connect race is over, fd is the winning socket
+void remote_connected(event_loop* loop, connector* race, int fd, int timed_out){
+    connection* conn=(connection*)race->data;
+    if(fd<0){
+        fprintf(stderr, timed_out ? "Timed out connecting to remote server\n" : "Error connecting to remote server\n");
+        fetch_failed(loop, conn, timed_out ? 504 : 500);
+        return;
+    }
+
+    conn->remote.fd=fd;
+    conn->state=CONN_SEND_REQUEST;
+    //already connected, EPOLLOUT starts sending the request
+    if(event_loop_add(loop, &conn->remote, EPOLLIN | EPOLLOUT | EPOLLET)<0){
+        perror("Error registering remote socket");
+        fetch_failed(loop, conn, 500);
+    }
+}
+
+//race connects to the resolved addresses of the origin
+int connect_remote(event_loop* loop, connection* conn){
+    conn->state=CONN_CONNECT_REMOTE;
+    if(connector_start(loop, &conn->connect, &conn->addrs, conn->remote_port, connect_timeout, remote_connected, conn)<0){
+        fprintf(stderr, "Error connecting to remote server\n");
         return -1;
     }
+    return 0;
+}
 
-    //converts domain name to IP address and returns a structure
-    struct hostent *server=gethostbyname(host_addr);
-    if (server == NULL) {
+//the resolver answered a lookup that was not cached
+void remote_resolved(event_loop* loop, resolver_query* query){
+    connection* conn=(connection*)query->data;
+    conn->dns=NULL;
+    if(query->status<0){
         fprintf(stderr, "Error, no such host exists\n");
-        return -1;
+        fetch_failed(loop, conn, 500);
+        return;
     }
+    conn->addrs=query->result;
+    if(connect_remote(loop, conn)<0)
+        fetch_failed(loop, conn, 500);
+}
 
-    //stores differently when connecting and when being connected to
-    struct sockaddr_in server_address;
-    bzero((char *)&server_address, sizeof(server_address));
-    server_address.sin_family=AF_INET; //address family
-    server_address.sin_port=htons(port); //port for socket connection
-    //s_addr hold the IP address
-
-    //copying from hostent object to sockaddr_in
-    bcopy((char *)server->h_addr, (char *)&server_address.sin_addr.s_addr, server->h_length);
-    if(connect(remote_socket, (struct sockaddr*)&server_address, (socklen_t)sizeof(server_address))<0){
-        fprintf(stderr, "Error connecting to remote server\n");
+//take an idle socket to the origin from the pool, or resolve the name and connect a new one
+int open_remote(event_loop* loop, connection* conn, int use_pool){
+    conn->upstream_request_pos=0;
+    conn->response_bytes=0;
+
+    int fd=use_pool ? upstream_pool_acquire(conn->request->host, conn->remote_port) : -1;
+    conn->reused=fd>=0;
+    if(fd>=0){
+        //a pooled socket is writable right away, EPOLLOUT starts sending the request
+        conn->remote.fd=fd;
+        conn->state=CONN_SEND_REQUEST;
+        if(event_loop_add(loop, &conn->remote, EPOLLIN | EPOLLOUT | EPOLLET)<0){
+            perror("Error registering remote socket");
+            return -1;
+        }
+        return 0;
+    }
+
+    //repeat hosts are answered from the resolver cache without leaving the loop
+    if(conn->addrs.count==0){
+        int found=resolver_lookup(conn->request->host, loop, remote_resolved, conn, &conn->addrs, &conn->dns);
+        if(found<0){
+            fprintf(stderr, "Error, no such host exists\n");
+            return -1;
+        }
+        if(found>0){
+            conn->state=CONN_RESOLVE;
+            return 0;
+        }
+    }
+    return connect_remote(loop, conn);
+}
+
+//a pooled socket turned out to be dead before any response arrived, the request is safe to send again
+void retry_remote(event_loop* loop, connection* conn){
+    printf("Pooled connection closed, reconnecting\n");
+    //closing the descriptor also removes it from the epoll set
+    close(conn->remote.fd);
+    conn->remote.fd=-1;
+    http_framing_free(&conn->framing);
+
+    //never pick another pooled socket, those may be just as stale
+    if(open_remote(loop, conn, 0)<0)
+        fetch_failed(loop, conn, 500);
+}
+
+//leader: once the response head is in, tell followers whether they can share the response
+void publish_head(connection* conn){
+    inflight* flight=conn->flight;
+    size_t published=inflight_published(flight);
+    int avail=published<SEGMENT_SIZE ? (int)published : SEGMENT_SIZE;
+    const char* head=flight->head->data;
+
+    int head_len=http_response_head_len(head, avail);
+    if(head_len<0){
+        //heads larger than a segment are not worth matching, followers fetch on their own
+        if(avail==SEGMENT_SIZE)
+            inflight_set_head(flight, -1, NULL, NULL);
+        return;
+    }
+    //a 304 answers the validators of this client's request, not those of the followers
+    //and a response too large for the cache is not buffered for them, they fetch on their own
+    if(conn->framing.status==304 || (conn->framing.state==HTTP_FRAME_LENGTH &&
+        conn->response_bytes+conn->framing.remaining>(size_t)MAX_ELEMENT_SIZE)){
+        inflight_set_head(flight, -1, NULL, NULL);
+        return;
+    }
+
+    int vary_len;
+    const char* vary_value=http_response_header(head, head_len, "Vary", &vary_len);
+    if(vary_value==NULL){
+        inflight_set_head(flight, 1, NULL, NULL);
+        return;
+    }
+
+    //followers may only share a varying response if their variant key is the leader's
+    cache_key variant;
+    char* vary=cache_normalize_vary(vary_value, vary_len);
+    if(vary!=NULL && vary[0]=='\0'){
+        //only Accept-Encoding, followers are matched by the coding they take instead
+        inflight_set_head(flight, 1, NULL, NULL);
+        free(vary);
+        return;
+    }
+    if(vary==NULL || cache_key_build(&variant, conn->request, vary)<0){
+        inflight_set_head(flight, -1, NULL, NULL);
+        free(vary);
+        return;
+    }
+    inflight_set_head(flight, 1, vary, &variant);
+    cache_key_free(&variant);
+    free(vary);
+}
+
+int open_relay_pipes(connection* conn){
+    if(pipe2(conn->relay_pipe, O_NONBLOCK | O_CLOEXEC)<0){
+        conn->relay_pipe[0]=conn->relay_pipe[1]=-1;
+        return -1;
+    }
+    if(pipe2(conn->capture_pipe, O_NONBLOCK | O_CLOEXEC)<0){
+        conn->capture_pipe[0]=conn->capture_pipe[1]=-1;
+        close_relay_pipes(conn);
+        return -1;
+    }
+    //larger pipes mean fewer splices per body, the kernel may refuse and keep its default
+    fcntl(conn->relay_pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    fcntl(conn->capture_pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    int relay_size=fcntl(conn->relay_pipe[1], F_GETPIPE_SZ);
+    int capture_size=fcntl(conn->capture_pipe[1], F_GETPIPE_SZ);
+    if(relay_size<=0 || capture_size<=0){
+        close_relay_pipes(conn);
         return -1;
     }
+    //every tee has to fit the capture pipe whole
+    conn->pipe_size=relay_size<capture_size ? relay_size : capture_size;
+    return 0;
+}
+
+//too large for the memory cache: spool the response to the disk tier, from the bytes already captured on
+void start_spool(connection* conn){
+    inflight* flight=conn->flight;
+    //nobody reads along, so every byte received so far is still in the fetch's segments
+    if(!disk_cache_enabled() || flight->capturing || inflight_published(flight)!=conn->response_bytes)
+        return;
+    const char* head=flight->head->data;
+    int head_len=http_response_head_len(head, conn->response_bytes<SEGMENT_SIZE ? (int)conn->response_bytes : SEGMENT_SIZE);
+    if(head_len<0)
+        return;
+    freshness fresh;
+    time_t now=time(NULL);
+    freshness_of(head, head_len, NULL, 0, conn->request, now, &fresh);
+    if(!fresh.storable || fresh.expires<=now)
+        return;
+    //entries on disk are found under the base key only
+    int vary_len;
+    const char* vary_value=http_response_header(head, head_len, "Vary", &vary_len);
+    if(vary_value!=NULL){
+        char* vary=cache_normalize_vary(vary_value, vary_len);
+        int varies=vary==NULL || vary[0]!='\0';
+        free(vary);
+        if(varies)
+            return;
+    }
 
-    //RPC, local socket which is connected to remote socket
-    return remote_socket;
+    conn->spool=disk_spool_begin(&conn->key, head, head_len, conn->response_bytes+conn->framing.remaining);
+    if(conn->spool==NULL)
+        return;
+    size_t pos=0;
+    for(segment* seg=flight->head;seg!=NULL && pos<conn->response_bytes;seg=seg->next){
+        size_t n=conn->response_bytes-pos<(size_t)seg->size ? conn->response_bytes-pos : (size_t)seg->size;
+        if(disk_spool_write(conn->spool, seg->data, n)<0){
+            disk_spool_finish(conn->spool, 0, 0);
+            conn->spool=NULL;
+            return;
+        }
+        pos+=n;
+    }
 }
 
-int handle_request(int client_socketId, ParsedRequest *request, char* temp){
+//large bodies that only need counting skip userspace, 1 when the rest of the body is spliced
+int start_splicing(connection* conn){
+    if(conn->client_gone || http_framing_window(&conn->framing)<SPLICE_MIN_BYTES)
+        return 0;
+    if(conn->relay_pipe[0]<0 && open_relay_pipes(conn)<0)
+        return 0;
+
+    //known to be too large for the cache: unless followers read along, the bytes go straight through
+    if(conn->framing.state==HTTP_FRAME_LENGTH && conn->response_bytes+conn->framing.remaining>(size_t)MAX_ELEMENT_SIZE){
+        if(conn->flight->capturing)
+            inflight_stop_capture(conn->flight);
+        start_spool(conn);
+    }
+    conn->splicing=1;
+    return 1;
+}
+
+//origin socket to relay_pipe to client socket, the kernel moves the pages
+void relay_spliced(event_loop* loop, connection* conn){
+    while(1){
+        while(conn->pipe_len>0){
+            ssize_t bytes_send=splice(conn->relay_pipe[0], NULL, conn->client.fd, NULL, conn->pipe_len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(bytes_send<0){
+                if(errno==EAGAIN || errno==EWOULDBLOCK)
+                    return; //resumed on EPOLLOUT from the client
+                printf("Error sending data to client\n");
+                if(conn->flight->capturing && __atomic_load_n(&conn->flight->followers, __ATOMIC_RELAXED)>0){
+                    //the followers already have these bytes, read on for them without our client
+                    conn->client_gone=1;
+                    conn->splicing=0;
+                    close_relay_pipes(conn);
+                    relay_response(loop, conn);
+                    return;
+                }
+                finish_response(loop, conn, 0);
+                return;
+            }
+            conn->pipe_len-=bytes_send;
+        }
+        if(conn->framing.state==HTTP_FRAME_DONE){
+            finish_response(loop, conn, 1);
+            return;
+        }
+
+        size_t window=http_framing_window(&conn->framing);
+        if(window>(size_t)conn->pipe_size)
+            window=conn->pipe_size;
+        ssize_t bytes_recv=splice(conn->remote.fd, NULL, conn->relay_pipe[1], NULL, window,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(bytes_recv==0){
+            finish_response(loop, conn, conn->framing.state==HTTP_FRAME_CLOSE);
+            return;
+        }
+        if(bytes_recv<0){
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                return; //resumed on EPOLLIN from the origin
+            finish_response(loop, conn, 0);
+            return;
+        }
+        conn->pipe_len=bytes_recv;
+
+        //bytes someone will read are duplicated into the capture pipe, the only copy into userspace
+        if(conn->flight->capturing){
+            if(tee(conn->relay_pipe[0], conn->capture_pipe[1], bytes_recv, SPLICE_F_NONBLOCK)!=bytes_recv ||
+                inflight_append_fd(conn->flight, conn->capture_pipe[0], bytes_recv)<0){
+                printf("Error capturing response\n");
+                close_relay_pipes(conn);
+                finish_response(loop, conn, 0);
+                return;
+            }
+        }else if(conn->spool!=NULL){
+            //the same duplicate goes to the spool file, the client is served whether or not it is kept
+            ssize_t copied=tee(conn->relay_pipe[0], conn->capture_pipe[1], bytes_recv, SPLICE_F_NONBLOCK);
+            if((copied>0 && disk_spool_splice(conn->spool, conn->capture_pipe[0], copied)<0) || copied!=bytes_recv){
+                printf("Error spooling response to disk\n");
+                disk_spool_finish(conn->spool, 0, 0);
+                conn->spool=NULL;
+            }
+        }
+        http_framing_skip(&conn->framing, bytes_recv);
+        conn->response_bytes+=bytes_recv;
+    }
+}
+
+//leader: send the stale copy after all, revalidated by a 304 or standing in for a failing origin
+void serve_stale(event_loop* loop, connection* conn, int revalidated){
+    inflight* flight=conn->flight;
+    int persistent=0;
+    if(revalidated){
+        size_t published=inflight_published(flight);
+        int head_len=http_response_head_len(flight->head->data, published<SEGMENT_SIZE ? (int)published : SEGMENT_SIZE);
+        cache_refresh(conn->stale, flight->head->data, head_len);
+        persistent=conn->framing.state==HTTP_FRAME_DONE && conn->framing.keep_alive;
+    }
+
+    //followers send the stored copy too, they only wake once the fetch left the table
+    inflight_set_head(flight, 2, NULL, NULL);
+    flight->persistent=persistent;
+    inflight_finish(flight, revalidated ? INFLIGHT_DONE : INFLIGHT_FAILED);
+    inflight_release(flight);
+    conn->flight=NULL;
+    conn->leader=0;
+
+    //closing the descriptor also removes it from the epoll set
+    if(persistent){
+        event_loop_remove(loop, &conn->remote);
+        upstream_pool_release(conn->request->host, conn->remote_port, conn->remote.fd);
+    }else if(conn->remote.fd>=0){
+        close(conn->remote.fd);
+    }
+    conn->remote.fd=-1;
+
+    cache_element* element=conn->stale;
+    conn->stale=NULL;
+    printf(revalidated ? "Revalidated cache_element\n" : "Origin failed, serving stale cache_element\n");
+    if(conn->background){
+        cache_element_release(element);
+        close_connection(loop, conn);
+        return;
+    }
+    serve_hit(loop, conn, element);
+}
+
+//leader: the origin could not be reached, or the response broke off before anything was sent to the client
+void fetch_failed(event_loop* loop, connection* conn, int status_code){
+    if(conn->stale!=NULL && cache_element_usable_on_error(conn->stale, time(NULL))){
+        serve_stale(loop, conn, 0);
+        return;
+    }
+    if(!conn->background)
+        send_error(conn->client.fd, status_code);
+    close_connection(loop, conn);
+}
+
+//client write and upstream read phase: relay the origin response until either side would block
+void relay_response(event_loop* loop, connection* conn){
+    while(1){
+        //flush what is left of the last chunk before reading more, so a slow client throttles the origin
+        while(!conn->client_gone && conn->out_pos<conn->out_len){
+            int bytes_send=send(conn->client.fd, conn->out+conn->out_pos, conn->out_len-conn->out_pos, MSG_NOSIGNAL);
+            if(bytes_send<0){
+                if(errno==EAGAIN || errno==EWOULDBLOCK)
+                    return; //resumed on EPOLLOUT from the client
+                printf("Error sending data to client\n");
+                if(conn->flight->capturing && __atomic_load_n(&conn->flight->followers, __ATOMIC_RELAXED)>0){
+                    //others are still waiting on this fetch, finish it without our own client
+                    conn->client_gone=1;
+                    break;
+                }
+                finish_response(loop, conn, 0);
+                return;
+            }
+            conn->out_pos+=bytes_send;
+        }
+        //a refresh reads on while the response can still be cached, followers only while they are buffered for
+        if(conn->client_gone && (__atomic_load_n(&conn->flight->followers, __ATOMIC_RELAXED)==0 || !conn->flight->capturing) &&
+            !(conn->background && conn->flight->capturing)){
+            finish_response(loop, conn, 0);
+            return;
+        }
+        //the pipe may still hold the end of the body, relay_spliced() sends it before finishing
+        if(conn->splicing){
+            relay_spliced(loop, conn);
+            return;
+        }
+        if(conn->framing.state==HTTP_FRAME_DONE){
+            finish_response(loop, conn, 1);
+            return;
+        }
+        if(start_splicing(conn)){
+            relay_spliced(loop, conn);
+            return;
+        }
+
+        //bytes kept for followers or the cache are received straight into the fetch's segments
+        int space;
+        char* in=inflight_reserve(conn->flight, &space);
+        if(in==NULL){
+            in=conn->out_buf;
+            space=MAX_BYTES;
+        }
+        int bytes_recv=recv(conn->remote.fd, in, space, 0);
+        if(bytes_recv>0){
+            int keep=http_framing_feed(&conn->framing, in, bytes_recv);
+            if(keep<0){
+                printf("Malformed response from remote server\n");
+                finish_response(loop, conn, 0);
+                return;
+            }
+            //bytes past the end of the response mean the origin is out of step, never reuse the socket
+            if(keep<bytes_recv)
+                conn->framing.keep_alive=0;
+            conn->response_bytes+=keep;
+
+            //published to the followers and the cache, the client is sent the same bytes in place
+            if(in!=conn->out_buf)
+                inflight_commit(conn->flight, keep);
+
+            //a revalidation holds the response back until its status tells whether the stale copy is good
+            if(conn->stale!=NULL){
+                if(in==conn->out_buf){
+                    finish_response(loop, conn, 0);
+                    return;
+                }
+                if(conn->framing.state==HTTP_FRAME_HEAD){
+                    //heads larger than a segment are not worth holding
+                    if(inflight_published(conn->flight)>=SEGMENT_SIZE){
+                        finish_response(loop, conn, 0);
+                        return;
+                    }
+                    continue;
+                }
+                if(conn->framing.status==304){
+                    serve_stale(loop, conn, 1);
+                    return;
+                }
+                if(conn->framing.status>=500 && cache_element_usable_on_error(conn->stale, time(NULL))){
+                    serve_stale(loop, conn, 0);
+                    return;
+                }
+                //changed at the origin, the new response replaces the stale copy once complete
+                cache_element_release(conn->stale);
+                conn->stale=NULL;
+                in=conn->flight->head->data;
+                keep=(int)inflight_published(conn->flight);
+            }
+            if(conn->flight->head_state==0 && inflight_published(conn->flight)>0)
+                publish_head(conn);
+
+            conn->out=in;
+            conn->out_len=keep;
+            conn->out_pos=0;
+        }else if(bytes_recv==0){
+            if(conn->reused && conn->response_bytes==0){
+                //the pooled socket was closed by the origin while idle
+                retry_remote(loop, conn);
+                return;
+            }
+            //only a close delimited body may end with the connection
+            finish_response(loop, conn, conn->framing.state==HTTP_FRAME_CLOSE);
+            return;
+        }else{
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                return; //resumed on EPOLLIN from the origin
+            if(conn->reused && conn->response_bytes==0){
+                retry_remote(loop, conn);
+                return;
+            }
+            finish_response(loop, conn, 0);
+            return;
+        }
+    }
+}
+
+void send_request(event_loop* loop, connection* conn){
+    while(conn->upstream_request_pos<conn->upstream_request_len){
+        int bytes_send=send(conn->remote.fd, conn->upstream_request+conn->upstream_request_pos,
+            conn->upstream_request_len-conn->upstream_request_pos, MSG_NOSIGNAL);
+        if(bytes_send<0){
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                return;
+            if(conn->reused){
+                retry_remote(loop, conn);
+                return;
+            }
+            fprintf(stderr, "Error sending request to remote server\n");
+            fetch_failed(loop, conn, 500);
+            return;
+        }
+        conn->upstream_request_pos+=bytes_send;
+    }
+
+    if(conn->out_buf==NULL){
+        conn->out_buf=(char*)malloc(MAX_BYTES);
+        if(conn->out_buf==NULL){
+            send_error(conn->client.fd, 500);
+            close_connection(loop, conn);
+            return;
+        }
+    }
+    conn->state=CONN_RELAY_RESPONSE;
+    conn->out_len=0;
+    conn->out_pos=0;
+    http_framing_init(&conn->framing, 0);
+    relay_response(loop, conn);
+}
+
+//If-None-Match and If-Modified-Since from the ETag and Last-Modified of the stale copy
+int set_validators(connection* conn){
+    static const char* validators[][2]={{"ETag", "If-None-Match"}, {"Last-Modified", "If-Modified-Since"}};
+    const char* head=conn->stale->segments[0]->data;
+    char value[MAX_BYTES/4];
+    for(int i=0;i<2;i++){
+        ParsedHeader_remove(conn->request, validators[i][1]);
+        int len;
+        const char* stored=http_response_header(head, conn->stale->head_len, validators[i][0], &len);
+        if(stored==NULL || len>=(int)sizeof(value))
+            continue;
+        memcpy(value, stored, len);
+        value[len]='\0';
+        if(ParsedHeader_set(conn->request, validators[i][1], value)<0)
+            return -1;
+    }
+    return 0;
+}
+
+int handle_request(event_loop* loop, connection* conn){
     /*request body example:
     GET /index.html HTTP/1.1\r\n
     Host: example.com || www.example.com:8080\r\n
@@ -218,426 +1051,851 @@ int handle_request(int client_socketId, ParsedRequest *request, char* temp){
     Accept-Language: en-US,en;q=0.5 | Preffered language
     Connection: keep-alive | or close (TCP)
     */
-    char* host = request->host;
-    
-    if (is_website_blocked(host)) {
-        // Block the request by sending a 403 Forbidden response
-        send_error(client_socketId, 403);
-        return -1;  // Return early to avoid processing further
-    }
+    ParsedRequest* request = conn->request;
 
-    char* buffer=(char*)malloc(sizeof(char)*MAX_BYTES);
+    char* buffer=(char*)arena_alloc(&conn->arena, MAX_BYTES);
+    if(buffer==NULL)
+        return -1;
     strcpy(buffer, "GET ");
     strcat(buffer, request->path);
     strcat(buffer, " ");
     strcat(buffer, request->version);
-    strcat(buffer, "\r\n"); 
+    strcat(buffer, "\r\n");
 
-    if(ParsedHeader_set(request, "Connection", "close")<0){
+    //complete responses leave the origin socket in the upstream pool
+    if(ParsedHeader_set(request, "Connection", "keep-alive")<0){
         printf("Error\n");
     }
-    
+
+    //the origin answers 304 when the stale copy still matches, the client's own validators do not apply to it
+    if(conn->stale!=NULL && set_validators(conn)<0)
+        return -1;
+
     //double check for host
-    if(ParsedHeader_get(request, "Host")==NULL){
+    if(ParsedHeader_getKnown(request, PARSED_HEADER_HOST)==NULL){
         if(ParsedHeader_set(request, "Host", request->host)<0){
             printf("Error setting host\n");
         }
     }
 
-    //used to handle large string as it is unsigned int type 
+    //used to handle large string as it is unsigned int type
     size_t len=strlen(buffer);
-    if(ParsedRequest_unparse_headers(request, buffer+len, (size_t)MAX_BYTES-len)<0){
+    //the headers are written without a terminator, on a keep-alive socket stray bytes would start the next request
+    if(ParsedRequest_unparse_headers(request, buffer+len, (size_t)MAX_BYTES-len-1)<0){
         printf("Error unparse headers\n");
+        return -1;
     }
+    len+=ParsedHeader_headersLen(request);
+    buffer[len]='\0';
 
     int server_port=80; //not our server, end server. Default GET goes to 80 port
     if(request->port!=NULL){
         server_port=atoi(request->port);
     }
 
-    //socket in destination server
-    int remote_socketId=connectRemoteServer(request->host, server_port);
+    //the rebuilt request is sent once the connect completes
+    conn->upstream_request=buffer;
+    conn->upstream_request_len=len;
+    conn->remote_port=server_port;
+    return open_remote(loop, conn, 1);
+}
 
-    if(remote_socketId<0)
-        return -1;
+//leader: fetch from the origin, the response is shared through conn->flight
+void lead_fetch(event_loop* loop, connection* conn){
+    conn->leader=1;
+    if(handle_request(loop, conn)==-1)
+        fetch_failed(loop, conn, 500);
+}
 
-    //flag like wait for all data, dont determine route etc
-    int bytes_send=send(remote_socketId, buffer, strlen(buffer), 0);
-    bzero(buffer, MAX_BYTES);
+//follower: leave the shared fetch and fetch the response alone, without sharing it
+void follow_privately(event_loop* loop, connection* conn){
+    follow_unlink(loop, conn);
+    inflight_detach(conn->flight);
+    inflight_release(conn->flight);
+    //the cursor may point into the segments just let go of
+    memset(&conn->cursor, 0, sizeof(conn->cursor));
+    conn->follow_checked=0;
+    conn->flight=inflight_private(&conn->key);
+    if(conn->flight==NULL){
+        send_error(conn->client.fd, 500);
+        close_connection(loop, conn);
+        return;
+    }
+    lead_fetch(loop, conn);
+}
 
-    //-1 for terminator "\0"
-    bytes_send=recv(remote_socketId, buffer, MAX_BYTES-1, 0);
-    char* temp_buffer=(char*)malloc(sizeof(char)*MAX_BYTES);
-    int temp_buffer_size=MAX_BYTES;
-    int temp_buffer_index=0;
+//follower: stream the leader's response from the shared buffer as it grows
+void send_follow(event_loop* loop, connection* conn){
+    inflight* flight=conn->flight;
+
+    if(!conn->follow_checked){
+        int head_state=__atomic_load_n(&flight->head_state, __ATOMIC_ACQUIRE);
+        if(head_state==0)
+            return; //woken again once the leader has the head
+
+        if(head_state==2){
+            //the leader sent the stored copy, revalidated or standing in for an origin error, so does this one
+            if(__atomic_load_n(&flight->state, __ATOMIC_ACQUIRE)==INFLIGHT_RUNNING)
+                return; //woken again once the fetch has left the table
+            follow_unlink(loop, conn);
+            inflight_detach(flight);
+            inflight_release(flight);
+            conn->flight=NULL;
+            lookup_request(loop, conn, 1);
+            return;
+        }
 
-    while(bytes_send>0){
-        //send what we recieved to requested socket
-        bytes_send=send(client_socketId, buffer, bytes_send, 0);
-        
-        //copy from buffer to temp, as needed to store in cache_element since buffer will be set to zero
-        for(int i=0;i<bytes_send/sizeof(char);i++){
-            temp_buffer[temp_buffer_index]=buffer[i];
-            temp_buffer_index++;
+        int shareable=head_state>0;
+        if(shareable && flight->vary!=NULL){
+            cache_key variant;
+            shareable=cache_key_build(&variant, conn->request, flight->vary)==0 &&
+                variant.hash==flight->vary_key.hash && variant.len==flight->vary_key.len &&
+                memcmp(variant.bytes, flight->vary_key.bytes, variant.len)==0;
+            cache_key_free(&variant);
+        }
+        if(shareable){
+            //the response goes out in the coding the leader's client asked for, it has to suit this one too
+            size_t published=inflight_published(flight);
+            const char* head=flight->head->data;
+            int head_len=http_response_head_len(head, published<SEGMENT_SIZE ? (int)published : SEGMENT_SIZE);
+            shareable=head_len>0 && encoding_accepted(conn->request, head, head_len);
         }
 
-        //increase temp buffer size for good measure
-        temp_buffer_size+=MAX_BYTES;
-        temp_buffer=(char*)realloc(temp_buffer, temp_buffer_size);
+        if(!shareable){
+            if(__atomic_load_n(&flight->state, __ATOMIC_ACQUIRE)==INFLIGHT_FAILED && inflight_published(flight)==0){
+                send_error(conn->client.fd, 500);
+                close_connection(loop, conn);
+                return;
+            }
+            //a different variant or an unusable head, fetch this one ourselves without sharing it
+            follow_privately(loop, conn);
+            return;
+        }
+        conn->follow_checked=1;
+    }
 
-        if(bytes_send<0){
-            printf("Error sending data to client\n");
-            break;
+    while(1){
+        //read the state first, once it is final the published length is too
+        int state=__atomic_load_n(&flight->state, __ATOMIC_ACQUIRE);
+        //cleared after the last bytes the leader buffers are published
+        int capturing=__atomic_load_n(&flight->capturing, __ATOMIC_ACQUIRE);
+        const char* data;
+        int avail;
+        while((avail=inflight_peek(flight, &conn->cursor, &data))>0){
+            int bytes_send=send(conn->client.fd, data, avail, MSG_NOSIGNAL);
+            if(bytes_send<0){
+                if(errno==EAGAIN || errno==EWOULDBLOCK)
+                    return; //resumed on EPOLLOUT from the client
+                printf("Error sending data to client\n");
+                close_connection(loop, conn);
+                return;
+            }
+            inflight_advance(flight, &conn->cursor, bytes_send);
         }
 
-        bzero(buffer, MAX_BYTES);
-        bytes_send=recv(remote_socketId, buffer, MAX_BYTES-1, 0);
+        if(state==INFLIGHT_RUNNING && capturing)
+            return; //woken again when the leader appends
+        if(inflight_peek(flight, &conn->cursor, &data)>0)
+            continue;
+        if(!capturing){
+            //the response outgrew the buffer: start over alone if nothing was sent yet, otherwise it is cut short
+            if(conn->cursor.pos==0){
+                follow_privately(loop, conn);
+                return;
+            }
+            printf("Shared fetch outgrew its buffer, closing connection\n");
+            close_connection(loop, conn);
+            return;
+        }
+        if(state==INFLIGHT_FAILED){
+            if(conn->cursor.pos==0)
+                send_error(conn->client.fd, 500);
+            close_connection(loop, conn);
+            return;
+        }
+        printf("Done, shared fetch\n");
+        end_response(loop, conn, flight->persistent);
+        return;
     }
+}
 
-    temp_buffer[temp_buffer_index]='\0';
-    free(buffer);
-    add_cache_element(temp_buffer, strlen(temp_buffer), temp,request);
-    printf("Done\n");
-    free(temp_buffer);
-    close(remote_socketId);
+//a fetch this loop follows made progress, retry every follower parked here
+void resume_followers(event_loop* loop){
+    worker* w=(worker*)loop->data;
+    if(w==NULL)
+        return;
+    connection* conn=w->followers;
+    while(conn!=NULL){
+        connection* next=conn->follow_next;
+        send_follow(loop, conn);
+        conn=next;
+    }
+}
 
-    return 0;
+//park the connection on its loop's follower list and send what the leader has so far
+void follow_fetch(event_loop* loop, connection* conn){
+    worker* w=worker_of(loop);
+    printf("Joining fetch in flight\n");
+    conn->state=CONN_FOLLOW;
+    conn->follow_next=w->followers;
+    if(w->followers!=NULL)
+        w->followers->follow_prev=conn;
+    w->followers=conn;
+    send_follow(loop, conn);
 }
 
-int checkHTTPversion(char* msg){
-    int v=-1;
+//the inflated response is complete or broke off, keep it for later clients that need identity
+void finish_decoded(event_loop* loop, connection* conn, int complete){
+    if(complete){
+        int len;
+        segment* chain=inflight_captured(conn->flight, &len);
+        if(chain!=NULL)
+            cache_store_identity(chain, len, &conn->flight->key);
+    }
+    //a chunked response leaves the connection usable, one without chunks ends by closing it
+    int persistent=complete && conn->decoder.chunked;
+    conn->flight->persistent=persistent;
+    inflight_finish(conn->flight, complete ? INFLIGHT_DONE : INFLIGHT_FAILED);
+    if(!complete){
+        close_connection(loop, conn);
+        return;
+    }
+    printf("Data inflated from cache_element\n\n");
+    end_response(loop, conn, persistent);
+}
 
-    if(strncmp(msg, "HTTP/1.1", 8)==0)
-        v=1;
-    else if(strncmp(msg, "HTTP/1.0", 8)==0)
-        v=1;
-    else   
-        v=-1;
+//inflate the pinned element a chunk at a time as the client takes it, shared like an origin fetch
+void send_decoded(event_loop* loop, connection* conn){
+    while(1){
+        while(conn->out_pos<conn->out_len){
+            int bytes_send=send(conn->client.fd, conn->out+conn->out_pos, conn->out_len-conn->out_pos, MSG_NOSIGNAL);
+            if(bytes_send<0){
+                if(errno==EAGAIN || errno==EWOULDBLOCK)
+                    return; //resumed on EPOLLOUT from the client
+                //inflating only moves as fast as this client reads, followers see the fetch fail
+                printf("Error sending data to client\n");
+                finish_decoded(loop, conn, 0);
+                return;
+            }
+            conn->out_pos+=bytes_send;
+        }
 
-    return v;
-}   
-
-void* thread_fn(void* client_socketId){
-    //obtain semaphore lock
-    sem_wait(&semaphore);
-    int p;
-    sem_getvalue(&semaphore, &p);
-    printf("Number of clients (Semaphore value): %d\n", p);
-
-    int* t= (int*) (client_socketId);
-    int socket = *t; //typecasting void
-    int client_bytes, len;  
-
-    char *buffer=(char*)calloc(MAX_BYTES, sizeof(char));
-    bzero(buffer, MAX_BYTES);
-    //recieve data from socket, >0 recieving, 0 done, -1 error
-    //0 default, can be peek, wait fully before returning
-    client_bytes=recv(socket, buffer, MAX_BYTES, 0);
-
-    while(client_bytes>0){
-        len = strlen(buffer);
-
-        //strstr find substring in string
-        //"\r" used to move cursor to next line, carriage return 
-        if(strstr(buffer, "\r\n\r\n")==NULL)
-            client_bytes=recv(socket, buffer+len, MAX_BYTES-len, 0); 
-        else
-            break;
+        int n=response_decoder_read(&conn->decoder, conn->out_buf, MAX_BYTES);
+        if(n<0){
+            printf("Error inflating cached response\n");
+            finish_decoded(loop, conn, 0);
+            return;
+        }
+        if(n==0){
+            finish_decoded(loop, conn, 1);
+            return;
+        }
+        //copied into the fetch's segments for followers and the identity copy, stops past MAX_ELEMENT_SIZE
+        inflight_append(conn->flight, conn->out_buf, n);
+        if(conn->flight->head_state==0 && response_decoder_head_done(&conn->decoder))
+            inflight_set_head(conn->flight, 1, NULL, NULL);
+        conn->out=conn->out_buf;
+        conn->out_len=n;
+        conn->out_pos=0;
+    }
+}
+
+//hit in a coding the client does not take: inflate it once, clients asking meanwhile follow
+void start_decode(event_loop* loop, connection* conn, cache_element* element){
+    worker* w=worker_of(loop);
+    cache_key identity;
+    int leader=0;
+    int chunked=!request_http10(conn->request);
+    conn->flight=NULL;
+    if(w!=NULL && cache_identity_key(&identity, element, conn->request)==0){
+        if(chunked){
+            conn->flight=inflight_join(&identity, loop, &leader);
+        }else{
+            //inflated for this client alone and never stored, the shared and stored copies are chunked
+            conn->flight=inflight_private(&identity);
+            leader=1;
+            if(conn->flight!=NULL)
+                inflight_stop_capture(conn->flight);
+        }
+    }
+    if(conn->flight==NULL){
+        cache_element_release(element);
+        send_error(conn->client.fd, 500);
+        close_connection(loop, conn);
+        return;
+    }
+    if(!leader){
+        cache_element_release(element);
+        follow_fetch(loop, conn);
+        return;
     }
 
+    conn->leader=1;
+    conn->cached=element;
+    if(conn->out_buf==NULL)
+        conn->out_buf=(char*)malloc(MAX_BYTES);
+    if(conn->out_buf==NULL || response_decoder_init(&conn->decoder, element, chunked)<0){
+        send_error(conn->client.fd, 500);
+        close_connection(loop, conn);
+        return;
+    }
+    conn->decoding=1;
+    conn->state=CONN_SEND_DECODED;
+    conn->out_len=0;
+    conn->out_pos=0;
+    send_decoded(loop, conn);
+}
+
+//miss: become the leader of a new origin fetch or follow the one already running for the key
+void start_fetch(event_loop* loop, connection* conn){
+    worker* w=worker_of(loop);
+    int leader;
+    conn->flight=w!=NULL ? inflight_join(&conn->key, loop, &leader) : NULL;
+    if(conn->flight==NULL){
+        send_error(conn->client.fd, 500);
+        close_connection(loop, conn);
+        return;
+    }
+
+    if(leader){
+        lead_fetch(loop, conn);
+        return;
+    }
+    //only the leader revalidates, a follower is served whatever its fetch brings
+    if(conn->stale!=NULL){
+        cache_element_release(conn->stale);
+        conn->stale=NULL;
+    }
+    follow_fetch(loop, conn);
+}
+
+//hit: send the element, its identity copy, or inflate it for a client that does not take its coding
+void serve_hit(event_loop* loop, connection* conn, cache_element* element){
+    if(element->encoding!=ENCODING_IDENTITY &&
+        !encoding_accepted(conn->request, element->segments[0]->data, element->head_len)){
+        if(element->encoding!=ENCODING_GZIP && element->encoding!=ENCODING_DEFLATE){
+            //a coding the proxy cannot undo, fetch what the origin gives this client
+            cache_element_release(element);
+            start_fetch(loop, conn);
+            return;
+        }
+        //the stored identity copy is chunked, an HTTP/1.0 client is inflated one of its own
+        cache_element* inflated=request_http10(conn->request) ? NULL : cache_lookup_identity(element, conn->request);
+        if(inflated==NULL){
+            start_decode(loop, conn, element);
+            return;
+        }
+        cache_element_release(element);
+        element=inflated;
+    }
+
+    conn->cached=element;
+    conn->cached_pos=0;
+    conn->state=CONN_SEND_CACHED;
+
+    //large hits are sent without copying into the socket buffer, the pin covers the kernel's reads
+    int one=1;
+    conn->zerocopy=0;
+    if(element->len>=ZEROCOPY_MIN_BYTES && (conn->zerocopy_enabled ||
+        setsockopt(conn->client.fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))==0)){
+        conn->zerocopy=1;
+        conn->zerocopy_enabled=1;
+    }
+    send_cached(loop, conn);
+}
+
+//disk hit: the kernel sends the record from the page cache, nothing passes through userspace
+void send_disk(event_loop* loop, connection* conn){
+    disk_entry* entry=conn->disk;
+    while(conn->disk_pos<entry->len){
+        off_t offset=entry->offset+conn->disk_pos;
+        ssize_t bytes_send=sendfile(conn->client.fd, disk_entry_fd(entry), &offset, entry->len-conn->disk_pos);
+        if(bytes_send<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+            return; //resumed on EPOLLOUT from the client
+        if(bytes_send<=0){
+            printf("Error sending data to client\n");
+            close_connection(loop, conn);
+            return;
+        }
+        conn->disk_pos+=bytes_send;
+    }
+
+    printf("Data retrived from disk cache\n\n");
+    end_response(loop, conn, entry->persistent);
+}
+
+//memory miss: send a fresh response from the disk tier, 1 when one is sent. stored sends any stored copy
+int serve_disk(event_loop* loop, connection* conn, int stored){
+    disk_entry* entry=disk_cache_lookup(&conn->key);
+    if(entry==NULL)
+        return 0;
+    //entries are never revalidated, a stale one is fetched again and replaced
+    int usable=stored || (time(NULL)<entry->expires && !freshness_request_revalidates(conn->request));
+    if(usable && entry->encoding!=ENCODING_IDENTITY){
+        //the head is only read back to tell whether the client takes the coding
+        char* head=(char*)arena_alloc(&conn->arena, entry->head_len);
+        usable=head!=NULL && pread(disk_entry_fd(entry), head, entry->head_len, entry->offset)==entry->head_len &&
+            encoding_accepted(conn->request, head, entry->head_len);
+    }
+    if(!usable){
+        disk_entry_release(entry);
+        return 0;
+    }
+
+    conn->disk=entry;
+    conn->disk_pos=0;
+    conn->state=CONN_SEND_DISK;
+    send_disk(loop, conn);
+    return 1;
+}
+
+//refresh element from the origin with a connection of its own, while conn is sent the copy it has
+void start_refresh(event_loop* loop, connection* conn, cache_element* element){
+    //a fetch already running for the key refreshes it just as well
+    inflight* flight=worker_of(loop)!=NULL ? inflight_start(&conn->key) : NULL;
+    if(flight==NULL)
+        return;
+    connection* refresh=connection_new(-1);
+    if(refresh==NULL){
+        inflight_finish(flight, INFLIGHT_FAILED);
+        inflight_release(flight);
+        return;
+    }
+    refresh->flight=flight;
+    refresh->leader=1;
+    refresh->background=1;
+    refresh->client_gone=1;
+    cache_element_ref(element);
+    refresh->stale=element;
+
+    //the client's request is parsed again into the refresh's own arena
+    memcpy(refresh->buffer, conn->buffer, conn->request_len);
+    refresh->len=refresh->request_len=conn->request_len;
+    refresh->buffer[refresh->len]='\0';
+    refresh->request=ParsedRequest_createIn(&refresh->arena);
+    if(refresh->request==NULL || ParsedRequest_feed(refresh->request, refresh->buffer, refresh->len)<=0 ||
+        cache_key_build(&refresh->key, refresh->request, NULL)<0){
+        close_connection(loop, refresh);
+        return;
+    }
+    printf("Refreshing cache_element in the background\n");
+    lead_fetch(loop, refresh);
+}
+
+//fresh hits are served, stale ones revalidated with the origin, misses fetched. stored sends any stored copy
+void lookup_request(event_loop* loop, connection* conn, int stored){
+    //the key is built from the parsed request, so clients differing only in other headers share entries
+    cache_key_free(&conn->key);
+    cache_element* element=cache_lookup(conn->request, &conn->key);
+    if(element==NULL){
+        if(!serve_disk(loop, conn, stored))
+            start_fetch(loop, conn);
+        return;
+    }
+
+    int use=CACHE_FRESH;
+    if(!stored)
+        use=freshness_request_revalidates(conn->request) ? CACHE_STALE : cache_element_use(element, time(NULL));
+    if(use==CACHE_STALE){
+        //sent with the stored validators, a 304 lets the copy be sent without downloading it again
+        printf("Revalidating stale cache_element\n");
+        conn->stale=element;
+        start_fetch(loop, conn);
+        return;
+    }
+    //hot and about to expire, or stale within stale-while-revalidate: this client does not wait for the origin
+    if(use==CACHE_REFRESH)
+        start_refresh(loop, conn, element);
+    serve_hit(loop, conn, element);
+}
+
+void start_request(event_loop* loop, connection* conn){
+    event_loop_timer_cancel(loop, &conn->idle_timer);
+
     printf("\n---------------Request----------------------------\n");
-	printf("%s",buffer);
+	printf("%.*s",conn->request_len,conn->buffer);
 	printf("\n--------------------------------------------\n");
 
-    //copy of buffer, good coding practice
-    char* reqCopy=(char*)malloc(strlen(buffer)*sizeof(char)+1);
-    for(int i=0;i<strlen(buffer);i++){
-        reqCopy[i]=buffer[i];
-    }
-        
-    struct cache_element* temp=find(reqCopy);
-    if(temp!=NULL){
-        int size=temp->len/sizeof(char);
-        int pos=0;
-        char response[MAX_BYTES];
-        while(pos<size){
-            bzero(response, MAX_BYTES);
-            for(int i=0;i<MAX_BYTES;i++){
-                response[i]=temp->data[pos];
-                pos++;
+    //HTTP/1.1 clients keep the connection unless they ask to close it, HTTP/1.0 ones are closed after one response
+    conn->keep_alive=0;
+    if(conn->request->version!=NULL && strncmp(conn->request->version, "HTTP/1.1", 8)==0){
+        struct ParsedHeader* connection_header=ParsedHeader_getKnown(conn->request, PARSED_HEADER_CONNECTION);
+        conn->keep_alive=connection_header==NULL || strcasestr(connection_header->value, "close")==NULL;
+    }
+
+    //if true strcmp returns 0
+    if(!strcmp(conn->request->method, "GET")){
+        if(conn->request->host && conn->request->path && checkHTTPversion(conn->request->version)==1){
+            if(is_website_blocked(conn->request->host)){
+                // Block the request by sending a 403 Forbidden response
+                send_error(conn->client.fd, 403);
+                close_connection(loop, conn);
+                return;
             }
-            //send(socket, response, MAX_BYTES, 0);
-        }
-        printf("Data retrived from cache_element\n\n");
-        printf("%s\n\n", response);
-
-        ParsedRequest* request = ParsedRequest_create();
-        if (ParsedRequest_parse(request, buffer, len) < 0) {
-            printf("Error parsing request\n");
-        } else {
-            // Forward request to actual server and handle the response
-            if (!strcmp(request->method, "GET")) {
-                if (request->host && request->path && checkHTTPversion(request->version) == 1) {
-                    client_bytes = handle_request(socket, request, reqCopy);
-                    if (client_bytes == -1) {
-                        send_error(socket, 500);
-                    }
-                } else {
-                    send_error(socket, 500);
-                }
-            }else {
-                printf("Only GET for HTTP 1.0 is implemented till now\n"); 
+
+            lookup_request(loop, conn, 0);
+        }else{
+            send_error(conn->client.fd, 500);
+            close_connection(loop, conn);
+        }
+    }else {
+        printf("Only GET for HTTP 1.0 is implemented till now\n");
+        close_connection(loop, conn);
+    }
+}
+
+//client read phase: collect bytes until the end of the request headers
+void read_request(event_loop* loop, connection* conn){
+    while(1){
+        //has struct where we can store request header, parsed as the bytes arrive
+        if(conn->request==NULL && (conn->request=ParsedRequest_createIn(&conn->arena))==NULL){
+            close_connection(loop, conn);
+            return;
+        }
+        //a pipelined request may already be complete in the buffer, bytes seen before are not scanned again
+        if(conn->len>0){
+            int request_len=ParsedRequest_feed(conn->request, conn->buffer, conn->len);
+            if(request_len<0){
+                printf("Error parsing request\n");
+                close_connection(loop, conn);
+                return;
+            }
+            if(request_len>0){
+                conn->request_len=request_len;
+                start_request(loop, conn);
+                return;
             }
         }
-        ParsedRequest_destroy(request);
-    }else if(client_bytes>0){
-        len=strlen(buffer);
-        //has struct where we can store request header 
-        ParsedRequest* request= ParsedRequest_create();
+        if(conn->len==MAX_BYTES-1){
+            send_error(conn->client.fd, 431);
+            close_connection(loop, conn);
+            return;
+        }
+
+        //recieve data from socket, >0 recieving, 0 done, -1 error
+        int client_bytes=recv(conn->client.fd, conn->buffer+conn->len, MAX_BYTES-1-conn->len, 0);
 
-        //parsing, breaking it down and storing in request 
-        if(ParsedRequest_parse(request, buffer, len)<0){
-            printf("Error parsing request\n");
+        if(client_bytes>0){
+            conn->len+=client_bytes;
+            conn->buffer[conn->len]='\0';
+        }else if(client_bytes==0){
+            printf("Client disconnected\n");
+            close_connection(loop, conn);
+            return;
         }else{
-            bzero(buffer, MAX_BYTES);
-            //if true strcmp returns 0
-            if(!strcmp(request->method, "GET")){
-                if(request->host && request->path && checkHTTPversion(request->version)==1){
-                    client_bytes=handle_request(socket, request, reqCopy);
-                    if(client_bytes==-1)
-                        send_error(socket, 500);
-                }else{
-                    send_error(socket, 500);
-                }
-            }else {
-                printf("Only GET for HTTP 1.0 is implemented till now\n"); 
-            }
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                return; //resumed on the next EPOLLIN
+            perror("Error in reciving from client\n");
+            close_connection(loop, conn);
+            return;
         }
-        ParsedRequest_destroy(request);
-    }else if(client_bytes<0){
-        perror("Error in reciving from client\n");
-    }else if(client_bytes==0){
-        printf("Client disconnected\n");
     }
+}
 
-    shutdown(socket, SHUT_RDWR);
-    close(socket);
-    free(buffer);
-    sem_post(&semaphore);
-    sem_getvalue(&semaphore, &p);
-    printf("Number of clients (Semaphore value): %d\n", p);
-    free(reqCopy);
+void client_callback(event_loop* loop, io_watcher* watcher, uint32_t events){
+    connection* conn=(connection*)watcher->data;
+
+    if(conn->state==CONN_READ_REQUEST)
+        read_request(loop, conn);
+    else if(conn->state==CONN_RELAY_RESPONSE && (events & EPOLLOUT))
+        relay_response(loop, conn);
+    else if(conn->state==CONN_SEND_CACHED)
+        send_cached(loop, conn);
+    else if(conn->state==CONN_SEND_DISK)
+        send_disk(loop, conn);
+    else if(conn->state==CONN_FOLLOW && !(events & (EPOLLERR | EPOLLHUP)))
+        send_follow(loop, conn);
+    else if(conn->state==CONN_SEND_DECODED && !(events & (EPOLLERR | EPOLLHUP)))
+        send_decoded(loop, conn);
+    else if(conn->state!=CONN_CLOSED && (events & (EPOLLERR | EPOLLHUP)))
+        close_connection(loop, conn);
+}
 
-    return NULL;
-} 
+void remote_callback(event_loop* loop, io_watcher* watcher, uint32_t events){
+    connection* conn=(connection*)watcher->data;
 
+    switch(conn->state){
+        case CONN_SEND_REQUEST:
+            send_request(loop, conn);
+            break;
+        case CONN_RELAY_RESPONSE:
+            relay_response(loop, conn);
+            break;
+        default:
+            break;
+    }
+}
 
-int main(int argc, char* argv[]){
-    if(argc == 2) 
-        port = atoi(argv[1]);
-    else{
-        perror("Too few arguments");
-        exit(1);
+//connection state around a client socket, -1 for a background refresh without one
+connection* connection_new(int socket){
+    connection* conn=(connection*)calloc(1, sizeof(connection));
+    char* buffer=(char*)malloc(MAX_BYTES);
+    if(conn==NULL || buffer==NULL){
+        free(conn);
+        free(buffer);
+        return NULL;
     }
-    //printf("Starting proxy server on port %d\n", port);
 
-    if(sem_init(&semaphore, 0, MAX_CLIENTS)!=0){
-        perror("Semaphore initialisation failed");
-        exit(1);
+    conn->state=CONN_READ_REQUEST;
+    conn->buffer=buffer;
+    conn->buffer[0]='\0';
+    conn->client.fd=socket;
+    conn->client.callback=client_callback;
+    conn->client.data=conn;
+    conn->remote.fd=-1;
+    conn->remote.callback=remote_callback;
+    conn->relay_pipe[0]=conn->relay_pipe[1]=-1;
+    conn->capture_pipe[0]=conn->capture_pipe[1]=-1;
+    conn->remote.data=conn;
+    arena_init(&conn->arena);
+    event_timer_init(&conn->idle_timer, client_idle, conn);
+    return conn;
+}
+
+//runs on the loop thread for every socket handed over by the acceptor
+void accept_connection(event_loop* loop, int socket){
+    connection* conn=connection_new(socket);
+    if(conn==NULL){
+        close(socket);
+        return;
     }
+    worker_of(loop);
 
-    if(pthread_mutex_init(&mutex, NULL)!=0){
-        perror("Mutex initialisation failed");
-        exit(1);
+    //edge triggered, each phase reads or writes until EAGAIN before waiting again
+    if(event_loop_add(loop, &conn->client, EPOLLIN | EPOLLOUT | EPOLLET)<0){
+        perror("Error registering client socket");
+        close_connection(loop, conn);
+        return;
     }
+    event_loop_timer_add(loop, &conn->idle_timer, CLIENT_IDLE_TIMEOUT);
+}
 
-    printf("Semaphore and mutex initialised\n");
 
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0); //creating the server socket
+//kill -USR1 <pid> dumps per-shard cache counters, used to tune the shard count
+void* stats_thread(void* arg){
+    sigset_t stats_signals;
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
 
-    if(proxy_socketId < 0) {
+    while(1){
+        int signal_number;
+        if(sigwait(&stats_signals, &signal_number)==0){
+            cache_print_stats(stdout);
+            slab_print_stats(stdout);
+            disk_cache_print_stats(stdout);
+        }
+    }
+    return NULL;
+}
+
+//creates a listening socket on port, reuse_port lets several sockets share the port
+int create_listener(int port, int reuse_port){
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0); //creating the server socket
+
+    if(listen_socket < 0) {
         printf("Error creating socket\n");
-        exit(1);
+        return -1;
     }
 
     int reuse=1;
     //setting the socket option
     //where to set, at which level to set (socket, tcp, ip), reuse dont block, reuse
-    if(setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0) {
+    if(setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0) {
         perror("setsockopt failed\n");
     }else{
         printf("Server Socket set up succesfully!\n");
     }
 
+    //every shard binds its own socket to the same port, the kernel balances connections across them
+    if(reuse_port && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) {
+        perror("SO_REUSEPORT failed\n");
+        close(listen_socket);
+        return -1;
+    }
+
     //Store info about our server socket
     struct sockaddr_in server_address;
 
     bzero((char*) &server_address, sizeof(server_address)); //change garbage data to 0
     //sin -> socket address
-    server_address.sin_family = AF_INET; 
-    server_address.sin_addr.s_addr = INADDR_ANY; //accept any incoming messages 
-    server_address.sin_port = htons(port); //convert to network byte order big endian 
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = INADDR_ANY; //accept any incoming messages
+    server_address.sin_port = htons(port); //convert to network byte order big endian
 
-    if(bind(proxy_socketId, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
+    if(bind(listen_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
         perror("Port is not free\n");
-        exit(1);
+        close(listen_socket);
+        return -1;
     }
-    
-    printf("Proxy server started on port %d\n\n", port);
-    int listen_status = listen(proxy_socketId, MAX_CLIENTS); //listen for incoming connections
+
+    int listen_status = listen(listen_socket, MAX_CLIENTS); //listen for incoming connections
 
     if(listen_status < 0) {
         perror("Error listening\n");
-        exit(1);
+        close(listen_socket);
+        return -1;
     }
 
-    int i=0, client_len;
-    struct sockaddr client_address;
-    int connected_socketID[MAX_CLIENTS];
+    return listen_socket;
+}
 
-    while(1){
-        //accept the connection (blocking)
-        bzero((char*) &client_address, sizeof(client_address)); //zero out the address block
-        client_len = sizeof(client_address); //size of client address structure
-        connected_socketID[i] = accept(proxy_socketId, (struct sockaddr*)&client_address, (socklen_t*)&client_len);
-        if(connected_socketID[i] < 0) {
-            perror("Error accepting connection\n");
-            exit(1);
+int main(int argc, char* argv[]){
+    int opt;
+    while((opt=getopt(argc, argv, "w:q:c:p:Ld:D:sH:t:"))!=-1){
+        switch(opt){
+            case 'w':
+                num_workers=atoi(optarg);
+                break;
+            case 'q':
+                queue_size=atoi(optarg);
+                break;
+            case 'c':
+                cache_shards=atoi(optarg);
+                break;
+            case 'p':
+                cache_policy=cache_policy_of(optarg);
+                if(cache_policy<0){
+                    fprintf(stderr, "Unknown cache policy %s, use lru or tinylfu\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'L':
+                huge_pages=1;
+                break;
+            case 'd':
+                disk_dir=optarg;
+                break;
+            case 'D':
+                disk_size=strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                single_listener=1;
+                break;
+            case 'H':
+                hosts_file=optarg;
+                break;
+            case 't':
+                connect_timeout=strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-q queue size] [-c cache shards] [-p lru|tinylfu] [-L] [-d disk cache dir] [-D disk cache MB] [-s] [-H hosts file] [-t connect timeout ms] <port>\n", argv[0]);
+                exit(1);
         }
-        
-        struct sockaddr_in* client_ptr=(struct sockaddr_in*)&client_address; //converting sockaddr
-        struct in_addr ip_addr=client_ptr->sin_addr; //struct of 32 bit IP address
-        char str[INET_ADDRSTRLEN]; //len of inet address length
-        inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN); //convert IP to human readable form 
-        printf("Client connect at port %d with IP %s\n", ntohs(client_ptr->sin_port), str); //big to little endian
-
-        ///where to store, attributes (null=defualt), function to execute when thread is created, arg to pass to func
-        pthread_create(&threadId[i], NULL, thread_fn, (void*)&connected_socketID[i]); 
-        i++;
     }
 
-    close(proxy_socketId);
-    return 0;
-}
+    if(optind == argc-1)
+        port = atoi(argv[optind]);
+    else{
+        perror("Too few arguments");
+        exit(1);
+    }
+    //printf("Starting proxy server on port %d\n", port);
 
-cache_element* find(char* url){
-    cache_element* ele=NULL;
+    //a client hanging up mid-response must not kill the whole proxy
+    signal(SIGPIPE, SIG_IGN);
 
-    int temp_lock=pthread_mutex_lock(&mutex);
-    printf("cache_element lock acquired %d\n", temp_lock);
+    //the cache's memory, mapped once for the life of the process
+    if(slab_init(MAX_SIZE, huge_pages)!=0 || cache_init(cache_shards, cache_policy)!=0){
+        perror("Cache initialisation failed");
+        exit(1);
+    }
+    if(inflight_init()!=0 || upstream_pool_init()!=0 || connector_init()!=0)
+        exit(1);
 
-    if(head!=NULL){
-        ele=head;
-        while(ele!=NULL){
-            if(!strcmp(ele->url, url)){
-                printf("\nURL found\n");
-                printf("LRU time before %ld", ele->time);
-                ele->time=time(NULL);
-                printf("LRU time after %ld", ele->time);
-                break;
-            }
-            ele=ele->next;
+    printf("Cache initialised\n");
+
+    //SIGUSR1 is only ever delivered to the stats thread, every thread created below inherits the mask
+    sigset_t stats_signals;
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+    pthread_t stats_threadId;
+    if(pthread_create(&stats_threadId, NULL, stats_thread, NULL)!=0)
+        printf("Error starting stats thread\n");
+
+    //evicted elements go on to the disk tier, its thread inherits the signal mask above
+    if(disk_dir!=NULL){
+        if(disk_size<1 || disk_cache_init(disk_dir, disk_size<<20)!=0){
+            perror("Disk cache initialisation failed");
+            exit(1);
         }
-    }else{
-        printf("\nURL not found in cache_element\n");
+        cache_set_demote(disk_cache_demote);
     }
 
-    temp_lock=pthread_mutex_unlock(&mutex);
-    printf("cache_element lock released %d\n", temp_lock);
-    return ele;
-}
-
-int add_cache_element(char* data, int len, char* url, ParsedRequest *request) {
-    // Check the Content-Encoding header to decide if decompression is needed
-    char *content_encoding = (char*)ParsedHeader_get(request, "Content-Encoding");
-
-    if (content_encoding != NULL) {
-        char* decompressed_data = NULL;
-        int decompressed_len = 0;
+    //names are resolved off the workers, the threads inherit the signal mask above
+    if(resolver_init(RESOLVER_THREADS, hosts_file)!=0){
+        printf("Error starting resolver\n");
+        exit(1);
+    }
 
-        // If the content encoding is gzip or deflate, decompress the data
-        if (strcmp(content_encoding, "gzip") == 0 || strcmp(content_encoding, "deflate") == 0) {
-            if (decompress_data(data, len, &decompressed_data, &decompressed_len) != 0) {
-                printf("Error decompressing data\n");
-                return -1;
+    //fixed pool of workers, one event loop per core by default
+    if(num_workers<1)
+        num_workers=sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_workers<1)
+        num_workers=1;
+    if(queue_size<1)
+        queue_size=ACCEPT_QUEUE_SIZE;
+    if(worker_pool_start(&pool, num_workers, queue_size, accept_connection, resume_followers)<0){
+        printf("Error starting worker pool\n");
+        exit(1);
+    }
+    printf("Started %d workers\n", num_workers);
+
+    if(!single_listener){
+        //one listener per worker, pinned to its own core, no socket crosses threads
+        int cores=sysconf(_SC_NPROCESSORS_ONLN);
+        for(int j=0;j<num_workers;j++){
+            int listen_socket=create_listener(port, 1);
+            if(listen_socket<0 || event_loop_listen(&pool.loops[j], listen_socket)<0){
+                printf("Error starting listener %d\n", j);
+                exit(1);
             }
-
-            // Replace the original data with decompressed data
-            free(data);  // Free the original compressed data
-            data = decompressed_data;
-            len = decompressed_len;
+            if(cores>0 && event_loop_pin(&pool.loops[j], j%cores)!=0)
+                printf("Error pinning worker %d\n", j);
         }
+        printf("Proxy server started on port %d with %d listeners\n\n", port, num_workers);
 
-        // Remove the Content-Encoding header as it is no longer needed after decompression
-        ParsedHeader_remove(request, "Content-Encoding");
+        //the workers do all the work from here on
+        pthread_join(pool.loops[0].thread, NULL);
+        return 0;
     }
 
-    // Lock the cache mutex to ensure thread-safety while modifying the cache
-    int temp_lock = pthread_mutex_lock(&mutex);
-    printf("Add cache_element lock acquired %d\n", temp_lock);
+    proxy_socketId = create_listener(port, 0);
+    if(proxy_socketId < 0)
+        exit(1);
+    printf("Proxy server started on port %d\n\n", port);
 
-    // Check if the cache size exceeds the maximum allowed size
-    int ele_size = len + 1 + strlen(url) + sizeof(cache_element);
-    if (ele_size > MAX_ELEMENT_SIZE) {
-        pthread_mutex_unlock(&mutex); // Release lock if size exceeds limit
-        printf("Cache size exceeded\n");
-        return 0;
-    } else {
-        // Make room for new cache elements if necessary
-        while (cache_element_size + ele_size > MAX_SIZE) {
-            remove_cache_element();  // Remove least recently used cache element
-        }
-
-        // Create and populate a new cache element
-        cache_element* element = (cache_element*)malloc(sizeof(cache_element));
-        element->data = (char*)malloc(len + 1);
-        strcpy(element->data, data);  // Store the decompressed data
-        element->url = (char*)malloc(strlen(url) + 1);
-        strcpy(element->url, url);    // Store the URL
-        element->len = len;
-        element->time = time(NULL);
-        element->next = head;         // Insert the new element at the head of the cache
-        head = element;
-        cache_element_size += ele_size;
-
-        // Optionally print cache info
-        /*
-        printf("\n\nData added to cache\n");
-        printf("URL: %s\n", element->url);
-        printf("Length: %d\n", element->len);
-        printf("Time: %ld\n", element->time);
-        */
-
-        // Release lock after modifying the cache
-        pthread_mutex_unlock(&mutex);
-        return 1;
-    }
-}
-
-void remove_cache_element(){
-    cache_element *p, *q, *temp;
-    int temp_lock=pthread_mutex_lock(&mutex);
-    printf("Remove cache_element lock acquired %d\n", temp_lock);
-
-    if(head!=NULL){
-        for(q=head, p=head, temp=head;q->next!=NULL;q=q->next){
-            if(((q->next)->time)<(temp->time)){
-                temp=q->next;
-                p=q;
-            }
+    int client_len;
+    struct sockaddr client_address;
+
+    while(1){
+        //accept the connection (blocking), the socket itself is handed over non-blocking
+        bzero((char*) &client_address, sizeof(client_address)); //zero out the address block
+        client_len = sizeof(client_address); //size of client address structure
+        int client_socketId = accept4(proxy_socketId, (struct sockaddr*)&client_address, (socklen_t*)&client_len, SOCK_NONBLOCK);
+        if(client_socketId < 0) {
+            //running out of descriptors under load must not take the proxy down
+            perror("Error accepting connection\n");
+            //accept fails at once until descriptors are freed, do not spin on it
+            if(errno==EMFILE || errno==ENFILE || errno==ENOBUFS || errno==ENOMEM)
+                usleep(ACCEPT_RETRY_MS*1000);
+            continue;
         }
 
-        if(temp==head)
-            head=head->next;
-        else   
-            p->next=temp->next;
+        struct sockaddr_in* client_ptr=(struct sockaddr_in*)&client_address; //converting sockaddr
+        struct in_addr ip_addr=client_ptr->sin_addr; //struct of 32 bit IP address
+        char str[INET_ADDRSTRLEN]; //len of inet address length
+        inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN); //convert IP to human readable form
+        printf("Client connect at port %d with IP %s\n", ntohs(client_ptr->sin_port), str); //big to little endian
 
-        cache_element_size=cache_element_size-(temp->len)-sizeof(cache_element)-strlen(temp->url)-1;
-        free(temp->data);
-        free(temp->url);
-        free(temp);
+        //the connection lives on the worker that adopts it until it is closed
+        if(worker_pool_submit(&pool, client_socketId)<0){
+            //every queue is full, shed the connection instead of letting it wait
+            send_error(client_socketId, 503);
+            close(client_socketId);
+        }
     }
 
-    temp_lock=pthread_mutex_unlock(&mutex);
-    printf("Remove cache_element lock released %d\n", temp_lock);
+    close(proxy_socketId);
+    return 0;
 }